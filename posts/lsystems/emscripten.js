@@ -17,3 +17,30 @@ var Module = {
         return canvas;
     })(),
 };
+
+// Picks a build to load. fern-mt.js is built with WASM threads and SIMD (see
+// the Makefile), and threads need SharedArrayBuffer, which browsers only allow
+// on cross-origin isolated pages. Anywhere else, or if it fails to load, the
+// single threaded fern.js is used.
+(function() {
+    // Smallest module using a SIMD instruction
+    var simd = new Uint8Array([0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1,
+        123, 3, 2, 1, 0, 10, 10, 1, 8, 0, 65, 0, 253, 15, 253, 98, 11]);
+    var threaded = self.crossOriginIsolated === true &&
+        typeof SharedArrayBuffer == "function" && WebAssembly.validate(simd);
+
+    function load(src, onerror) {
+        var script = document.createElement("script");
+        script.src = src;
+        script.onerror = onerror;
+        document.head.appendChild(script);
+    }
+    if (threaded) {
+        // Workers load the same script, which they can't find by themselves
+        // when it was added from here
+        Module.mainScriptUrlOrBlob = "fern-mt.js";
+        load("fern-mt.js", function() { load("fern.js"); });
+    } else {
+        load("fern.js");
+    }
+})();
@@ -6,6 +6,8 @@
 #include "imgui_impl_sdlrenderer.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <string>
 
 /*
@@ -37,10 +39,33 @@ SDL_Colour CreateFrom(ImVec4 iv) {
 namespace App {
 SDL_Window *window = nullptr;
 SDL_Renderer *renderer = nullptr;
-SDL_Texture *screen = nullptr;
+SDL_Texture *screen = nullptr; // The window plus SCREEN_MARGIN on each side
+
+// Window size in window coordinates, which are what events and ImGui use. On
+// high-DPI displays each of those covers g_pixel_scale pixels.
+int g_width, g_height;
+int g_pixel_width, g_pixel_height;
+float g_pixel_scale = 1;
+
+// The screen texture is bigger than the window so that panning can just show
+// a different part of it. g_scroll is where the window's top left is, in
+// pixels.
+const int SCREEN_MARGIN = 256;
+SDL_FPoint g_scroll = {SCREEN_MARGIN, SCREEN_MARGIN};
 
 bool g_alive;
 
+// Damage tracking, so idle frames neither copy the screen nor present
+bool g_dirty = true;       // screen changed since the last present
+uint64_t g_ui_hash = 0;    // of the ImGui draw data last presented
+int g_idle_frames = 0;     // frames in a row with nothing to present
+bool g_wait = false;       // the next PollEvent may block
+
+// How long PollEvent sleeps when idle. Short enough for ImGui's own timers
+// (cursor blink, tooltips), which show up as changes to the draw data.
+const int IDLE_WAIT_MS = 100;
+const int IDLE_FRAMES_BEFORE_WAIT = 3;
+
 // Call all the SDL/imgui setup functions
 void Setup(const char *name, int width, int height, SDL_WindowFlags,
            SDL_RendererFlags);
@@ -48,19 +73,43 @@ void Setup(const char *name, int width, int height, SDL_WindowFlags,
 bool Running() { return g_alive; }
 bool PollEvent(SDL_Event *e);
 
-// The ClearScreen / Present pair should be called every frame so ImGui is
-// responsive
-void ClearScreen(SDL_Colour);
+// The NewFrame / Present pair should be called every frame so ImGui is
+// responsive. Present does nothing when neither the screen texture nor the UI
+// changed, and once idle PollEvent sleeps until there's an event.
+void NewFrame();
 void Present();
 
+// Call after drawing to App::screen, so the next Present shows it
+void Invalidate() { g_dirty = true; }
+
+// Position on the screen texture of a point in window coordinates
+SDL_FPoint ToScreen(SDL_FPoint p) {
+  return {SCREEN_MARGIN + p.x * g_pixel_scale,
+          SCREEN_MARGIN + p.y * g_pixel_scale};
+}
+
+// Moves the view over the screen texture, in window coordinates. Returns
+// false, leaving the view as it was, if that would show anything outside the
+// texture, in which case the screen needs redrawing.
+bool Scroll(float dx, float dy);
+
+// Call after redrawing the screen, so the window shows its centre
+void ResetScroll() {
+  g_scroll = {SCREEN_MARGIN, SCREEN_MARGIN};
+  Invalidate();
+}
+
+// Matches the screen texture to the window, called by PollEvent whenever the
+// window changes size. The screen will need redrawing afterwards.
+void Resize();
+
 void Quit() { g_alive = false; }
 }; // namespace App
 
 void App::Setup(const char *name, int width, int height,
                 SDL_WindowFlags w_flags, SDL_RendererFlags r_flags) {
 
-  w_flags = SDL_WindowFlags(
-      w_flags & (~SDL_WINDOW_RESIZABLE)); // Resizing not currently supported
+  w_flags = SDL_WindowFlags(w_flags | SDL_WINDOW_ALLOW_HIGHDPI);
 
   App::window = SDL_CreateWindow(name, 0, 0, width, height, w_flags);
   App::renderer = SDL_CreateRenderer(window, -1, r_flags);
@@ -68,8 +117,7 @@ void App::Setup(const char *name, int width, int height,
 
   SDL_Init(SDL_INIT_VIDEO);
 
-  screen = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
-                             SDL_TEXTUREACCESS_TARGET, width, height);
+  Resize();
 
   // Setup ImGui
   IMGUI_CHECKVERSION();
@@ -95,9 +143,18 @@ bool App::PollEvent(SDL_Event *e) {
   ImGuiIO &io = ImGui::GetIO();
   bool key_stolen, mouse_stolen;
   do {
-    if (!SDL_PollEvent(e)) {
+#ifdef BUILD_WASM
+    // The browser drives frames itself, so there's no sleeping
+    const bool got_event = SDL_PollEvent(e);
+#else
+    const bool got_event =
+        g_wait ? SDL_WaitEventTimeout(e, IDLE_WAIT_MS) : SDL_PollEvent(e);
+    g_wait = false;
+#endif
+    if (!got_event) {
       return false;
     }
+    g_idle_frames = 0;
 
     ImGui_ImplSDL2_ProcessEvent(e);
     key_stolen = (e->type == SDL_KEYDOWN or e->type == SDL_KEYUP) and
@@ -112,6 +169,13 @@ bool App::PollEvent(SDL_Event *e) {
   case SDL_QUIT: {
     App::Quit();
   } break;
+  case SDL_WINDOWEVENT: {
+    // Exposed, restored etc. may have lost what was presented
+    if (e->window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+      App::Resize();
+    }
+    App::Invalidate();
+  } break;
   case SDL_KEYDOWN: {
     switch (e->key.keysym.sym) {
     case SDLK_ESCAPE: {
@@ -125,10 +189,37 @@ bool App::PollEvent(SDL_Event *e) {
   return true;
 }
 
-void App::ClearScreen(SDL_Colour clear_colour) {
-  auto [r, g, b, a] = clear_colour;
-  SDL_SetRenderDrawColor(renderer, r, g, b, a);
-  SDL_RenderClear(renderer);
+void App::Resize() {
+  SDL_GetWindowSize(window, &g_width, &g_height);
+  SDL_GetRendererOutputSize(renderer, &g_pixel_width, &g_pixel_height);
+  g_pixel_scale = g_width > 0 ? (float)g_pixel_width / g_width : 1.0f;
+
+  if (screen) {
+    SDL_DestroyTexture(screen);
+  }
+  screen = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                             SDL_TEXTUREACCESS_TARGET,
+                             g_pixel_width + 2 * SCREEN_MARGIN,
+                             g_pixel_height + 2 * SCREEN_MARGIN);
+  ResetScroll();
+}
+
+bool App::Scroll(float dx, float dy) {
+  const SDL_FPoint to = {g_scroll.x + dx * g_pixel_scale,
+                         g_scroll.y + dy * g_pixel_scale};
+  if (to.x < 0 or to.y < 0 or to.x > 2 * SCREEN_MARGIN or
+      to.y > 2 * SCREEN_MARGIN) {
+    return false;
+  }
+  g_scroll = to;
+  Invalidate();
+  return true;
+}
+
+void App::NewFrame() {
+  g_wait = g_idle_frames >= IDLE_FRAMES_BEFORE_WAIT;
+
+  // No need to clear, the screen texture covers the whole window
 
   // Begin new ImGui frame
   ImGui_ImplSDLRenderer_NewFrame();
@@ -138,11 +229,50 @@ void App::ClearScreen(SDL_Colour clear_colour) {
   // Any ImGui code called after this will show up on the next App::Present()
 }
 
+// FNV-1a over everything ImGui would draw, so an unchanged UI can be detected
+// without keeping a copy of the last frame
+uint64_t HashDrawData(const ImDrawData *dd) {
+  uint64_t h = 14695981039346656037ull;
+  auto add = [&](const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i) {
+      h = (h ^ p[i]) * 1099511628211ull;
+    }
+  };
+  add(&dd->DisplaySize, sizeof(dd->DisplaySize));
+  for (int n = 0; n < dd->CmdListsCount; ++n) {
+    const ImDrawList *list = dd->CmdLists[n];
+    add(list->VtxBuffer.Data, list->VtxBuffer.Size * sizeof(ImDrawVert));
+    add(list->IdxBuffer.Data, list->IdxBuffer.Size * sizeof(ImDrawIdx));
+    for (int c = 0; c < list->CmdBuffer.Size; ++c) {
+      const ImDrawCmd &cmd = list->CmdBuffer.Data[c];
+      add(&cmd.ClipRect, sizeof(cmd.ClipRect));
+      add(&cmd.TextureId, sizeof(cmd.TextureId));
+      add(&cmd.VtxOffset, sizeof(cmd.VtxOffset));
+      add(&cmd.IdxOffset, sizeof(cmd.IdxOffset));
+      add(&cmd.ElemCount, sizeof(cmd.ElemCount));
+    }
+  }
+  return h;
+}
+
 void App::Present() {
+  ImGui::Render();
+  const uint64_t ui_hash = HashDrawData(ImGui::GetDrawData());
+  if (!g_dirty and ui_hash == g_ui_hash) {
+    ++g_idle_frames;
+    return;
+  }
+  g_dirty = false;
+  g_ui_hash = ui_hash;
+  g_idle_frames = 0;
+
   SDL_SetRenderTarget(renderer, NULL);
-  SDL_RenderCopy(renderer, screen, NULL, NULL);
+  SDL_RenderSetScale(renderer, 1, 1);
+  const SDL_Rect view = {(int)roundf(g_scroll.x), (int)roundf(g_scroll.y),
+                         g_pixel_width, g_pixel_height};
+  SDL_RenderCopy(renderer, screen, &view, NULL);
 
-  ImGui::Render();
   ImGuiIO &io = ImGui::GetIO();
   SDL_RenderSetScale(renderer, io.DisplayFramebufferScale.x,
                      io.DisplayFramebufferScale.y);
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/*
+Contexts of more than one symbol, e.g. the 'BC' in BC < A > D, matched with an
+Aho-Corasick automaton (Aho & Corasick, "Efficient string matching", 1975).
+
+A left context is matched against the symbols on the path back towards the
+root of the branching structure, and a right context against the symbols
+ahead on the same branch, with other branches skipped either way.
+LSystem::FindNeighbours walks those sequences for every symbol at once, one
+pass in each direction, feeding them through an automaton built from every
+rule's pattern. Each symbol then only has to look up its state, so matching
+costs the same however many rules there are, or however long their contexts.
+Right contexts are read backwards, so their automaton holds the reversed
+patterns. Right contexts with branches, such as the D[E]F of BC < A > D[E]F,
+describe part of the tree rather than a sequence, so those are checked against
+the value by LSystem::RightTreeMatches instead.
+*/
+
+struct ContextAutomaton {
+  static constexpr uint32_t NO_PATTERN = UINT32_MAX;
+
+  // Transitions from each state for every symbol, with the failure links
+  // folded in so stepping is a single lookup. State 0 is the root, where
+  // nothing has matched.
+  std::vector<std::array<uint32_t, 128>> next = {{}};
+  // Which patterns end at each state, as words bits per state
+  std::vector<uint64_t> ends;
+  size_t words = 0;
+  std::vector<uint32_t> pattern_state; // Trie node each pattern ends at
+
+  void Clear() {
+    next.assign(1, {});
+    ends.clear();
+    words = 0;
+    pattern_state.clear();
+  }
+
+  // Adds a pattern of symbols below 128, returning its id. Build must be
+  // called after the last one.
+  uint32_t Add(std::string_view pattern) {
+    uint32_t state = 0;
+    for (char c : pattern) {
+      uint32_t &child = next[state][(unsigned char)c];
+      if (child == 0) {
+        // The reference into next doesn't survive the push
+        const uint32_t added = next.size();
+        child = added;
+        next.emplace_back();
+        state = added;
+      } else {
+        state = child;
+      }
+    }
+    for (uint32_t id = 0; id < pattern_state.size(); ++id) {
+      if (pattern_state[id] == state) {
+        return id;
+      }
+    }
+    pattern_state.push_back(state);
+    return pattern_state.size() - 1;
+  }
+
+  void Build() {
+    words = (pattern_state.size() + 63) / 64;
+    ends.assign(next.size() * words, 0);
+    for (uint32_t id = 0; id < pattern_state.size(); ++id) {
+      ends[pattern_state[id] * words + id / 64] |= 1ull << (id % 64);
+    }
+
+    // Breadth first, so each state's failure state is finished before it.
+    // Until a state is reached its transitions are still just its children.
+    std::vector<uint32_t> fail(next.size(), 0), queue;
+    for (int c = 0; c < 128; ++c) {
+      if (next[0][c]) {
+        queue.push_back(next[0][c]);
+      }
+    }
+    for (size_t q = 0; q < queue.size(); ++q) {
+      const uint32_t state = queue[q];
+      for (size_t w = 0; w < words; ++w) {
+        ends[state * words + w] |= ends[fail[state] * words + w];
+      }
+      for (int c = 0; c < 128; ++c) {
+        const uint32_t child = next[state][c];
+        if (child) {
+          fail[child] = next[fail[state]][c];
+          queue.push_back(child);
+        } else {
+          next[state][c] = next[fail[state]][c];
+        }
+      }
+    }
+  }
+
+  uint32_t Next(uint32_t state, char c) const {
+    return (unsigned char)c < 128 ? next[state][(unsigned char)c] : 0;
+  }
+
+  // Whether the sequence read to reach state ends with the pattern
+  bool Matches(uint32_t state, uint32_t pattern) const {
+    return pattern == NO_PATTERN or
+           (ends[state * words + pattern / 64] >> (pattern % 64) & 1);
+  }
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "lsystem.h"
+#include "turtle.h"
+
+#include "SDL.h"
+
+// Initial window dimensions. The window can be resized, but Demo origins are
+// laid out for this size (see LayoutOffset in main.cpp).
+constexpr int WIDTH = 900;
+constexpr int HEIGHT = 600;
+
+// ImGui scroll bar that controls LSystem development
+constexpr int STAGE_BAR_H = 64;
+constexpr int STAGE_BAR_Y = HEIGHT - STAGE_BAR_H;
+
+// An LSystem, along with everything needed to display it
+struct Demo {
+  LSystem ls;
+  TurtleMap tm;
+
+  // Window params.
+  SDL_FPoint origin = {WIDTH / 2.0f, STAGE_BAR_Y - 5.0f};
+  float zoom = 1;
+  int stage = 0;
+  int max_stage = 7;
+  SDL_Colour clear_colour = {0, 0, 0, 0};
+
+  // Turtle params.
+  int step_size = 5;
+  float angle_delta = 0.071;
+  SDL_Colour turtle_colour = {255, 0, 255, 0};
+  StrokeStyle stroke;
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "demo.h"
+#include "geometry.h"
+#include "turtle.h"
+#include "turtle3d.h"
+
+#include "SDL.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Grows one stochastic system with a range of rng seeds, to pick from or to
+composite into a forest. Seeds are handed out to a pool of threads, each with
+its own copy of the Demo (LSystem::Step reseeds that copy's own Random, so
+nothing is shared). Each seed can be drawn into a contact sheet, saved as its
+own image, and/or exported as a mesh.
+
+Images are drawn with SDL's software renderer, so no window is needed.
+*/
+
+struct EnsembleOptions {
+  uint32_t first_seed = 0;
+  uint32_t count = 1;
+  int stage = -1;  // The demo's own stage if negative
+  int threads = 0; // One per core if 0
+  bool simplify = false;
+
+  int cell_size = 256;                // Pixels per image
+  const char *sheet_path = nullptr;   // Every seed in a grid, as a BMP
+  const char *image_path = nullptr;   // A BMP per seed, see SeedPath
+  const char *obj_path = nullptr;     // A mesh per seed, see SeedPath
+  const char *ply_path = nullptr;
+  Turtle3DOptions turtle3d;
+};
+
+// The path for one seed's output, e.g. "tree.obj" -> "tree_12.obj"
+std::string SeedPath(const char *path, uint32_t seed) {
+  std::string p = path;
+  size_t dot = p.find_last_of('.');
+  size_t slash = p.find_last_of("/\\");
+  if (dot == std::string::npos or
+      (slash != std::string::npos and dot < slash)) {
+    dot = p.size();
+  }
+  return p.substr(0, dot) + "_" + std::to_string(seed) + p.substr(dot);
+}
+
+// Returns false with an error naming the first seed that failed. Seeds after
+// a failure may or may not have been written.
+bool RunEnsemble(const Demo &demo, const EnsembleOptions &opts,
+                 std::string *error) {
+  const bool images = opts.sheet_path or opts.image_path;
+  const int size = opts.cell_size;
+  const int columns = std::max(1, (int)ceil(sqrt((double)opts.count)));
+  const int rows = (opts.count + columns - 1) / columns;
+  const int stage = opts.stage < 0 ? demo.stage : opts.stage;
+  const SDL_Colour bg = demo.clear_colour, fg = demo.turtle_colour;
+
+  SDL_Surface *sheet = nullptr;
+  if (opts.sheet_path) {
+    sheet = SDL_CreateRGBSurfaceWithFormat(0, columns * size, rows * size, 32,
+                                           SDL_PIXELFORMAT_ARGB8888);
+    if (!sheet) {
+      *error = std::string("Couldn't create the contact sheet: ") +
+               SDL_GetError();
+      return false;
+    }
+    SDL_FillRect(sheet, NULL,
+                 SDL_MapRGBA(sheet->format, bg.r, bg.g, bg.b, 255));
+  }
+
+  std::atomic<uint32_t> next{0};
+  std::atomic<bool> failed{false};
+  std::mutex lock; // Guards sheet and error
+
+  // Keeps the first error, and stops every thread
+  auto fail = [&](const std::string &message) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!failed) {
+      *error = message;
+      failed = true;
+    }
+  };
+  auto seed_error = [](uint32_t seed, const std::string &message) {
+    return "seed " + std::to_string(seed) + ": " + message;
+  };
+
+  auto work = [&]() {
+    Demo d = demo;
+    d.ls.threads = 1; // Seeds are already spread over the threads
+    Drawing drawing;
+    Mesh mesh;
+    std::string e;
+
+    SDL_Surface *cell = nullptr;
+    SDL_Renderer *r = nullptr;
+    if (images) {
+      cell = SDL_CreateRGBSurfaceWithFormat(0, size, size, 32,
+                                            SDL_PIXELFORMAT_ARGB8888);
+      r = cell ? SDL_CreateSoftwareRenderer(cell) : nullptr;
+      if (!r) {
+        fail(std::string("Couldn't create a renderer: ") + SDL_GetError());
+      }
+    }
+
+    for (uint32_t i; !failed and (i = next++) < opts.count;) {
+      const uint32_t seed = opts.first_seed + i;
+      d.ls.rng_seed = seed;
+      d.ls.Reset();
+      const std::string_view value =
+          Generate2D(d.ls, stage, d.tm, d.angle_delta, &e);
+      if (d.ls.m_stage != stage) {
+        fail(seed_error(seed, e));
+        break;
+      }
+
+      if (images) {
+        if (!Interpret2D(value, d.tm, d.angle_delta, drawing, d.ls.Params(),
+                         &e)) {
+          fail(seed_error(seed, e));
+          break;
+        }
+        if (opts.simplify) {
+          Simplify(drawing);
+        }
+        SDL_SetRenderDrawColor(r, bg.r, bg.g, bg.b, 255);
+        SDL_RenderClear(r);
+        SDL_SetRenderDrawColor(r, fg.r, fg.g, fg.b, 255);
+        RenderFitted(r, drawing, size, size, d.stroke);
+        SDL_RenderPresent(r);
+
+        if (opts.image_path) {
+          const std::string path = SeedPath(opts.image_path, seed);
+          if (SDL_SaveBMP(cell, path.c_str()) != 0) {
+            fail(seed_error(seed, "Couldn't write " + path));
+            break;
+          }
+        }
+        if (sheet) {
+          SDL_Rect dst = {(int)(i % columns) * size, (int)(i / columns) * size,
+                          size, size};
+          std::lock_guard<std::mutex> guard(lock);
+          SDL_BlitSurface(cell, NULL, sheet, &dst);
+        }
+      }
+
+      if (opts.obj_path or opts.ply_path) {
+        bool ok = Interpret3D(value, d.tm, opts.turtle3d, mesh, d.ls.Params(),
+                              &e);
+        if (ok and opts.simplify) {
+          Simplify(mesh, 1e-4f * opts.turtle3d.step);
+        }
+        if (ok and opts.obj_path) {
+          ok = WriteOBJ(mesh, SeedPath(opts.obj_path, seed).c_str(), &e);
+        }
+        if (ok and opts.ply_path) {
+          ok = WritePLY(mesh, SeedPath(opts.ply_path, seed).c_str(), &e);
+        }
+        if (!ok) {
+          fail(seed_error(seed, e));
+          break;
+        }
+      }
+    }
+
+    if (r) {
+      SDL_DestroyRenderer(r);
+    }
+    if (cell) {
+      SDL_FreeSurface(cell);
+    }
+  };
+
+  // The calling thread works too. WASM builds without pthreads can't start
+  // threads at all.
+  int threads = opts.threads > 0 ? opts.threads
+                                 : (int)std::thread::hardware_concurrency();
+  threads = std::clamp(threads, 1, (int)std::max(1u, opts.count));
+#if defined(BUILD_WASM) and !defined(__EMSCRIPTEN_PTHREADS__)
+  threads = 1;
+#endif
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; ++t) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (std::thread &t : pool) {
+    t.join();
+  }
+
+  if (sheet) {
+    if (!failed and SDL_SaveBMP(sheet, opts.sheet_path) != 0) {
+      *error = std::string("Couldn't write ") + opts.sheet_path;
+      failed = true;
+    }
+    SDL_FreeSurface(sheet);
+  }
+  return !failed;
+}
@@ -1,368 +1,280 @@
+#pragma once
 
+#include "demo.h"
+#include "lsystem.h"
+#include "turtle.h"
 
-Demo AB_1_24a;
-AB_1_24a.step_size = 5;
-AB_1_24a.angle_delta = 25.7f / 360;
-AB_1_24a.ls.seed = "F";
-AB_1_24a.ls.rules.push_back({'F', "F[+F]F[-F]F"});
-AB_1_24a.tm['F'] = INS_MOVE_FORWARD;
-AB_1_24a.tm['+'] = INS_TURN_LEFT;
-AB_1_24a.tm['-'] = INS_TURN_RIGHT;
-AB_1_24a.tm['['] = INS_PUSH_POSITION;
-AB_1_24a.tm[']'] = INS_POP_POSITION;
-AB_1_24a.stage = 5;
-AB_1_24a.max_stage = 7;
-AB_1_24a.zoom = 0.39f;
-AB_1_24a.ls.Reset();
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
 
-Demo AB_1_24b;
-AB_1_24b.step_size = 5;
-AB_1_24b.angle_delta = 20.0f / 360;
-AB_1_24b.ls.seed = "F";
-AB_1_24b.ls.rules.push_back({'F', "F[+F]F[-F][F]"});
-AB_1_24b.tm['F'] = INS_MOVE_FORWARD;
-AB_1_24b.tm['+'] = INS_TURN_LEFT;
-AB_1_24b.tm['-'] = INS_TURN_RIGHT;
-AB_1_24b.tm['['] = INS_PUSH_POSITION;
-AB_1_24b.tm[']'] = INS_POP_POSITION;
-AB_1_24b.stage = 5;
-AB_1_24b.zoom = 1.5f;
-AB_1_24b.ls.Reset();
+/*
+The built in examples, as constant tables. Nothing is allocated, parsed or
+generated for an example until it's picked, when MakeExample builds its Demo,
+so startup only pays for the one that's shown first.
+*/
 
-Demo AB_1_24c;
-AB_1_24c.step_size = 4;
-AB_1_24c.angle_delta = 22.5f / 360;
-AB_1_24c.ls.seed = "F";
-AB_1_24c.ls.rules.push_back({'F', "FF-[-F+F+F]+[+F-F-F]"});
-AB_1_24c.tm['F'] = INS_MOVE_FORWARD;
-AB_1_24c.tm['+'] = INS_TURN_LEFT;
-AB_1_24c.tm['-'] = INS_TURN_RIGHT;
-AB_1_24c.tm['['] = INS_PUSH_POSITION;
-AB_1_24c.tm[']'] = INS_POP_POSITION;
-AB_1_24c.stage = 4;
-AB_1_24c.max_stage = 6;
-AB_1_24c.zoom = 2.3f;
-AB_1_24c.ls.Reset();
+// A Rule without its strings, so it can be constexpr
+struct ExampleRule {
+  char target;
+  const char *replacement;
+  char left_context = CON_IGNORE;
+  char right_context = CON_IGNORE;
+  float probability = 1.0f;
+};
 
-Demo AB_1_24d;
-AB_1_24d.step_size = 7;
-AB_1_24d.angle_delta = 20.0f / 360;
-AB_1_24d.ls.seed = "X";
-AB_1_24d.ls.rules.push_back({'X', "F[+X]F[-X]+X"});
-AB_1_24d.ls.rules.push_back({'F', "FF"});
-AB_1_24d.tm['F'] = INS_MOVE_FORWARD;
-AB_1_24d.tm['X'] = INS_NONE;
-AB_1_24d.tm['+'] = INS_TURN_LEFT;
-AB_1_24d.tm['-'] = INS_TURN_RIGHT;
-AB_1_24d.tm['['] = INS_PUSH_POSITION;
-AB_1_24d.tm[']'] = INS_POP_POSITION;
-AB_1_24d.stage = 7;
-AB_1_24d.max_stage = 10;
-AB_1_24d.zoom = 0.27f;
-AB_1_24d.ls.Reset();
+struct ExampleTurtle {
+  char symbol;
+  TurtleInstruction ins;
+};
 
-Demo AB_1_24e;
-AB_1_24e.step_size = 7;
-AB_1_24e.angle_delta = 25.7f / 360;
-AB_1_24e.ls.seed = "X";
-AB_1_24e.ls.rules.push_back({'X', "F[+X][-X]FX"});
-AB_1_24e.ls.rules.push_back({'F', "FF"});
-AB_1_24e.tm['F'] = INS_MOVE_FORWARD;
-AB_1_24d.tm['X'] = INS_NONE;
-AB_1_24e.tm['+'] = INS_TURN_LEFT;
-AB_1_24e.tm['-'] = INS_TURN_RIGHT;
-AB_1_24e.tm['['] = INS_PUSH_POSITION;
-AB_1_24e.tm[']'] = INS_POP_POSITION;
-AB_1_24e.stage = 7;
-AB_1_24e.max_stage = 10;
-AB_1_24e.zoom = 0.27f;
-AB_1_24e.ls.Reset();
+// A constexpr array and its length
+template <typename T> struct Table {
+  const T *data = nullptr;
+  size_t size = 0;
 
-Demo AB_1_24f;
-AB_1_24f.step_size = 5;
-AB_1_24f.angle_delta = 22.5f / 360;
-AB_1_24f.ls.seed = "X";
-AB_1_24f.ls.rules.push_back({'X', "F-[[X]+X]+F[+FX]-X"});
-AB_1_24f.ls.rules.push_back({'F', "FF"});
-AB_1_24f.tm['F'] = INS_MOVE_FORWARD;
-AB_1_24f.tm['+'] = INS_TURN_LEFT;
-AB_1_24f.tm['-'] = INS_TURN_RIGHT;
-AB_1_24f.tm['['] = INS_PUSH_POSITION;
-AB_1_24f.tm[']'] = INS_POP_POSITION;
-AB_1_24f.stage = 6;
-AB_1_24f.max_stage = 8;
-AB_1_24f.zoom = 0.6f;
-AB_1_24f.ls.Reset();
+  constexpr Table() = default;
+  template <size_t N> constexpr Table(const T (&a)[N]) : data(a), size(N) {}
+  constexpr const T *begin() const { return data; }
+  constexpr const T *end() const { return data + size; }
+};
 
-Demo AB_1_27;
-AB_1_27.step_size = 5;
-AB_1_27.angle_delta = 25.7f / 360;
-AB_1_27.ls.seed = "F";
-AB_1_27.ls.rules.push_back({'F', "F[+F]F[-F]F", CON_IGNORE, CON_IGNORE, 0.33f});
-AB_1_27.ls.rules.push_back({'F', "F[+F]F", CON_IGNORE, CON_IGNORE, 0.33f});
-AB_1_27.ls.rules.push_back({'F', "F[-F]F", CON_IGNORE, CON_IGNORE, 0.34f});
-AB_1_27.tm['F'] = INS_MOVE_FORWARD;
-AB_1_27.tm['+'] = INS_TURN_LEFT;
-AB_1_27.tm['-'] = INS_TURN_RIGHT;
-AB_1_27.tm['['] = INS_PUSH_POSITION;
-AB_1_27.tm[']'] = INS_POP_POSITION;
-AB_1_27.stage = 5;
-AB_1_27.zoom = 1.8f;
-AB_1_27.ls.Reset();
+// Fields after zoom are rarely needed, so they come last
+struct Example {
+  const char *name; // Displayed in ImGui
+  const char *seed;
+  Table<ExampleRule> rules;
+  Table<ExampleTurtle> turtle;
+  float angle_delta = 0.071f;
+  int step_size = 5;
+  int stage = 0;
+  int max_stage = 7;
+  float zoom = 1;
+  float raise = 0;                 // Moves the origin up from its default
+  const char *ignore = "";         // Symbols skipped when matching contexts
+  Table<const char *> prules = {}; // Parametric rules, see parametric.h
+  SDL_Colour turtle_colour = {255, 0, 255, 0};
+  float stroke_width = 0;
+  Table<SDL_Colour> palette = {};
+  uint32_t rng_seed = 0; // For stochastic rules, 0 picks a new one each run
+};
 
-Demo AB_1_30_a;
-AB_1_30_a.step_size = 5;
-AB_1_30_a.angle_delta = 22.5f / 360;
-AB_1_30_a.ls.seed = "BC[+A]A[-A]A[+A]A";
-AB_1_30_a.ls.AddIgnored('+');
-AB_1_30_a.ls.AddIgnored('-');
-AB_1_30_a.ls.AddIgnored('C');
-AB_1_30_a.ls.rules.push_back({'A', "BC", 'B', CON_IGNORE});
-AB_1_30_a.tm['A'] = INS_MOVE_FORWARD;
-AB_1_30_a.tm['B'] = INS_MOVE_FORWARD;
-AB_1_30_a.tm['C'] = INS_DRAW_SQUARE;
-AB_1_30_a.tm['+'] = INS_TURN_LEFT;
-AB_1_30_a.tm['-'] = INS_TURN_RIGHT;
-AB_1_30_a.tm['['] = INS_PUSH_POSITION;
-AB_1_30_a.tm[']'] = INS_POP_POSITION;
-AB_1_30_a.stage = 0;
-AB_1_30_a.max_stage = 3;
-AB_1_30_a.zoom = 19.5f;
-AB_1_30_a.ls.Reset();
+// F draws, + and - turn, [ and ] branch
+constexpr ExampleTurtle BRANCHING[] = {
+    {'F', INS_MOVE_FORWARD},  {'+', INS_TURN_LEFT},
+    {'-', INS_TURN_RIGHT},    {'[', INS_PUSH_POSITION},
+    {']', INS_POP_POSITION},
+};
 
-Demo AB_1_30_b;
-AB_1_30_b.step_size = 5;
-AB_1_30_b.angle_delta = 22.5f / 360;
-AB_1_30_b.ls.seed = "A[+A]A[-A]A[+A]BC";
-AB_1_30_b.ls.AddIgnored('+');
-AB_1_30_b.ls.AddIgnored('-');
-AB_1_30_b.ls.AddIgnored('C');
-AB_1_30_b.ls.rules.push_back({'A', "BC", CON_IGNORE, 'B'});
-AB_1_30_b.tm['A'] = INS_MOVE_FORWARD;
-AB_1_30_b.tm['B'] = INS_MOVE_FORWARD;
-AB_1_30_b.tm['C'] = INS_DRAW_SQUARE;
-AB_1_30_b.tm['+'] = INS_TURN_LEFT;
-AB_1_30_b.tm['-'] = INS_TURN_RIGHT;
-AB_1_30_b.tm['['] = INS_PUSH_POSITION;
-AB_1_30_b.tm[']'] = INS_POP_POSITION;
-AB_1_30_b.stage = 0;
-AB_1_30_b.max_stage = 3;
-AB_1_30_b.zoom = 19.5f;
-AB_1_30_b.ls.Reset();
+constexpr ExampleRule AB_1_24a[] = {{'F', "F[+F]F[-F]F"}};
+constexpr ExampleRule AB_1_24b[] = {{'F', "F[+F]F[-F][F]"}};
+constexpr ExampleRule AB_1_24c[] = {{'F', "FF-[-F+F+F]+[+F-F-F]"}};
+constexpr ExampleRule AB_1_24d[] = {{'X', "F[+X]F[-X]+X"}, {'F', "FF"}};
+constexpr ExampleRule AB_1_24e[] = {{'X', "F[+X][-X]FX"}, {'F', "FF"}};
+constexpr ExampleRule AB_1_24f[] = {{'X', "F-[[X]+X]+F[+FX]-X"},
+                                    {'F', "FF"}};
 
-Demo AB_1_31_a;
-AB_1_31_a.step_size = 5;
-AB_1_31_a.angle_delta = 22.5f / 360;
-AB_1_31_a.ls.seed = "F1F1F1";
-AB_1_31_a.ls.AddIgnored('+');
-AB_1_31_a.ls.AddIgnored('-');
-AB_1_31_a.ls.AddIgnored('F');
-AB_1_31_a.ls.rules.push_back({'0', "0", '0', '0'});
-AB_1_31_a.ls.rules.push_back({'0', "1[+F1F1]", '0', '1'});
-AB_1_31_a.ls.rules.push_back({'1', "1", '0', '0'});
-AB_1_31_a.ls.rules.push_back({'1', "1", '0', '1'});
-AB_1_31_a.ls.rules.push_back({'0', "0", '1', '0'});
-AB_1_31_a.ls.rules.push_back({'0', "1F1", '1', '1'});
-AB_1_31_a.ls.rules.push_back({'1', "0", '1', '0'});
-AB_1_31_a.ls.rules.push_back({'1', "0", '1', '1'});
-AB_1_31_a.ls.rules.push_back({'+', "-", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_a.ls.rules.push_back({'-', "+", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_a.tm['F'] = INS_MOVE_FORWARD;
-AB_1_31_a.tm['+'] = INS_TURN_LEFT;
-AB_1_31_a.tm['-'] = INS_TURN_RIGHT;
-AB_1_31_a.tm['['] = INS_PUSH_POSITION;
-AB_1_31_a.tm[']'] = INS_POP_POSITION;
-AB_1_31_a.stage = 30;
-AB_1_31_a.max_stage = 40;
-AB_1_31_a.zoom = 1.2f;
-AB_1_31_a.ls.Reset();
+constexpr ExampleRule AB_1_27[] = {
+    {'F', "F[+F]F[-F]F", CON_IGNORE, CON_IGNORE, 0.33f},
+    {'F', "F[+F]F", CON_IGNORE, CON_IGNORE, 0.33f},
+    {'F', "F[-F]F", CON_IGNORE, CON_IGNORE, 0.34f},
+};
 
-Demo AB_1_31_b;
-AB_1_31_b.step_size = 5;
-AB_1_31_b.angle_delta = 22.5f / 360;
-AB_1_31_b.ls.seed = "F1F1F1";
-AB_1_31_b.ls.AddIgnored('+');
-AB_1_31_b.ls.AddIgnored('-');
-AB_1_31_b.ls.AddIgnored('F');
-AB_1_31_b.ls.rules.push_back({'0', "1", '0', '0'});
-AB_1_31_b.ls.rules.push_back({'0', "1[-F1F1]", '0', '1'});
-AB_1_31_b.ls.rules.push_back({'1', "1", '0', '0'});
-AB_1_31_b.ls.rules.push_back({'1', "1", '0', '1'});
-AB_1_31_b.ls.rules.push_back({'0', "0", '1', '0'});
-AB_1_31_b.ls.rules.push_back({'0', "1F1", '1', '1'});
-AB_1_31_b.ls.rules.push_back({'1', "1", '1', '0'});
-AB_1_31_b.ls.rules.push_back({'1', "0", '1', '1'});
-AB_1_31_b.ls.rules.push_back({'+', "-", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_b.ls.rules.push_back({'-', "+", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_b.tm['F'] = INS_MOVE_FORWARD;
-AB_1_31_b.tm['+'] = INS_TURN_LEFT;
-AB_1_31_b.tm['-'] = INS_TURN_RIGHT;
-AB_1_31_b.tm['['] = INS_PUSH_POSITION;
-AB_1_31_b.tm[']'] = INS_POP_POSITION;
-AB_1_31_b.stage = 30;
-AB_1_31_b.max_stage = 40;
-AB_1_31_b.zoom = 1.7f;
-AB_1_31_b.ls.Reset();
+// A and B draw, C is a flower
+constexpr ExampleTurtle FLOWERING[] = {
+    {'A', INS_MOVE_FORWARD}, {'B', INS_MOVE_FORWARD},
+    {'C', INS_DRAW_SQUARE},  {'+', INS_TURN_LEFT},
+    {'-', INS_TURN_RIGHT},   {'[', INS_PUSH_POSITION},
+    {']', INS_POP_POSITION},
+};
+constexpr ExampleRule AB_1_30_a[] = {{'A', "BC", 'B', CON_IGNORE}};
+constexpr ExampleRule AB_1_30_b[] = {{'A', "BC", CON_IGNORE, 'B'}};
 
-Demo AB_1_31_c;
-AB_1_31_c.step_size = 5;
-AB_1_31_c.angle_delta = 25.75f / 360;
-AB_1_31_c.ls.seed = "F1F1F1";
-AB_1_31_c.ls.AddIgnored('+');
-AB_1_31_c.ls.AddIgnored('-');
-AB_1_31_c.ls.AddIgnored('F');
-AB_1_31_c.ls.rules.push_back({'0', "0", '0', '0'});
-AB_1_31_c.ls.rules.push_back({'0', "1", '0', '1'});
-AB_1_31_c.ls.rules.push_back({'1', "0", '0', '0'});
-AB_1_31_c.ls.rules.push_back({'1', "1[+F1F1]", '0', '1'});
-AB_1_31_c.ls.rules.push_back({'0', "0", '1', '0'});
-AB_1_31_c.ls.rules.push_back({'0', "1F1", '1', '1'});
-AB_1_31_c.ls.rules.push_back({'1', "0", '1', '0'});
-AB_1_31_c.ls.rules.push_back({'1', "0", '1', '1'});
-AB_1_31_c.ls.rules.push_back({'+', "-", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_c.ls.rules.push_back({'-', "+", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_c.tm['F'] = INS_MOVE_FORWARD;
-AB_1_31_c.tm['+'] = INS_TURN_LEFT;
-AB_1_31_c.tm['-'] = INS_TURN_RIGHT;
-AB_1_31_c.tm['['] = INS_PUSH_POSITION;
-AB_1_31_c.tm[']'] = INS_POP_POSITION;
-AB_1_31_c.stage = 30;
-AB_1_31_c.max_stage = 40;
-AB_1_31_c.zoom = 1.2f;
-AB_1_31_c.ls.Reset();
+constexpr ExampleRule AB_1_31_a[] = {
+    {'0', "0", '0', '0'},
+    {'0', "1[+F1F1]", '0', '1'},
+    {'1', "1", '0', '0'},
+    {'1', "1", '0', '1'},
+    {'0', "0", '1', '0'},
+    {'0', "1F1", '1', '1'},
+    {'1', "0", '1', '0'},
+    {'1', "0", '1', '1'},
+    {'+', "-", CON_WILDCARD, CON_WILDCARD},
+    {'-', "+", CON_WILDCARD, CON_WILDCARD},
+};
+constexpr ExampleRule AB_1_31_b[] = {
+    {'0', "1", '0', '0'},
+    {'0', "1[-F1F1]", '0', '1'},
+    {'1', "1", '0', '0'},
+    {'1', "1", '0', '1'},
+    {'0', "0", '1', '0'},
+    {'0', "1F1", '1', '1'},
+    {'1', "1", '1', '0'},
+    {'1', "0", '1', '1'},
+    {'+', "-", CON_WILDCARD, CON_WILDCARD},
+    {'-', "+", CON_WILDCARD, CON_WILDCARD},
+};
+constexpr ExampleRule AB_1_31_c[] = {
+    {'0', "0", '0', '0'},
+    {'0', "1", '0', '1'},
+    {'1', "0", '0', '0'},
+    {'1', "1[+F1F1]", '0', '1'},
+    {'0', "0", '1', '0'},
+    {'0', "1F1", '1', '1'},
+    {'1', "0", '1', '0'},
+    {'1', "0", '1', '1'},
+    {'+', "-", CON_WILDCARD, CON_WILDCARD},
+    {'-', "+", CON_WILDCARD, CON_WILDCARD},
+};
+constexpr ExampleRule AB_1_31_d[] = {
+    {'0', "1", '0', '0'},
+    {'0', "0", '0', '1'},
+    {'1', "0", '0', '0'},
+    {'1', "1F1", '0', '1'},
+    {'0', "1", '1', '0'},
+    {'0', "1[+F1F1]", '1', '1'},
+    {'1', "1", '1', '0'},
+    {'1', "0", '1', '1'},
+    {'+', "-", CON_WILDCARD, CON_WILDCARD},
+    {'-', "+", CON_WILDCARD, CON_WILDCARD},
+};
+constexpr ExampleRule AB_1_31_e[] = {
+    {'0', "0", '0', '0'},
+    {'0', "1[-F1F1]", '0', '1'},
+    {'1', "1", '0', '0'},
+    {'1', "1", '0', '1'},
+    {'0', "0", '1', '0'},
+    {'0', "1F1", '1', '1'},
+    {'1', "1", '1', '0'},
+    {'1', "0", '1', '1'},
+    {'+', "-", CON_WILDCARD, CON_WILDCARD},
+    {'-', "+", CON_WILDCARD, CON_WILDCARD},
+};
 
-Demo AB_1_31_d;
-AB_1_31_d.step_size = 5;
-AB_1_31_d.angle_delta = 25.75f / 360;
-AB_1_31_d.ls.seed = "F0F1F1";
-AB_1_31_d.ls.AddIgnored('+');
-AB_1_31_d.ls.AddIgnored('-');
-AB_1_31_d.ls.AddIgnored('F');
-AB_1_31_d.ls.rules.push_back({'0', "1", '0', '0'});
-AB_1_31_d.ls.rules.push_back({'0', "0", '0', '1'});
-AB_1_31_d.ls.rules.push_back({'1', "0", '0', '0'});
-AB_1_31_d.ls.rules.push_back({'1', "1F1", '0', '1'});
-AB_1_31_d.ls.rules.push_back({'0', "1", '1', '0'});
-AB_1_31_d.ls.rules.push_back({'0', "1[+F1F1]", '1', '1'});
-AB_1_31_d.ls.rules.push_back({'1', "1", '1', '0'});
-AB_1_31_d.ls.rules.push_back({'1', "0", '1', '1'});
-AB_1_31_d.ls.rules.push_back({'+', "-", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_d.ls.rules.push_back({'-', "+", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_d.tm['F'] = INS_MOVE_FORWARD;
-AB_1_31_d.tm['+'] = INS_TURN_LEFT;
-AB_1_31_d.tm['-'] = INS_TURN_RIGHT;
-AB_1_31_d.tm['['] = INS_PUSH_POSITION;
-AB_1_31_d.tm[']'] = INS_POP_POSITION;
-AB_1_31_d.stage = 24;
-AB_1_31_d.max_stage = 30;
-AB_1_31_d.zoom = 0.85f;
-AB_1_31_d.ls.Reset();
+constexpr ExampleRule GAoL_1_e[] = {{'X', "X+YF+"}, {'Y', "-FX-Y"}};
+constexpr ExampleRule GAoL_1_f[] = {{'X', "-YF+XFX+FY-"},
+                                    {'Y', "+XF-YFY-FX+"}};
+constexpr ExampleRule GAoL_2_a[] = {{'X', "YF+XF+Y", CON_IGNORE, 'F'},
+                                    {'Y', "XF-YF-X", CON_IGNORE, 'F'}};
 
-Demo AB_1_31_e;
-AB_1_31_e.step_size = 5;
-AB_1_31_e.angle_delta = 22.5f / 360;
-AB_1_31_e.ls.seed = "F1F1F1";
-AB_1_31_e.ls.AddIgnored('+');
-AB_1_31_e.ls.AddIgnored('-');
-AB_1_31_e.ls.AddIgnored('F');
-AB_1_31_e.ls.rules.push_back({'0', "0", '0', '0'});
-AB_1_31_e.ls.rules.push_back({'0', "1[-F1F1]", '0', '1'});
-AB_1_31_e.ls.rules.push_back({'1', "1", '0', '0'});
-AB_1_31_e.ls.rules.push_back({'1', "1", '0', '1'});
-AB_1_31_e.ls.rules.push_back({'0', "0", '1', '0'});
-AB_1_31_e.ls.rules.push_back({'0', "1F1", '1', '1'});
-AB_1_31_e.ls.rules.push_back({'1', "1", '1', '0'});
-AB_1_31_e.ls.rules.push_back({'1', "0", '1', '1'});
-AB_1_31_e.ls.rules.push_back({'+', "-", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_e.ls.rules.push_back({'-', "+", CON_WILDCARD, CON_WILDCARD});
-AB_1_31_e.tm['F'] = INS_MOVE_FORWARD;
-AB_1_31_e.tm['+'] = INS_TURN_LEFT;
-AB_1_31_e.tm['-'] = INS_TURN_RIGHT;
-AB_1_31_e.tm['['] = INS_PUSH_POSITION;
-AB_1_31_e.tm[']'] = INS_POP_POSITION;
-AB_1_31_e.stage = 26;
-AB_1_31_e.max_stage = 30;
-AB_1_31_e.zoom = 2.1f;
-AB_1_31_e.ls.Reset();
+// Open L-system (see IsOpen in turtle.h). Each apex ?(d) is told how far it
+// is from the rest of the plant, and only grows while that's far enough.
+constexpr ExampleTurtle OPEN_turtle[] = {
+    {'F', INS_MOVE_FORWARD},  {'+', INS_TURN_LEFT},
+    {'-', INS_TURN_RIGHT},    {'[', INS_PUSH_POSITION},
+    {']', INS_POP_POSITION},  {'?', INS_QUERY},
+};
+constexpr const char *OPEN_collision[] = {
+    "?(d) : d > 0.6 -> F(1)[+(50)?(4)][-(50)?(4)]"};
 
-Demo GAoL_1_e;
-GAoL_1_e.step_size = 1;
-GAoL_1_e.angle_delta = 0.25f;
-GAoL_1_e.ls.seed = "X";
-GAoL_1_e.ls.rules.push_back({'X', "X+YF+"});
-GAoL_1_e.ls.rules.push_back({'Y', "-FX-Y"});
-GAoL_1_e.tm['F'] = INS_MOVE_FORWARD;
-GAoL_1_e.tm['+'] = INS_TURN_LEFT;
-GAoL_1_e.tm['-'] = INS_TURN_RIGHT;
-GAoL_1_e.tm['['] = INS_PUSH_POSITION;
-GAoL_1_e.tm[']'] = INS_POP_POSITION;
-GAoL_1_e.stage = 14;
-GAoL_1_e.max_stage = 18;
-GAoL_1_e.zoom = 2.1f;
-GAoL_1_e.origin.y -= 200;
-GAoL_1_e.ls.Reset();
+// Stroke widths and colours (see INS_NARROW and INS_NEXT_COLOUR). Each branch
+// is narrower than its parent, and the twigs at the tips are green.
+constexpr ExampleTurtle STYLED_turtle[] = {
+    {'F', INS_MOVE_FORWARD},  {'+', INS_TURN_LEFT},
+    {'-', INS_TURN_RIGHT},    {'[', INS_PUSH_POSITION},
+    {']', INS_POP_POSITION},  {'!', INS_NARROW},
+    {'\'', INS_NEXT_COLOUR},
+};
+constexpr const char *STYLED_tree[] = {
+    "A(l,w) : l >= 2 -> !(w)F(l)[+(30)A(l*0.7,w*0.6)][-(25)A(l*0.75,w*0.7)]",
+    "A(l,w) : l < 2 -> '(1)!(0.4)F(1.5)"};
+constexpr SDL_Colour STYLED_palette[] = {{110, 70, 40, 255},
+                                         {60, 160, 60, 255}};
 
-Demo GAoL_1_f;
-GAoL_1_f.step_size = 6;
-GAoL_1_f.angle_delta = 0.25f;
-GAoL_1_f.ls.seed = "X";
-GAoL_1_f.ls.rules.push_back({'X', "-YF+XFX+FY-"});
-GAoL_1_f.ls.rules.push_back({'Y', "+XF-YFY-FX+"});
-GAoL_1_f.tm['F'] = INS_MOVE_FORWARD;
-GAoL_1_f.tm['+'] = INS_TURN_LEFT;
-GAoL_1_f.tm['-'] = INS_TURN_RIGHT;
-GAoL_1_f.tm['['] = INS_PUSH_POSITION;
-GAoL_1_f.tm[']'] = INS_POP_POSITION;
-GAoL_1_f.stage = 5;
-GAoL_1_f.max_stage = 8;
-GAoL_1_f.zoom = 2.1f;
-GAoL_1_f.origin.y -= 200;
-GAoL_1_f.ls.Reset();
+constexpr Example EXAMPLES[] = {
+    {"Simple branching - ABoP 1.24a", "F", AB_1_24a, BRANCHING, 25.7f / 360,
+     5, 5, 7, 0.39f},
+    {"Simple branching - ABoP 1.24b", "F", AB_1_24b, BRANCHING, 20.0f / 360,
+     5, 5, 7, 1.5f},
+    {"Simple branching - ABoP 1.24c", "F", AB_1_24c, BRANCHING, 22.5f / 360,
+     4, 4, 6, 2.3f},
+    {"Simple branching - ABoP 1.24d", "X", AB_1_24d, BRANCHING, 20.0f / 360,
+     7, 7, 10, 0.27f},
+    {"Simple branching - ABoP 1.24e", "X", AB_1_24e, BRANCHING, 25.7f / 360,
+     7, 7, 10, 0.27f},
+    {"Simple branching - ABoP 1.24f", "X", AB_1_24f, BRANCHING, 22.5f / 360,
+     5, 6, 8, 0.6f},
 
-Demo GAoL_2_a;
-GAoL_2_a.step_size = 4;
-GAoL_2_a.angle_delta = 0.1667f;
-GAoL_2_a.ls.AddIgnored('+');
-GAoL_2_a.ls.AddIgnored('-');
-GAoL_2_a.ls.seed = "YF";
-GAoL_2_a.ls.rules.push_back({'X', "YF+XF+Y", CON_IGNORE, 'F'});
-GAoL_2_a.ls.rules.push_back({'Y', "XF-YF-X", CON_IGNORE, 'F'});
-GAoL_2_a.tm['F'] = INS_MOVE_FORWARD;
-GAoL_2_a.tm['+'] = INS_TURN_LEFT;
-GAoL_2_a.tm['-'] = INS_TURN_RIGHT;
-GAoL_2_a.tm['['] = INS_PUSH_POSITION;
-GAoL_2_a.tm[']'] = INS_POP_POSITION;
-GAoL_2_a.stage = 6;
-GAoL_2_a.max_stage = 8;
-GAoL_2_a.zoom = 2.1f;
-GAoL_2_a.origin.y -= 200;
-GAoL_2_a.ls.Reset();
+    // A typical plant for the seed, picked to fit the view (see Random)
+    {"Stochastic branching - ABoP 1.27", "F", AB_1_27, BRANCHING,
+     25.7f / 360, 5, 5, 7, 1.8f, 0, "", {}, {255, 0, 255, 0}, 0, {}, 1771},
 
-Demo test;
-test.step_size = 5;
-test.angle_delta = 22.5f / 360;
-test.ls.seed = "F1F1F1";
-test.ls.AddIgnored('+');
-test.ls.AddIgnored('-');
-test.ls.AddIgnored('F');
-test.ls.rules.push_back({'0', "1", '0', '0'});
-test.ls.rules.push_back({'0', "1[-F1F1]", '0', '1', 0.5f});
-test.ls.rules.push_back({'0', "0", '0', '1', 0.5f});
-test.ls.rules.push_back({'1', "1", '0', '0'});
-test.ls.rules.push_back({'1', "1", '0', '1'});
-test.ls.rules.push_back({'0', "0", '1', '0'});
-test.ls.rules.push_back({'0', "1F1", '1', '1', 0.5f});
-test.ls.rules.push_back({'0', "0", '1', '1', 0.5f});
-test.ls.rules.push_back({'1', "1", '1', '0'});
-test.ls.rules.push_back({'1', "0", '1', '1'});
-test.ls.rules.push_back({'+', "-", CON_WILDCARD, CON_WILDCARD});
-test.ls.rules.push_back({'-', "+", CON_WILDCARD, CON_WILDCARD});
-test.tm['F'] = INS_MOVE_FORWARD;
-test.tm['+'] = INS_TURN_LEFT;
-test.tm['-'] = INS_TURN_RIGHT;
-test.tm['['] = INS_PUSH_POSITION;
-test.tm[']'] = INS_POP_POSITION;
-test.stage = 30;
-test.max_stage = 40;
-test.zoom = 1.7f;
-test.ls.Reset();
\ No newline at end of file
+    {"Acropetal development - ABoP 1.30a", "BC[+A]A[-A]A[+A]A", AB_1_30_a,
+     FLOWERING, 22.5f / 360, 5, 0, 3, 19.5f, 0, "+-C"},
+    {"Basipetal development - ABoP 1.30b", "A[+A]A[-A]A[+A]BC", AB_1_30_b,
+     FLOWERING, 22.5f / 360, 5, 0, 3, 19.5f, 0, "+-C"},
+
+    {"Context sensitive - ABoP 1.31a", "F1F1F1", AB_1_31_a, BRANCHING,
+     22.5f / 360, 5, 30, 40, 1.2f, 0, "+-F"},
+    {"Context sensitive - ABoP 1.31b", "F1F1F1", AB_1_31_b, BRANCHING,
+     22.5f / 360, 5, 30, 40, 1.7f, 0, "+-F"},
+    {"Context sensitive - ABoP 1.31c", "F1F1F1", AB_1_31_c, BRANCHING,
+     25.75f / 360, 5, 30, 40, 1.2f, 0, "+-F"},
+    {"Context sensitive - ABoP 1.31d", "F0F1F1", AB_1_31_d, BRANCHING,
+     25.75f / 360, 5, 24, 30, 0.85f, 0, "+-F"},
+    {"Context sensitive - ABoP 1.31e", "F1F1F1", AB_1_31_e, BRANCHING,
+     22.5f / 360, 5, 26, 30, 2.1f, 0, "+-F"},
+
+    {"Dragon Curve - GAoL 1e", "X", GAoL_1_e, BRANCHING, 0.25f, 1, 14, 18,
+     2.1f, 200},
+    {"Hilbert Curve - GAoL 1f", "X", GAoL_1_f, BRANCHING, 0.25f, 6, 5, 8,
+     2.1f, 200},
+    {"Sierpinski arrowhead - GAoL 2a", "YF", GAoL_2_a, BRANCHING, 0.1667f, 4,
+     6, 8, 2.1f, 200, "+-"},
+
+    {"Collision pruning - open L-system", "?(4)", {}, OPEN_turtle, 0.071f, 5,
+     12, 20, 3, 250, "", OPEN_collision},
+    {"Tapering tree - stroke width and colour", "A(12,2.5)", {},
+     STYLED_turtle, 0.071f, 5, 8, 12, 1, 0, "", STYLED_tree,
+     {110, 70, 40, 0}, 1, STYLED_palette},
+};
+constexpr size_t N_EXAMPLES = sizeof(EXAMPLES) / sizeof(EXAMPLES[0]);
+
+// Builds the Demo for e, reset and ready to generate
+Demo MakeExample(const Example &e) {
+  Demo d;
+  d.step_size = e.step_size;
+  d.angle_delta = e.angle_delta;
+  d.ls.seed = e.seed;
+  if (e.rng_seed != 0) {
+    d.ls.rng_seed = e.rng_seed;
+  }
+  for (const char *c = e.ignore; *c; ++c) {
+    d.ls.AddIgnored(*c);
+  }
+  for (const ExampleRule &r : e.rules) {
+    d.ls.rules.push_back({r.target, r.replacement, r.left_context,
+                          r.right_context, r.probability});
+  }
+  for (const char *text : e.prules) {
+    ParametricRule r;
+    std::string error;
+    // The tables are fixed, so this is a bug in them. It's checked in every
+    // build, as the example would silently lose the rule otherwise.
+    if (!ParseParametricRule(text, &r, &error)) {
+      std::cerr << "Example \"" << e.name << "\": " << error << '\n';
+      std::abort();
+    }
+    d.ls.parametric_rules.push_back(r);
+  }
+  for (const ExampleTurtle &t : e.turtle) {
+    d.tm[t.symbol] = t.ins;
+  }
+  d.stage = e.stage;
+  d.max_stage = e.max_stage;
+  d.zoom = e.zoom;
+  d.origin.y -= e.raise;
+  d.turtle_colour = e.turtle_colour;
+  d.stroke.width = e.stroke_width;
+  d.stroke.palette.assign(e.palette.begin(), e.palette.end());
+  d.ls.Reset();
+  return d;
+}
+
+// The nth example, counting the built in ones first and then those loaded
+// at runtime
+Demo PickExample(size_t n, const std::vector<Demo> &loaded) {
+  return n < N_EXAMPLES ? MakeExample(EXAMPLES[n]) : loaded[n - N_EXAMPLES];
+}
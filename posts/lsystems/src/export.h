@@ -0,0 +1,152 @@
+#pragma once
+
+#include "lsystem.h"
+
+#ifdef BUILD_WASM
+#include <emscripten.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+/*
+Exports the string of a stage without ever holding a second copy of it:
+natively by writing to a file descriptor (a file, or stdout), and in the
+browser as a Blob download.
+
+The string comes from LSystem::Expand, so seekable systems are written out
+straight from their rules without being generated at all. Expand hands over many
+small pieces, which are gathered into chunks of up to EXPORT_CHUNK bytes.
+Pieces at least that long, like an already generated value, are passed on as
+they are.
+*/
+
+const size_t EXPORT_CHUNK = 1 << 20;
+
+// Calls sink with the system's value at stage, in order and in chunks. Stops
+// at the first chunk sink returns false for. If the stage can't be expanded
+// (see LSystem::Expand), sink is never called and error is set.
+template <typename Sink>
+bool StreamValue(LSystem &ls, int stage, Sink &&sink, std::string *error) {
+  std::string buffer;
+  buffer.reserve(EXPORT_CHUNK);
+  bool ok = true;
+  auto gather = [&](std::string_view piece) {
+    if (!ok) {
+      return;
+    }
+    if (!buffer.empty() and buffer.size() + piece.size() > EXPORT_CHUNK) {
+      ok = sink(std::string_view(buffer));
+      buffer.clear();
+    }
+    if (piece.size() >= EXPORT_CHUNK) {
+      ok = ok and sink(piece);
+    } else {
+      buffer.append(piece);
+    }
+  };
+  if (!ls.Expand(stage, gather, error)) {
+    return false;
+  }
+  if (ok and !buffer.empty()) {
+    ok = sink(std::string_view(buffer));
+  }
+  return ok;
+}
+
+#ifndef BUILD_WASM
+
+// Writes all of data, carrying on after partial writes
+bool WriteAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    const ssize_t n = write(fd, data.data(), data.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data.remove_prefix(n);
+  }
+  return true;
+}
+
+bool ExportValue(LSystem &ls, int stage, int fd, std::string *error) {
+  bool written = true;
+  if (!StreamValue(ls, stage,
+                   [fd, &written](std::string_view chunk) {
+                     return written = WriteAll(fd, chunk);
+                   },
+                   error)) {
+    if (!written) {
+      *error = std::string("Couldn't write the string: ") + strerror(errno);
+    }
+    return false;
+  }
+  return true;
+}
+
+bool ExportValue(LSystem &ls, int stage, const char *path,
+                 std::string *error) {
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    *error = std::string("Couldn't open ") + path + " for writing";
+    return false;
+  }
+  bool ok = ExportValue(ls, stage, fd, error);
+  if (close(fd) != 0 and ok) {
+    *error = std::string("Couldn't write ") + path;
+    ok = false;
+  }
+  return ok;
+}
+
+#else
+
+// Each chunk is handed over as a view of the WASM heap, which a Blob copies
+// from straight away, so the buffer behind it can be reused. Blobs can't be
+// made from shared memory though, which fern-mt.js uses (see the Makefile), so
+// there it has to be copied out first.
+EM_JS(void, ExportBegin, (), { Module.exportParts = []; });
+EM_JS(void, ExportChunk, (const char *data, size_t size), {
+  data >>>= 0;
+  var view = HEAPU8.subarray(data, data + size);
+  if (!(view.buffer instanceof ArrayBuffer)) {
+    view = view.slice();
+  }
+  Module.exportParts.push(new Blob([view]));
+});
+EM_JS(void, ExportCancel, (), { delete Module.exportParts; });
+EM_JS(void, ExportFinish, (const char *name), {
+  var blob = new Blob(Module.exportParts, {type : "text/plain"});
+  delete Module.exportParts;
+  var a = document.createElement("a");
+  a.href = URL.createObjectURL(blob);
+  a.download = UTF8ToString(name);
+  a.click();
+  setTimeout(function() { URL.revokeObjectURL(a.href); }, 0);
+});
+
+// Offers the value at stage as a file download called name
+bool DownloadValue(LSystem &ls, int stage, const char *name,
+                   std::string *error) {
+  ExportBegin();
+  if (!StreamValue(ls, stage,
+                   [](std::string_view chunk) {
+                     ExportChunk(chunk.data(), chunk.size());
+                     return true;
+                   },
+                   error)) {
+    ExportCancel();
+    return false;
+  }
+  ExportFinish(name);
+  return true;
+}
+
+#endif
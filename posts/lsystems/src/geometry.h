@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+Geometry produced by the turtles, and an optional clean up pass over it.
+
+Branching systems retrace the same segments after every ']', and curves like
+the Sierpinski arrowhead draw long straight runs one 'F' at a time, so the raw
+output can be several times larger than the picture it draws. Simplify welds
+vertices that land in the same spot, drops repeated segments and joins
+straight runs into single segments.
+*/
+
+struct Vec3 {
+  float x, y, z;
+};
+
+inline Vec3 operator+(Vec3 a, Vec3 b) {
+  return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+inline Vec3 operator-(Vec3 a, Vec3 b) {
+  return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+inline Vec3 operator*(float s, Vec3 a) { return {s * a.x, s * a.y, s * a.z}; }
+inline Vec3 operator-(Vec3 a) { return {-a.x, -a.y, -a.z}; }
+inline float Dot(Vec3 a, Vec3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vec3 Cross(Vec3 a, Vec3 b) {
+  return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+// One indexed vertex buffer. Line meshes use two indices per segment, tube
+// meshes three per triangle.
+struct Mesh {
+  std::vector<Vec3> vertices;
+  std::vector<uint32_t> indices;
+  bool triangles = false;
+};
+
+namespace Geometry {
+
+// Open addressing hash from grid cells to the first vertex seen in them, after
+// Teschner et al. "Optimized Spatial Hashing for Collision Detection"
+struct SpatialHash {
+  struct Cell {
+    int64_t x, y, z;
+    uint32_t vertex = UINT32_MAX; // UINT32_MAX for an empty slot
+  };
+  std::vector<Cell> cells;
+  float inv_size;
+
+  SpatialHash(size_t n, float cell_size) : inv_size(1 / cell_size) {
+    size_t capacity = 16;
+    while (capacity < 2 * n) {
+      capacity *= 2;
+    }
+    cells.resize(capacity);
+  }
+
+  // Returns the vertex already in v's cell, or adds and returns vertex
+  uint32_t Insert(Vec3 v, uint32_t vertex) {
+    const int64_t x = llroundf(v.x * inv_size), y = llroundf(v.y * inv_size),
+                  z = llroundf(v.z * inv_size);
+    const uint64_t hash = (uint64_t)x * 73856093 ^ (uint64_t)y * 19349663 ^
+                          (uint64_t)z * 83492791;
+    const size_t mask = cells.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Cell &c = cells[i];
+      if (c.vertex == UINT32_MAX) {
+        c = {x, y, z, vertex};
+        return vertex;
+      }
+      if (c.x == x and c.y == y and c.z == z) {
+        return c.vertex;
+      }
+    }
+  }
+};
+
+// Removes vertices no segment uses, numbering the rest in order of first use
+void Compact(Mesh &mesh) {
+  std::vector<uint32_t> remap(mesh.vertices.size(), UINT32_MAX);
+  std::vector<Vec3> vertices;
+  for (uint32_t &i : mesh.indices) {
+    if (remap[i] == UINT32_MAX) {
+      remap[i] = vertices.size();
+      vertices.push_back(mesh.vertices[i]);
+    }
+    i = remap[i];
+  }
+  mesh.vertices = std::move(vertices);
+}
+
+} // namespace Geometry
+
+// Welds vertices within tolerance of each other, removes zero length and
+// repeated segments, then merges runs of collinear segments whose joints
+// nothing else touches. Only line meshes are changed, and the order of
+// segments isn't kept.
+void Simplify(Mesh &mesh, float tolerance = 1e-4f) {
+  if (mesh.triangles or mesh.indices.empty()) {
+    return;
+  }
+
+  // Weld, pointing each index at the first vertex in its cell
+  Geometry::SpatialHash hash(mesh.vertices.size(), tolerance);
+  std::vector<uint32_t> welded(mesh.vertices.size());
+  for (uint32_t i = 0; i < mesh.vertices.size(); ++i) {
+    welded[i] = hash.Insert(mesh.vertices[i], i);
+  }
+
+  // Segments are direction-less, so store them as (low, high) packed into one
+  // integer to sort out the repeats
+  std::vector<uint64_t> segments;
+  segments.reserve(mesh.indices.size() / 2);
+  for (size_t i = 0; i + 1 < mesh.indices.size(); i += 2) {
+    uint32_t a = welded[mesh.indices[i]], b = welded[mesh.indices[i + 1]];
+    if (a != b) {
+      segments.push_back((uint64_t)std::min(a, b) << 32 | std::max(a, b));
+    }
+  }
+  std::sort(segments.begin(), segments.end());
+  segments.erase(std::unique(segments.begin(), segments.end()),
+                 segments.end());
+  auto end_a = [&](size_t s) { return uint32_t(segments[s] >> 32); };
+  auto end_b = [&](size_t s) { return uint32_t(segments[s]); };
+
+  // Segments touching each vertex, in compressed rows
+  const size_t n = mesh.vertices.size();
+  std::vector<uint32_t> first(n + 1, 0), touching(2 * segments.size());
+  for (size_t s = 0; s < segments.size(); ++s) {
+    ++first[end_a(s) + 1];
+    ++first[end_b(s) + 1];
+  }
+  for (size_t v = 0; v < n; ++v) {
+    first[v + 1] += first[v];
+  }
+  {
+    std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+    for (uint32_t s = 0; s < segments.size(); ++s) {
+      touching[fill[end_a(s)]++] = s;
+      touching[fill[end_b(s)]++] = s;
+    }
+  }
+  auto other = [&](size_t s, uint32_t v) {
+    return end_a(s) == v ? end_b(s) : end_a(s);
+  };
+
+  // A joint can go if exactly two segments meet there, heading in opposite
+  // directions along the same line
+  const float sin_limit = 1e-5f;
+  std::vector<bool> interior(n, false);
+  for (uint32_t v = 0; v < n; ++v) {
+    if (first[v + 1] - first[v] != 2) {
+      continue;
+    }
+    const Vec3 p = mesh.vertices[v];
+    const Vec3 d1 = mesh.vertices[other(touching[first[v]], v)] - p;
+    const Vec3 d2 = mesh.vertices[other(touching[first[v] + 1], v)] - p;
+    const Vec3 c = Cross(d1, d2);
+    const float limit = sin_limit * sin_limit * Dot(d1, d1) * Dot(d2, d2);
+    interior[v] = Dot(d1, d2) < 0 and Dot(c, c) <= limit;
+  }
+
+  // Walk from every other vertex along its straight runs
+  std::vector<bool> used(segments.size(), false);
+  std::vector<uint32_t> indices;
+  indices.reserve(2 * segments.size());
+  for (uint32_t v = 0; v < n; ++v) {
+    if (interior[v]) {
+      continue;
+    }
+    for (uint32_t t = first[v]; t < first[v + 1]; ++t) {
+      uint32_t s = touching[t];
+      if (used[s]) {
+        continue;
+      }
+      used[s] = true;
+      uint32_t end = other(s, v);
+      while (interior[end]) {
+        // Tiny bends at each joint could add up along a long run, so each
+        // step is also checked against the run's start
+        const uint32_t *next = &touching[first[end]];
+        const uint32_t s2 = next[0] == s ? next[1] : next[0];
+        const uint32_t end2 = other(s2, end);
+        const Vec3 d1 = mesh.vertices[end] - mesh.vertices[v];
+        const Vec3 d2 = mesh.vertices[end2] - mesh.vertices[v];
+        const Vec3 c = Cross(d1, d2);
+        if (Dot(c, c) > sin_limit * sin_limit * Dot(d1, d1) * Dot(d2, d2)) {
+          break;
+        }
+        s = s2;
+        end = end2;
+        used[s] = true;
+      }
+      indices.push_back(v);
+      indices.push_back(end);
+    }
+  }
+  // Anything left is the rest of a run that bent too far, or a loop of
+  // interior joints, and is kept as it was
+  for (size_t s = 0; s < segments.size(); ++s) {
+    if (!used[s]) {
+      indices.push_back(end_a(s));
+      indices.push_back(end_b(s));
+    }
+  }
+
+  mesh.indices = std::move(indices);
+  Geometry::Compact(mesh);
+}
@@ -0,0 +1,450 @@
+#pragma once
+
+#include "demo.h"
+#include "lsystem.h"
+#include "turtle.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/*
+Plain text format for L-Systems, so they can be loaded at runtime rather than
+compiled into examples.h. Each line is 'key: value', blank lines and lines
+starting with '#' are skipped. A 'name' line starts a new system, e.g.
+
+  name: Stochastic branching - ABoP 1.27
+  seed: F
+  rule: F -> F[+F]F[-F]F 0.33
+  rule: F -> F[+F]F 0.33
+  rule: F -> F[-F]F 0.34
+  turtle: F MOVE_FORWARD
+  turtle: + TURN_LEFT
+  angle: 25.7
+  stage: 5
+
+Keys:
+  name      Displayed in the examples list
+  seed      Value of the system at stage 0
+  rule      'lhs -> replacement [probability]', where lhs is one of T, L<T,
+            T>R or L<T>R. A context of '*' matches any symbol. Contexts may
+            be several symbols, as in BC<A>DE, but without '*', and right
+            contexts may have branches, as in BC<A>D[E]F. Leaving out the
+            replacement erases the target.
+  prule     Parametric rule, e.g. 'F(l) : l > 1 -> F(l*0.7)[+F(l*0.5)]', see
+            parametric.h. Any prule makes the system parametric, so the seed
+            may have parameters and plain rules are ignored.
+  ignore    Symbols skipped when matching contexts
+  turtle    'symbol INSTRUCTION', using the names shown in the UI
+  angle     Turn per instruction in degrees
+  step      Turtle step size
+  stage, max_stage, zoom
+  offset    'x y', moves the origin from its default
+  width     Steps per unit of turtle width, see NARROW (1 pixel lines if 0)
+  palette   Hex colours for the turtle's colour indexes, e.g. '6b4226 3a7d2c',
+            see NEXT_COLOUR
+
+Symbols must be printable ASCII, and spaces can't be used as symbols.
+*/
+
+namespace Grammar {
+
+struct Parser {
+  std::vector<Demo> *demos;
+  std::vector<std::string> *names;
+  std::string *error;
+  int line_number = 0;
+
+  bool Fail(const std::string &message) {
+    *error = "line " + std::to_string(line_number) + ": " + message;
+    return false;
+  }
+
+  Demo &Current() {
+    if (demos->empty()) {
+      demos->emplace_back();
+      names->push_back("Unnamed");
+    }
+    return demos->back();
+  }
+
+  bool Symbol(char c) const { return c > ' ' and c < 127; }
+
+  bool Symbols(const std::string &s) {
+    for (char c : s) {
+      if (!Symbol(c)) {
+        return Fail("invalid symbol in '" + s + "'");
+      }
+    }
+    return true;
+  }
+
+  bool Number(const std::string &s, float *out) {
+    char *end;
+    *out = strtof(s.c_str(), &end);
+    if (s.empty() or *end != '\0') {
+      return Fail("expected a number, got '" + s + "'");
+    }
+    return true;
+  }
+
+  bool Integer(const std::string &s, int *out) {
+    char *end;
+    *out = strtol(s.c_str(), &end, 10);
+    if (s.empty() or *end != '\0') {
+      return Fail("expected an integer, got '" + s + "'");
+    }
+    return true;
+  }
+
+  bool ParseRule(const std::vector<std::string> &tokens);
+  bool ParseLine(const std::string &key,
+                 const std::vector<std::string> &tokens);
+  bool Validate();
+};
+
+std::vector<std::string> Split(const std::string &s) {
+  std::vector<std::string> tokens;
+  size_t i = 0;
+  while (true) {
+    i = s.find_first_not_of(" \t\r", i);
+    if (i == std::string::npos) {
+      return tokens;
+    }
+    size_t end = s.find_first_of(" \t\r", i);
+    tokens.push_back(s.substr(i, end - i));
+    i = end;
+  }
+}
+
+bool Parser::ParseRule(const std::vector<std::string> &tokens) {
+  // Context markers may or may not be separated by spaces, so glue the left
+  // hand side back together first
+  std::string lhs;
+  size_t arrow = 0;
+  while (arrow < tokens.size() and tokens[arrow] != "->") {
+    lhs += tokens[arrow++];
+  }
+  if (arrow == tokens.size()) {
+    return Fail("rule is missing '->'");
+  }
+  if (tokens.size() - arrow > 3) {
+    return Fail("expected 'replacement [probability]' after '->'");
+  }
+
+  Rule r;
+  auto context = [](char c) { return c == '*' ? CON_WILDCARD : c; };
+  if (lhs.size() == 1) {
+    r.target = lhs[0];
+  } else if (lhs.size() == 3 and lhs[1] == '<') {
+    r.left_context = context(lhs[0]);
+    r.target = lhs[2];
+  } else if (lhs.size() == 3 and lhs[1] == '>') {
+    r.target = lhs[0];
+    r.right_context = context(lhs[2]);
+  } else if (lhs.size() == 5 and lhs[1] == '<' and lhs[3] == '>') {
+    r.left_context = context(lhs[0]);
+    r.target = lhs[2];
+    r.right_context = context(lhs[4]);
+  } else {
+    // Longer contexts, so '<' and '>' can only be markers here
+    const size_t lt = lhs.find('<');
+    const size_t gt = lhs.find('>', lt == std::string::npos ? 0 : lt + 1);
+    const size_t t = lt == std::string::npos ? 0 : lt + 1;
+    const std::string left = lhs.substr(0, t == 0 ? 0 : t - 1);
+    const std::string right =
+        gt == std::string::npos ? "" : lhs.substr(gt + 1);
+    if ((gt == std::string::npos ? lhs.size() : gt) != t + 1 or
+        (lt != std::string::npos and left.empty()) or
+        (gt != std::string::npos and right.empty())) {
+      return Fail("expected the rule to start with T, L<T, T>R or L<T>R");
+    }
+    r.target = lhs[t];
+    for (const std::string &c : {left, right}) {
+      if (c.size() > 1 and c.find_first_of("*<>") != std::string::npos) {
+        return Fail("contexts of several symbols can't use '*', '<' or '>'");
+      }
+    }
+    if (left.size() > 1 and left.find_first_of("[]") != std::string::npos) {
+      return Fail("left contexts can't have branches");
+    }
+    // Each ']' leaves a branch the context entered
+    int depth = 0;
+    for (char c : right) {
+      depth += c == '[' ? 1 : c == ']' ? -1 : 0;
+      if (depth < 0) {
+        return Fail("unmatched ']' in right context '" + right + "'");
+      }
+    }
+    if (left.size() == 1) {
+      r.left_context = context(left[0]);
+    } else {
+      r.left_string = left;
+    }
+    if (right.size() == 1) {
+      r.right_context = context(right[0]);
+    } else {
+      r.right_string = right;
+    }
+  }
+
+  if (arrow + 1 < tokens.size()) {
+    r.replacement = tokens[arrow + 1];
+  }
+  if (arrow + 2 < tokens.size() and
+      !Number(tokens[arrow + 2], &r.probability)) {
+    return false;
+  }
+  if (!(r.probability > 0.0f and r.probability <= 1.0f)) {
+    return Fail("probability must be in (0, 1]");
+  }
+  if (!Symbols(lhs) or !Symbols(r.replacement)) {
+    return false;
+  }
+
+  Current().ls.rules.push_back(r);
+  return true;
+}
+
+bool Parser::ParseLine(const std::string &key,
+                       const std::vector<std::string> &tokens) {
+  if (key == "name") {
+    std::string name;
+    for (const std::string &t : tokens) {
+      name += (name.empty() ? "" : " ") + t;
+    }
+    if (!demos->empty() and !Validate()) {
+      return false;
+    }
+    demos->emplace_back();
+    names->push_back(name);
+    return true;
+  }
+
+  if (key == "rule") {
+    return ParseRule(tokens);
+  }
+
+  if (key == "prule") {
+    std::string text, rule_error;
+    for (const std::string &t : tokens) {
+      text += (text.empty() ? "" : " ") + t;
+    }
+    ParametricRule r;
+    if (!ParseParametricRule(text, &r, &rule_error)) {
+      return Fail(rule_error);
+    }
+    if (!Symbols(std::string(1, r.target)) or !Symbols(r.successor)) {
+      return false;
+    }
+    Current().ls.parametric_rules.push_back(r);
+    return true;
+  }
+
+  Demo &d = Current();
+  if (key == "turtle") {
+    if (tokens.size() != 2 or tokens[0].size() != 1) {
+      return Fail("expected 'symbol INSTRUCTION'");
+    }
+    if (!Symbols(tokens[0])) {
+      return false;
+    }
+    for (int i = 0; i < N_INSTRUCTIONS; ++i) {
+      if (tokens[1] == instuction_labels[i]) {
+        d.tm[tokens[0][0]] = (TurtleInstruction)i;
+        return true;
+      }
+    }
+    return Fail("unknown turtle instruction '" + tokens[1] + "'");
+  }
+
+  if (key == "offset") {
+    float dx, dy;
+    if (tokens.size() != 2) {
+      return Fail("expected 'x y'");
+    }
+    if (!Number(tokens[0], &dx) or !Number(tokens[1], &dy)) {
+      return false;
+    }
+    d.origin.x += dx;
+    d.origin.y += dy;
+    return true;
+  }
+
+  if (key == "seed") {
+    // Spaces aren't symbols, but can separate parameters in parametric seeds,
+    // which are checked once the whole system has been read
+    d.ls.seed.clear();
+    for (const std::string &t : tokens) {
+      d.ls.seed += t;
+    }
+    return Symbols(d.ls.seed);
+  }
+
+  if (key == "palette") {
+    d.stroke.palette.clear();
+    for (const std::string &t : tokens) {
+      char *end;
+      const unsigned long rgb = strtoul(t.c_str(), &end, 16);
+      if (t.size() != 6 or *end != '\0') {
+        return Fail("expected a colour like 3a7d2c, got '" + t + "'");
+      }
+      d.stroke.palette.push_back({(uint8_t)(rgb >> 16), (uint8_t)(rgb >> 8),
+                                  (uint8_t)rgb, 255});
+    }
+    return true;
+  }
+
+  // Everything else takes a single value
+  if (tokens.size() != 1) {
+    return Fail("expected a single value for '" + key + "'");
+  }
+  const std::string &v = tokens[0];
+  if (key == "ignore") {
+    if (!Symbols(v)) {
+      return false;
+    }
+    for (char c : v) {
+      d.ls.AddIgnored(c);
+    }
+    return true;
+  }
+  if (key == "angle") {
+    float degrees;
+    if (!Number(v, &degrees)) {
+      return false;
+    }
+    d.angle_delta = degrees / 360;
+    return true;
+  }
+  if (key == "step") {
+    return Integer(v, &d.step_size);
+  }
+  if (key == "width") {
+    return Number(v, &d.stroke.width);
+  }
+  if (key == "stage") {
+    return Integer(v, &d.stage);
+  }
+  if (key == "max_stage") {
+    return Integer(v, &d.max_stage);
+  }
+  if (key == "zoom") {
+    return Number(v, &d.zoom);
+  }
+  return Fail("unknown key '" + key + "'");
+}
+
+// Checks for anything that would misbehave once the system is running
+bool Parser::Validate() {
+  Demo &d = Current();
+  if (d.ls.seed.empty()) {
+    return Fail("system '" + names->back() + "' has no seed");
+  }
+  if (d.stage < 0 or d.max_stage < d.stage) {
+    return Fail("system '" + names->back() + "' needs 0 <= stage <= max_stage");
+  }
+
+  // Rules sharing a target and contexts are alternatives, which only make
+  // sense if their probabilities add up to at most 1
+  std::map<std::tuple<char, char, char, std::string, std::string>, float>
+      totals;
+  for (const Rule &r : d.ls.rules) {
+    float &total = totals[{r.target, r.left_context, r.right_context,
+                           r.left_string, r.right_string}];
+    total += r.probability;
+    if (total > 1.001f) {
+      return Fail("system '" + names->back() + "' has probabilities for '" +
+                  r.target + "' adding up to more than 1");
+    }
+  }
+
+  if (d.ls.IsParametric()) {
+    std::string symbols, seed_error;
+    ParamBuffer params;
+    if (!ParseModules(d.ls.seed, symbols, params, &seed_error)) {
+      return Fail("system '" + names->back() + "' " + seed_error);
+    }
+  }
+
+  d.ls.Reset();
+  UpdateTurtleMap(d.tm, d.ls);
+  return true;
+}
+
+} // namespace Grammar
+
+// Parses every system in text, appending them to demos and names. On failure
+// error says which line was wrong, and nothing is appended.
+bool LoadGrammar(const std::string &text, std::vector<Demo> &demos,
+                 std::vector<std::string> &names, std::string *error) {
+  std::vector<Demo> new_demos;
+  std::vector<std::string> new_names;
+  Grammar::Parser p{&new_demos, &new_names, error};
+
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string line = text.substr(start, end - start);
+    start = end + 1;
+    ++p.line_number;
+
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos or line[first] == '#') {
+      continue;
+    }
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      return p.Fail("expected 'key: value'");
+    }
+    std::vector<std::string> key = Grammar::Split(line.substr(0, colon));
+    if (key.size() != 1) {
+      return p.Fail("expected 'key: value'");
+    }
+    if (!p.ParseLine(key[0], Grammar::Split(line.substr(colon + 1)))) {
+      return false;
+    }
+  }
+  if (new_demos.empty()) {
+    *error = "no systems found";
+    return false;
+  }
+  if (!p.Validate()) {
+    return false;
+  }
+
+  for (int i = 0; i < (int)new_demos.size(); ++i) {
+    demos.push_back(std::move(new_demos[i]));
+    names.push_back(std::move(new_names[i]));
+  }
+  return true;
+}
+
+bool LoadGrammarFile(const char *path, std::vector<Demo> &demos,
+                     std::vector<std::string> &names, std::string *error) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    *error = std::string("Couldn't open ") + path;
+    return false;
+  }
+  std::string text;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    text.append(buffer, n);
+  }
+  fclose(f);
+
+  if (!LoadGrammar(text, demos, names, error)) {
+    *error = std::string(path) + ", " + *error;
+    return false;
+  }
+  return true;
+}
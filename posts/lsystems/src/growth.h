@@ -0,0 +1,424 @@
+#pragma once
+
+#include "demo.h"
+#include "ensemble.h"
+#include "lsystem.h"
+#include "turtle.h"
+
+#include "SDL.h"
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/*
+Animates a system growing from one stage to the next (like
+resources/branches.gif), without generating or drawing a whole stage per
+frame.
+
+LSystem::Step records where each symbol's replacement went (see
+track_lineage), so every symbol of the next stage knows which one it grew
+from. The first move in a move's replacement starts out as long as its
+parent, and likewise for turns, while everything else new starts out as
+nothing. So F -> F[+F]F starts as the F it replaced, and the branch and the
+second F grow out of its end. Each frame eases every length and angle from
+where it started to where it ends up: t = 0 draws the last stage and t = 1
+the next. New squares appear halfway.
+
+Styled systems (see INS_NARROW and INS_NEXT_COLOUR) also carry each
+segment's width and colour index, which start out as its parent's. Widths
+ease like lengths, and colours change halfway, so t = 1 looks just like the
+turtle's own drawing of the next stage.
+
+Only the segments after a changing symbol on the same branch ever move. The
+rest are drawn once (Growth::fixed) and kept by the app in a texture, or in a
+surface when exporting frames. Each frame then runs the turtle over just what
+changes (Growth::ops) and draws that on top. A segment whose width or colour
+changes is redrawn too, but doesn't move what comes after it. Growing a
+segment moves everything after it on its branch though, so systems like
+F -> FF, which lengthen every segment, still redraw most of the plant.
+*/
+
+// One instruction of the moving part of a growth. Lengths, and angles in turns
+// (left positive, so every turn is an INS_TURN_LEFT), ease from `from` at t =
+// 0 to `to` at t = 1. Squares are drawn once their value reaches 0.5. INS_NONE
+// moves the turtle to the next of Growth::starts, where a static part of the
+// drawing hands over to a moving one. Moves also ease their width, and switch
+// colour halfway, when the growth is styled.
+struct GrowthOp {
+  TurtleInstruction ins;
+  float from, to;
+  float width_from = 1, width_to = 1;
+  uint8_t colour_from = 0, colour_to = 0;
+};
+
+struct Growth {
+  int stage = -1; // Growing from stage to stage + 1, if not negative
+  Drawing fixed;  // Everything that doesn't move
+  std::vector<GrowthOp> ops;
+  std::vector<Vec3> starts; // x, y and the angle at each INS_NONE
+  bool styled = false;      // Whether drawings have widths and colours
+
+  bool Active() const { return stage >= 0; }
+};
+
+// Length or signed angle of a symbol, as the 2D turtle would draw it (see
+// InterpretPieces). Squares are 1 and everything else 0.
+float GrowthAmount(TurtleInstruction ins, const ParamBuffer *params, size_t i,
+                   float da) {
+  const bool param = params and params->Count(i);
+  switch (ins) {
+  case INS_MOVE_FORWARD:
+    return param ? params->Get(i)[0] : 1.0f;
+  case INS_TURN_LEFT:
+    return param ? params->Get(i)[0] / 360.0f : da;
+  case INS_TURN_RIGHT:
+    return -(param ? params->Get(i)[0] / 360.0f : da);
+  case INS_TURN_AROUND:
+    return 0.5f;
+  case INS_DRAW_SQUARE:
+    return 1.0f;
+  default:
+    return 0.0f;
+  }
+}
+
+// Symbols only grow from parents of the same kind
+TurtleInstruction GrowthKind(TurtleInstruction ins) {
+  switch (ins) {
+  case INS_MOVE_FORWARD:
+  case INS_DRAW_SQUARE:
+    return ins;
+  case INS_TURN_LEFT:
+  case INS_TURN_RIGHT:
+  case INS_TURN_AROUND:
+    return INS_TURN_LEFT;
+  default:
+    return INS_NONE;
+  }
+}
+
+// Steps ls from stage to stage + 1, splitting the turtle's output into what
+// stays put and what grows. Leaves ls at stage + 1, or returns false if
+// either stage is over its memory budget.
+bool PrepareGrowth(LSystem &ls, int stage, const TurtleMap &tm, float da,
+                   Growth &g, std::string *error = nullptr) {
+  const InstructionTable table(tm);
+  const bool styled = IsStyled(tm);
+  g.stage = -1;
+
+  // Step replaces the value, so keep what the parents' children need. An
+  // outdated value (see LSystem::Update) can't be stepped, so start again.
+  if (ls.m_outdated) {
+    ls.Reset();
+  }
+  Generate2D(ls, stage, tm, da, error);
+  if (ls.m_stage != stage) {
+    return false;
+  }
+  std::vector<TurtleInstruction> parent_kind;
+  std::vector<float> parent_amount;
+  // The turtle's width and colour at each parent, as it would draw it
+  std::vector<float> parent_width;
+  std::vector<uint8_t> parent_colour;
+  {
+    const std::string_view before = ls.Value();
+    const ParamBuffer *params = ls.Params();
+    parent_kind.resize(before.size());
+    parent_amount.resize(before.size());
+    for (size_t i = 0; i < before.size(); ++i) {
+      parent_kind[i] = GrowthKind(table[before[i]]);
+      parent_amount[i] = GrowthAmount(table[before[i]], params, i, da);
+    }
+    if (styled) {
+      parent_width.resize(before.size());
+      parent_colour.resize(before.size());
+      float width = 1;
+      uint8_t colour = 0;
+      std::vector<std::pair<float, uint8_t>> stack;
+      for (size_t i = 0; i < before.size(); ++i) {
+        const TurtleInstruction ins = table[before[i]];
+        parent_width[i] = width;
+        parent_colour[i] = colour;
+        ApplyStyle(ins, params, i, width, colour);
+        if (ins == INS_PUSH_POSITION) {
+          stack.push_back({width, colour});
+        } else if (ins == INS_POP_POSITION and !stack.empty()) {
+          std::tie(width, colour) = stack.back();
+          stack.pop_back();
+        }
+      }
+    }
+  }
+  ls.track_lineage = true;
+  ls.Generate(stage + 1, error);
+  ls.track_lineage = false;
+  if (ls.m_stage != stage + 1) {
+    return false;
+  }
+  const std::string_view value = ls.Value();
+  const ParamBuffer *params = ls.Params();
+
+  g.stage = stage;
+  g.styled = styled;
+  g.fixed.lines.triangles = false;
+  g.fixed.lines.vertices.clear();
+  g.fixed.lines.indices.clear();
+  g.fixed.squares.clear();
+  g.fixed.widths.clear();
+  g.fixed.colours.clear();
+  g.ops.clear();
+  g.starts.clear();
+
+  // A turtle is dynamic once anything before it on its branch moves. Until
+  // then its position is known now, and so is everything it draws.
+  struct State {
+    float x, y, a;
+    bool dynamic;
+    float width;
+    uint8_t colour;
+  };
+  State s = {0, 0, 0.75f, false, 1, 0};
+  std::vector<State> stack;
+  const float TWO_PI = 6.283185307;
+  auto hand_over = [&]() {
+    if (!s.dynamic) {
+      g.starts.push_back({s.x, s.y, s.a});
+      g.ops.push_back({INS_NONE, 0, 0});
+    }
+  };
+
+  for (size_t i = 0; i < parent_kind.size(); ++i) {
+    bool inherited = false;
+    for (uint64_t j = ls.m_lineage[i]; j < ls.m_lineage[i + 1]; ++j) {
+      const TurtleInstruction ins = table[value[j]];
+      const TurtleInstruction kind = GrowthKind(ins);
+      const float to = GrowthAmount(ins, params, j, da);
+      float from = kind == INS_NONE ? to : 0.0f;
+      bool child = false; // Whether this is the one grown from the parent
+      if (kind != INS_NONE and !inherited and kind == parent_kind[i]) {
+        from = parent_amount[i];
+        inherited = child = true;
+      }
+      const bool moves = s.dynamic or from != to;
+
+      switch (kind) {
+      case INS_MOVE_FORWARD: {
+        const float x = s.x - to * cosf(TWO_PI * s.a);
+        const float y = s.y - to * sinf(TWO_PI * s.a);
+        // New segments take on their style as they grow from nothing
+        float width = s.width;
+        uint8_t colour = s.colour;
+        if (styled and child) {
+          width = parent_width[i];
+          colour = parent_colour[i];
+        }
+        if (moves or width != s.width or colour != s.colour) {
+          hand_over();
+          g.ops.push_back({INS_MOVE_FORWARD, from, to, width, s.width, colour,
+                           s.colour});
+          s.dynamic |= moves;
+        } else {
+          const uint32_t n = g.fixed.lines.vertices.size();
+          g.fixed.lines.vertices.push_back({s.x, s.y, 0});
+          g.fixed.lines.vertices.push_back({x, y, 0});
+          g.fixed.lines.indices.push_back(n);
+          g.fixed.lines.indices.push_back(n + 1);
+          if (styled) {
+            g.fixed.widths.push_back(s.width);
+            g.fixed.colours.push_back(s.colour);
+          }
+        }
+        s.x = x;
+        s.y = y;
+      } break;
+      case INS_TURN_LEFT: {
+        if (moves) {
+          hand_over();
+          g.ops.push_back({INS_TURN_LEFT, from, to});
+          s.dynamic = true;
+        }
+        s.a += to;
+      } break;
+      case INS_DRAW_SQUARE: {
+        // Squares don't move the turtle, so what comes after stays put
+        if (moves) {
+          hand_over();
+          g.ops.push_back({INS_DRAW_SQUARE, from, to});
+        } else {
+          g.fixed.squares.push_back({s.x, s.y, 0});
+        }
+      } break;
+      default: {
+        ApplyStyle(ins, params, j, s.width, s.colour);
+        // Pushes and pops only need replaying where the turtle is dynamic.
+        // A pop restores the dynamic flag from its push, so they pair up.
+        if (ins == INS_PUSH_POSITION) {
+          if (s.dynamic) {
+            g.ops.push_back({INS_PUSH_POSITION, 0, 0});
+          }
+          stack.push_back(s);
+        } else if (ins == INS_POP_POSITION and !stack.empty()) {
+          s = stack.back();
+          stack.pop_back();
+          if (s.dynamic) {
+            g.ops.push_back({INS_POP_POSITION, 0, 0});
+          }
+        }
+      } break;
+      }
+    }
+  }
+  return true;
+}
+
+// Draws the moving part of g at time t, in [0, 1], into out
+void DrawGrowth(const Growth &g, float t, Drawing &out) {
+  const float TWO_PI = 6.283185307;
+  out.lines.triangles = false;
+  out.lines.vertices.clear();
+  out.lines.indices.clear();
+  out.squares.clear();
+  out.widths.clear();
+  out.colours.clear();
+
+  // One per thread, like the turtle's stack in InterpretPieces
+  thread_local std::vector<Vec3> stack;
+  stack.clear();
+  float x = 0, y = 0, a = 0.75f;
+  size_t start = 0;
+  for (const GrowthOp &op : g.ops) {
+    const float v = op.from + (op.to - op.from) * t;
+    switch (op.ins) {
+    case INS_NONE: {
+      const Vec3 &p = g.starts[start++];
+      x = p.x;
+      y = p.y;
+      a = p.z;
+    } break;
+    case INS_MOVE_FORWARD: {
+      const uint32_t n = out.lines.vertices.size();
+      out.lines.vertices.push_back({x, y, 0});
+      x -= v * cosf(TWO_PI * a);
+      y -= v * sinf(TWO_PI * a);
+      out.lines.vertices.push_back({x, y, 0});
+      out.lines.indices.push_back(n);
+      out.lines.indices.push_back(n + 1);
+      if (g.styled) {
+        out.widths.push_back(op.width_from +
+                             (op.width_to - op.width_from) * t);
+        out.colours.push_back(t < 0.5f ? op.colour_from : op.colour_to);
+      }
+    } break;
+    case INS_TURN_LEFT: {
+      a += v;
+    } break;
+    case INS_DRAW_SQUARE: {
+      if (v >= 0.5f) {
+        out.squares.push_back({x, y, 0});
+      }
+    } break;
+    case INS_PUSH_POSITION: {
+      stack.push_back({x, y, a});
+    } break;
+    case INS_POP_POSITION: {
+      x = stack.back().x;
+      y = stack.back().y;
+      a = stack.back().z;
+      stack.pop_back();
+    } break;
+    default:
+      break;
+    }
+  }
+}
+
+// Draws demo growing from stage 0 to stage, frames_per_stage frames for each
+// step and a last one of the final stage, as size x size BMPs named by
+// SeedPath(path, frame). Every frame uses the same scale, fitted to the
+// largest stage.
+bool ExportGrowth(const Demo &demo, int stage, int frames_per_stage, int size,
+                  const char *path, std::string *error) {
+  Demo d = demo;
+  const SDL_Colour bg = d.clear_colour, fg = d.turtle_colour;
+
+  Bounds bounds;
+  Drawing drawing;
+  d.ls.Reset();
+  for (int s = 0; s <= stage; ++s) {
+    if (!Interpret2D(d.ls, s, d.tm, d.angle_delta, drawing, error)) {
+      return false;
+    }
+    bounds.Extend(drawing);
+  }
+  SDL_FPoint origin = {size / 2.0f, size / 2.0f};
+  float step = 1;
+  if (!bounds.Empty()) {
+    Fit(bounds, size, size, &origin, &step);
+  }
+
+  // The fixed part of each step is drawn once into base, which is copied
+  // into frame before drawing what moves
+  SDL_Surface *base = SDL_CreateRGBSurfaceWithFormat(0, size, size, 32,
+                                                     SDL_PIXELFORMAT_ARGB8888);
+  SDL_Surface *frame = SDL_CreateRGBSurfaceWithFormat(
+      0, size, size, 32, SDL_PIXELFORMAT_ARGB8888);
+  SDL_Renderer *base_r = base ? SDL_CreateSoftwareRenderer(base) : nullptr;
+  SDL_Renderer *frame_r = frame ? SDL_CreateSoftwareRenderer(frame) : nullptr;
+  bool ok = base_r and frame_r;
+  if (!ok) {
+    *error = std::string("Couldn't create a renderer: ") + SDL_GetError();
+  }
+
+  Growth g;
+  d.ls.Reset();
+  uint32_t n = 0;
+  for (int s = 0; ok and s <= stage; ++s) {
+    const bool last = s == stage;
+    if (last ? !Interpret2D(d.ls, s, d.tm, d.angle_delta, drawing, error)
+             : !PrepareGrowth(d.ls, s, d.tm, d.angle_delta, g, error)) {
+      ok = false;
+      break;
+    }
+    SDL_SetRenderDrawColor(base_r, bg.r, bg.g, bg.b, 255);
+    SDL_RenderClear(base_r);
+    SDL_SetRenderDrawColor(base_r, fg.r, fg.g, fg.b, 255);
+    if (last) {
+      Render(base_r, drawing, origin, step, d.stroke);
+    } else {
+      Render(base_r, g.fixed, origin, step, d.stroke);
+    }
+    SDL_RenderPresent(base_r);
+
+    for (int f = 0; ok and f < (last ? 1 : frames_per_stage); ++f) {
+      SDL_BlitSurface(base, NULL, frame, NULL);
+      if (!last) {
+        DrawGrowth(g, (float)f / frames_per_stage, drawing);
+        SDL_SetRenderDrawColor(frame_r, fg.r, fg.g, fg.b, 255);
+        Render(frame_r, drawing, origin, step, d.stroke);
+        SDL_RenderPresent(frame_r);
+      }
+      const std::string name = SeedPath(path, n++);
+      if (SDL_SaveBMP(frame, name.c_str()) != 0) {
+        *error = "Couldn't write " + name;
+        ok = false;
+      }
+    }
+  }
+
+  if (base_r) {
+    SDL_DestroyRenderer(base_r);
+  }
+  if (frame_r) {
+    SDL_DestroyRenderer(frame_r);
+  }
+  if (base) {
+    SDL_FreeSurface(base);
+  }
+  if (frame) {
+    SDL_FreeSurface(frame);
+  }
+  return ok;
+}
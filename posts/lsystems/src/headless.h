@@ -0,0 +1,234 @@
+#pragma once
+
+#include "demo.h"
+#include "ensemble.h"
+#include "examples.h"
+#include "growth.h"
+#include "turtle3d.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+Command line export, which runs without opening a window:
+
+  fern [systems...] --obj tree.obj [--example N] [--stage N] [--sides N]
+                                   [--radius R] [--simplify]
+  fern [systems...] --seeds 100 --sheet forest.bmp [--first-seed N]
+                                   [--images tree.bmp] [--cell N] [--threads N]
+  fern [systems...] --grow frame.bmp [--frames N] [--example N] [--stage N]
+
+  Any of them can also take --budget MB.
+
+  --example  Index into the examples, where systems from the command line
+             come after the built in ones (default 0)
+  --stage    Stage to generate (default: the example's own stage)
+  --budget   Most memory to generate a stage with, in MB, or 0 for no limit
+             (default 1024, see LSystem::Generate)
+  --obj      Write the 3D turtle's mesh as Wavefront OBJ
+  --ply      Write the 3D turtle's mesh as binary PLY
+  --sides    Output tubes with this many sides rather than lines
+  --radius   Tube radius, as a fraction of the step size (default 0.1)
+  --simplify Merge and deduplicate segments first (lines only, see geometry.h)
+
+  --seeds      Grow the example with this many rng seeds (see ensemble.h).
+               Meshes and images are written once per seed, as tree_<seed>.obj
+  --first-seed First of the seeds (default 0)
+  --sheet      Draw every seed into one grid, as a BMP
+  --images     Draw each seed into its own BMP
+  --cell       Size of each image in pixels (default 256)
+  --threads    Threads to use (default one per core)
+
+  --grow    Animate the example growing from stage 0 (see growth.h), as one
+            BMP per frame: frame_0.bmp, frame_1.bmp... Uses --cell for size
+  --frames  Frames for each stage to grow into the next (default 30)
+*/
+
+struct HeadlessOptions {
+  int example = 0;
+  int stage = -1;
+  uint64_t budget_mb = DEFAULT_MEMORY_BUDGET >> 20;
+  const char *obj_path = nullptr;
+  const char *ply_path = nullptr;
+  int sides = 0;
+  float radius = 0.1f;
+  bool simplify = false;
+
+  uint32_t seeds = 0;
+  uint32_t first_seed = 0;
+  const char *sheet_path = nullptr;
+  const char *image_path = nullptr;
+  int cell_size = 256;
+  int threads = 0;
+
+  const char *grow_path = nullptr;
+  int frames = 30;
+
+  bool Enabled() const {
+    return obj_path or ply_path or sheet_path or image_path or grow_path;
+  }
+};
+
+// Takes the export flags out of argv, leaving the system files in files
+bool ParseHeadlessArgs(int argc, char *argv[], HeadlessOptions &opts,
+                       std::vector<const char *> &files, std::string *error) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg.size() < 2 or arg.substr(0, 2) != "--") {
+      files.push_back(argv[i]);
+      continue;
+    }
+    if (arg == "--simplify") {
+      opts.simplify = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      *error = arg + " needs a value";
+      return false;
+    }
+    const char *value = argv[++i];
+    char *end;
+    if (arg == "--obj") {
+      opts.obj_path = value;
+    } else if (arg == "--ply") {
+      opts.ply_path = value;
+    } else if (arg == "--example") {
+      opts.example = strtol(value, &end, 10);
+    } else if (arg == "--stage") {
+      opts.stage = strtol(value, &end, 10);
+    } else if (arg == "--budget") {
+      opts.budget_mb = strtoull(value, &end, 10);
+    } else if (arg == "--sides") {
+      opts.sides = strtol(value, &end, 10);
+    } else if (arg == "--radius") {
+      opts.radius = strtof(value, &end);
+    } else if (arg == "--seeds") {
+      opts.seeds = strtoul(value, &end, 10);
+    } else if (arg == "--first-seed") {
+      opts.first_seed = strtoul(value, &end, 10);
+    } else if (arg == "--sheet") {
+      opts.sheet_path = value;
+    } else if (arg == "--images") {
+      opts.image_path = value;
+    } else if (arg == "--cell") {
+      opts.cell_size = strtol(value, &end, 10);
+    } else if (arg == "--threads") {
+      opts.threads = strtol(value, &end, 10);
+    } else if (arg == "--grow") {
+      opts.grow_path = value;
+    } else if (arg == "--frames") {
+      opts.frames = strtol(value, &end, 10);
+    } else {
+      *error = "unknown option " + arg;
+      return false;
+    }
+    const bool is_path = arg == "--obj" or arg == "--ply" or
+                         arg == "--sheet" or arg == "--images" or
+                         arg == "--grow";
+    if (!is_path and (*value == '\0' or *end)) {
+      *error = arg + " expects a number, got '" + value + "'";
+      return false;
+    }
+    // Kept in bytes, see RunHeadless
+    if (arg == "--budget" and opts.budget_mb > UINT64_MAX >> 20) {
+      *error = "--budget can be at most " + std::to_string(UINT64_MAX >> 20) +
+               " MB, got '" + value + "'";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Generates the chosen example and writes its mesh and/or images, returning
+// the exit code. loaded are the examples from the command line, which come
+// after the built in ones.
+int RunHeadless(const HeadlessOptions &opts, const std::vector<Demo> &loaded) {
+  const size_t n_examples = N_EXAMPLES + loaded.size();
+  if (opts.example < 0 or (size_t)opts.example >= n_examples) {
+    std::cerr << "--example must be below " << n_examples << '\n';
+    return 1;
+  }
+  if (opts.cell_size <= 0) {
+    std::cerr << "--cell must be positive\n";
+    return 1;
+  }
+  Demo d = PickExample(opts.example, loaded);
+  const int stage = opts.stage < 0 ? d.stage : opts.stage;
+  d.ls.memory_budget = opts.budget_mb << 20;
+
+  if (opts.grow_path) {
+    if (opts.frames <= 0) {
+      std::cerr << "--frames must be positive\n";
+      return 1;
+    }
+    std::string error;
+    if (!ExportGrowth(d, stage, opts.frames, opts.cell_size, opts.grow_path,
+                      &error)) {
+      std::cerr << error << '\n';
+      return 1;
+    }
+    std::cout << stage * opts.frames + 1 << " frames\n";
+    if (!opts.obj_path and !opts.ply_path and !opts.sheet_path and
+        !opts.image_path) {
+      return 0;
+    }
+  }
+
+  Turtle3DOptions t;
+  t.step = d.step_size;
+  t.da = d.angle_delta;
+  t.sides = opts.sides;
+  t.radius = opts.radius * d.step_size;
+
+  // Images always go through the ensemble, with the example's own seed if no
+  // range was given
+  if (opts.seeds > 0 or opts.sheet_path or opts.image_path) {
+    EnsembleOptions e;
+    e.first_seed = opts.seeds > 0 ? opts.first_seed : d.ls.rng_seed;
+    e.count = std::max(opts.seeds, 1u);
+    e.stage = stage;
+    e.threads = opts.threads;
+    e.simplify = opts.simplify;
+    e.cell_size = opts.cell_size;
+    e.sheet_path = opts.sheet_path;
+    e.image_path = opts.image_path;
+    e.obj_path = opts.obj_path;
+    e.ply_path = opts.ply_path;
+    e.turtle3d = t;
+
+    std::string error;
+    if (!RunEnsemble(d, e, &error)) {
+      std::cerr << error << '\n';
+      return 1;
+    }
+    std::cout << e.count << " seeds from " << e.first_seed << '\n';
+    return 0;
+  }
+
+  Mesh mesh;
+  std::string error;
+  // Open systems are answered by the 2D turtle, see Generate2D
+  const std::string_view value =
+      Generate2D(d.ls, stage, d.tm, d.angle_delta, &error);
+  bool ok = d.ls.m_stage == stage and
+            Interpret3D(value, d.tm, t, mesh, d.ls.Params(), &error);
+  if (ok and opts.simplify) {
+    Simplify(mesh, 1e-4f * d.step_size);
+  }
+  if (ok and opts.obj_path) {
+    ok = WriteOBJ(mesh, opts.obj_path, &error);
+  }
+  if (ok and opts.ply_path) {
+    ok = WritePLY(mesh, opts.ply_path, &error);
+  }
+  if (!ok) {
+    std::cerr << error << '\n';
+    return 1;
+  }
+  std::cout << mesh.vertices.size() << " vertices, "
+            << mesh.indices.size() / (mesh.triangles ? 3 : 2)
+            << (mesh.triangles ? " triangles\n" : " segments\n");
+  return 0;
+}
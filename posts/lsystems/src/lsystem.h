@@ -1,25 +1,40 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cassert>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include "context.h"
+#include "parametric.h"
+
 // Special chars for context rules
 // TODO - check if this is a bad idea...
 const char CON_END = '\0'; // Passed when the context is empty (no more chars)
 const char CON_IGNORE = '\1';   // Rule doesn't care about context
 const char CON_WILDCARD = '\2'; // Any non-null char will match
 
+bool ContextMatches(char context, char c) {
+  return (context == c) or (context == CON_IGNORE) or
+         (context == CON_WILDCARD and c != CON_END);
+}
+
 struct Rule {
   bool Match(char t, char c_l, char c_r) const {
-    bool l_matches = (left_context == c_l) or (left_context == CON_IGNORE) or
-                     (left_context == CON_WILDCARD and c_l != CON_END);
-    bool r_matches = (right_context == c_r) or (right_context == CON_IGNORE) or
-                     (right_context == CON_WILDCARD and c_r != CON_END);
-    return (t == target) and l_matches and r_matches;
+    return (t == target) and ContextMatches(left_context, c_l) and
+           ContextMatches(right_context, c_r);
   }
 
   char target;
@@ -28,26 +43,197 @@ struct Rule {
   char left_context = CON_IGNORE;
   char right_context = CON_IGNORE;
   float probability = 1.0f;
+
+  // Contexts of more than one symbol, written in reading order as in
+  // BC < A > DE, so the last symbol of left_string and the first of
+  // right_string are the neighbours. They must match as well as the single
+  // symbol contexts above, see context.h. right_string may have branches, as
+  // in BC < A > D[E]F, see LSystem::RightTreeMatches.
+  std::string left_string = "";
+  std::string right_string = "";
+
+  bool HasContext() const {
+    return left_context != CON_IGNORE or right_context != CON_IGNORE or
+           !left_string.empty() or !right_string.empty();
+  }
+};
+
+// A Rule packed for the hot path, see LSystem::Compile
+struct CompiledRule {
+  uint32_t offset, length; // Replacement, in LSystem::m_rule_bodies
+  char left_context;
+  char right_context;
+  float probability;
+  uint32_t left_pattern, right_pattern; // In LSystem::m_*_contexts
+  uint32_t right_tree; // In LSystem::m_tree_contexts, or NO_PATTERN
+};
+
+// SplitMix64 (Steele et al.), used instead of rand so each LSystem has its own
+// state and the same seed grows the same plant on every platform
+struct Random {
+  uint64_t state = 0;
+
+  void Seed(uint32_t seed) { state = seed; }
+  // Same as calling NextInt n times, so a range of a stage can be rewritten
+  // without stepping through everything before it
+  void Skip(uint64_t n) { state += n * 0x9e3779b97f4a7c15ull; }
+  uint64_t NextInt() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+  // Uniform in [0, 1)
+  float Next() { return (NextInt() >> 40) * (1.0f / (1 << 24)); }
+};
+
+// Summary of the system at some stage, calculated from the rules without
+// generating the string. See LSystem::Predict.
+struct StageStats {
+  double length = 0;
+  double counts[128] = {0}; // How many of each symbol
+  // Deepest nesting of '[' and ']'. That's the turtle's stack size when they
+  // push and pop, as in every example, but Predict doesn't see the turtle map
+  // so other push and pop symbols aren't counted.
+  double max_depth = 0;
+
+  // Only deterministic, context-free systems give exact values. Stochastic
+  // rules give expected values. Symbols with context-sensitive or parametric
+  // rules could become any of their replacements, or stay as they are, so
+  // they're assumed to give the most of each symbol any of those would
+  // (making counts, length and max_depth upper bounds).
+  bool exact = true;
 };
 
+// Generate refuses to step past this many bytes unless told otherwise, which
+// leaves room for everything else in a 32 bit WASM heap
+constexpr uint64_t DEFAULT_MEMORY_BUDGET = 1ull << 30;
+
 struct LSystem {
   void Reset();
 
+  // Call after editing the rules or seed, instead of Reset. Deterministic,
+  // context-free systems keep their current stage, only re-expanding the parts
+  // of it that used a changed rule. If the new stage would be over the memory
+  // budget, the old one is kept instead with error set, and m_outdated until
+  // another stage is generated.
+  void Update(std::string *error = nullptr);
+  bool m_outdated = false; // Value is from before the last edit
+
   bool CharUsed(char c) const;
 
-  const std::string &Generate(int stage);
+  // If a step would take more than memory_budget bytes (see StepBytes), stops
+  // before it with error set, leaving m_stage below stage and returning an
+  // empty view. No limit if memory_budget is 0.
+  std::string_view Generate(int stage, std::string *error = nullptr);
   void Step();
+  uint64_t memory_budget = DEFAULT_MEMORY_BUDGET;
+
+  // Bytes Step would hold at once, i.e. the current value, the next one and
+  // everything kept alongside them. Exact for deterministic, context-free
+  // systems and an upper bound for others (but for parametric symbols, only
+  // an estimate), from how many of each symbol there are now and what each
+  // can become.
+  double StepBytes() const;
+  // Same, from a value of length to one of next_length, e.g. from Predict
+  double StepBytes(double length, double next_length) const;
+  // Most symbols one symbol can become in a step, and the most parameters any
+  // of them can have, filled in by Compile
+  uint32_t m_max_growth[128];
+  int m_max_arity = 0;
+
+  // Step splits values longer than this between threads
+  static constexpr size_t PARALLEL_STEP_LENGTH = 1 << 20;
+  int threads = 0; // Most threads Step may use, one per core if 0
+  int StepThreads(size_t size) const; // How many it uses for size symbols
+  void StepRange(size_t begin, size_t end, std::string &out,
+                 uint64_t *lineage) const;
+
+  // When set, Step records where the replacement of each symbol starts in the
+  // new value, so symbol i of the old value became [m_lineage[i],
+  // m_lineage[i + 1]) of the new one. See growth.h.
+  bool track_lineage = false;
+  std::vector<uint64_t> m_lineage;
+
+  // Use an already generated value, such as one mapped from a file, for the
+  // provided stage. owner keeps the memory behind value alive.
+  void Preload(int stage, std::string_view value,
+               std::shared_ptr<const void> owner);
+  std::string_view Value() const {
+    return m_preloaded.data() ? m_preloaded : std::string_view(m_value);
+  }
+  // Where the bracket matching the '[' or ']' at i of the value is, or
+  // NO_BRACKET for other symbols and unmatched brackets. Indexes the value
+  // first unless it already is (see m_brackets), then each lookup is O(1).
+  uint64_t MatchingBracket(uint64_t i);
+  // The branch opened or closed at i, brackets included, or an empty view
+  std::string_view Branch(uint64_t i);
   void RegenerateRNG();
 
-  std::string FindReplacement(char t, char c_l, char c_rs) const;
-  char FindLNeighbour(int position, int depth = 0) const;
-  char FindRNeighbour(int position, int depth = 0) const;
+  StageStats Predict(int stage) const;
+  // Different after every Compile and every Update, in any system, so a
+  // Predict can be cached until it changes
+  uint64_t m_revision = 0;
+  void Revise() {
+    static std::atomic<uint64_t> revisions{0};
+    m_revision = ++revisions;
+  }
+
+  // Random access into a stage without generating it. Only deterministic,
+  // context-free systems can seek, others fall back to GeneratedValue. Like
+  // Generate, they leave m_stage below stage and set error on failure, and
+  // return 0 or an empty string.
+  bool CanSeek() const;
+  uint64_t Length(int stage, std::string *error = nullptr);
+  std::string Window(int stage, uint64_t start, size_t count,
+                     std::string *error = nullptr);
+
+  // Calls piece with the value at the provided stage, in order, as a series of
+  // string pieces. Seekable systems are walked straight from the derivation
+  // tree of their seed and rules, so the string is never built and stepping
+  // only adds a row to m_lengths. Every other system is generated, and its
+  // whole value held as usual, then passed as one piece. Returns false with
+  // error set, without calling piece, if the stage can't be had (see
+  // GeneratedValue).
+  template <typename F>
+  bool Expand(int stage, F &&piece, std::string *error = nullptr);
+
+  // Generate, for the systems that can't seek. Parametric systems may be open
+  // (see IsOpen in turtle.h), where each stage's queries are answered by the
+  // turtle before it's stepped, so they aren't stepped here at all: they must
+  // already be at stage, e.g. from Generate2D.
+  std::string_view GeneratedValue(int stage, std::string *error);
+
+  void Compile();
+  std::string_view FindReplacement(char t, char c_l, char c_r, float s,
+                                   uint32_t s_l = 0, uint32_t s_r = 0,
+                                   size_t at = 0) const;
 
   std::string seed;
   std::vector<Rule> rules;
   std::string m_value;
   int m_stage;
 
+  // When there are parametric rules, only they are used to step the system,
+  // and the seed may give its symbols parameters. See parametric.h.
+  std::vector<ParametricRule> parametric_rules;
+  bool IsParametric() const { return !parametric_rules.empty(); }
+  void StepParametric();
+  int m_answered = -1; // Stage whose query modules were answered, see turtle.h
+
+  // Parameters for each symbol of m_value, or null if there aren't any
+  const ParamBuffer *Params() const {
+    return IsParametric() and m_params.start.size() == m_value.size() + 1
+               ? &m_params
+               : nullptr;
+  }
+  ParamBuffer m_params, m_next_params;
+  std::vector<uint32_t> m_prule_order; // Parametric rules grouped by target
+  uint32_t m_first_prule[129];
+
+  std::string_view m_preloaded; // When set, used instead of m_value
+  std::shared_ptr<const void> m_preloaded_owner;
+
   void AddIgnored(char c) {
     unsigned char index = c;
     assert(index < 128);
@@ -65,25 +251,392 @@ struct LSystem {
   uint64_t ignore_list[2] = {0};
 
   uint32_t rng_seed = time(NULL);
+
+  // m_lengths[n][c] is the length of symbol c after n steps, used for seeking
+  std::vector<std::array<uint64_t, 128>> m_lengths;
+  int m_seek_rules[128]; // Index of the rule used for each symbol, or -1
+  void BuildLengths(int stage);
+
+  // Arena holding every replacement back to back, with the rules grouped by
+  // target so each symbol only looks at its own. Rebuilt by Reset, so rules
+  // must not be edited without calling it.
+  std::string m_rule_bodies;
+  std::vector<CompiledRule> m_compiled;
+  uint32_t m_first_rule[129]; // Rules for c are [m_first_rule[c], [c + 1])
+
+  // Spare buffer for Step, swapped with m_value to keep its capacity around
+  std::string m_next;
+  std::vector<std::string> m_next_parts; // Output of Step's other threads
+
+  // Automata for every multi symbol context of the rules, see context.h
+  ContextAutomaton m_left_contexts, m_right_contexts;
+  // Right contexts with branches, which aren't a sequence of neighbours so
+  // can't be run through an automaton
+  std::vector<std::string> m_tree_contexts;
+  bool RightTreeMatches(size_t at, std::string_view pattern) const;
+  bool m_has_contexts = false; // Whether Step needs FindNeighbours
+
+  // The nearest neighbours of each symbol of the value, and the states of
+  // the context automata for its neighbour sequences. Filled in by
+  // FindNeighbours, the states only when there are multi symbol contexts.
+  std::vector<char> m_left, m_right;
+  std::vector<uint32_t> m_left_state, m_right_state;
+  void FindNeighbours();
+
+  // Where the bracket matching each '[' and ']' of the value is, or
+  // NO_BRACKET for other symbols and unmatched brackets. So a branch is [i,
+  // m_brackets[i]], and skipping it is one lookup however long it is. Step
+  // builds it for the new value of systems with contexts, which need it for
+  // their next step, and MatchingBracket for anything else. Empty when out of
+  // date.
+  static constexpr uint64_t NO_BRACKET = UINT64_MAX;
+  std::vector<uint64_t> m_brackets;
+  void IndexBrackets();
+
+  // The system as of the last Compile, so Update can tell what changed
+  std::string m_compiled_seed;
+  bool m_compiled_can_seek = false;
+  std::string_view CompiledReplacement(unsigned char c) const {
+    return m_first_rule[c] < m_first_rule[c + 1]
+               ? std::string_view(m_rule_bodies.data() +
+                                      m_compiled[m_first_rule[c]].offset,
+                                  m_compiled[m_first_rule[c]].length)
+               : std::string_view(m_rule_bodies.data() + c, 1);
+  }
 };
 
 // Returns the value of the system at the provided stage. This may involve
 // resetting and/or advancing the system depending on it's current state.
-const std::string &LSystem::Generate(int stage) {
-  if (m_stage > stage) {
+std::string_view LSystem::Generate(int stage, std::string *error) {
+  // An outdated value can't be stepped with the new rules
+  if (m_stage > stage or (m_outdated and m_stage != stage)) {
     Reset();
   }
 
-  for (int i = m_stage; i < stage; ++i) {
+  while (m_stage < stage) {
+    const double bytes = StepBytes();
+    if (memory_budget and bytes > memory_budget) {
+      if (error) {
+        char message[128];
+        snprintf(message, sizeof(message),
+                 "Stage %d would need %.1f MB, over the memory budget of "
+                 "%.1f MB",
+                 m_stage + 1, bytes / (1 << 20),
+                 memory_budget / (double)(1 << 20));
+        *error = message;
+      }
+      return {};
+    }
     Step();
   }
 
-  return m_value;
+  return Value();
+}
+
+double LSystem::StepBytes() const {
+  const std::string_view value = Value();
+  uint64_t counts[128] = {0};
+  for (char c : value) {
+    ++counts[(unsigned char)c & 127];
+  }
+  double next = 0;
+  for (int c = 0; c < 128; ++c) {
+    next += (double)counts[c] * m_max_growth[c];
+  }
+  return StepBytes(value.size(), next);
+}
+
+double LSystem::StepBytes(double length, double next_length) const {
+  // Each symbol of a parametric value also has a start index and parameters
+  const double symbol = IsParametric() ? 5 + 4.0 * m_max_arity : 1;
+  double scratch = 0; // Per symbol of the value being stepped
+  double index = 0;   // Per symbol of the new one
+  if (m_has_contexts) {
+    // Neighbours, their states and m_brackets, for both values
+    scratch += (m_left_contexts.words or m_right_contexts.words ? 10 : 2) + 8;
+    index = 8;
+  }
+  if (track_lineage) {
+    scratch += 8;
+  }
+  return length * (symbol + scratch) + next_length * (symbol + index);
+}
+
+void LSystem::Preload(int stage, std::string_view value,
+                      std::shared_ptr<const void> owner) {
+  Reset();
+  m_stage = stage;
+  m_value.clear();
+  m_preloaded = value;
+  m_preloaded_owner = std::move(owner);
+  m_params.Clear();
 }
 
 void LSystem::Reset() {
   m_stage = 0;
+  m_answered = -1;
   m_value = seed;
+  m_brackets.clear();
+  m_params.Clear();
+  if (IsParametric()) {
+    std::string error;
+    if (!ParseModules(seed, m_value, m_params, &error)) {
+      // Treat it as a plain string, with no parameters
+      m_value = seed;
+      m_params.start.assign(seed.size() + 1, 0);
+    }
+  }
+  m_preloaded = {};
+  m_preloaded_owner.reset();
+  m_lengths.clear();
+  Compile();
+}
+
+void LSystem::Compile() {
+  // The first 128 chars of the arena are the identity replacements, for
+  // symbols that no rule matched
+  m_rule_bodies.clear();
+  for (int c = 0; c < 128; ++c) {
+    m_rule_bodies += (char)c;
+  }
+  m_compiled.clear();
+
+  // Counting sort by target, which keeps the order of rules with the same
+  // target (FindReplacement relies on this for stochastic rules)
+  uint32_t counts[128] = {0};
+  for (const Rule &r : rules) {
+    unsigned char t = r.target;
+    assert(t < 128);
+    ++counts[t];
+  }
+  m_first_rule[0] = 0;
+  for (int c = 0; c < 128; ++c) {
+    m_first_rule[c + 1] = m_first_rule[c] + counts[c];
+  }
+
+  m_compiled.resize(rules.size());
+  m_left_contexts.Clear();
+  m_right_contexts.Clear();
+  m_tree_contexts.clear();
+  m_has_contexts = false;
+  uint32_t next[128];
+  std::copy(m_first_rule, m_first_rule + 128, next);
+  for (const Rule &r : rules) {
+    const std::string reversed(r.right_string.rbegin(), r.right_string.rend());
+    const bool tree = r.right_string.find_first_of("[]") != std::string::npos;
+    if (tree) {
+      m_tree_contexts.push_back(r.right_string);
+    }
+    m_compiled[next[(unsigned char)r.target]++] = {
+        (uint32_t)m_rule_bodies.size(),
+        (uint32_t)r.replacement.size(),
+        r.left_context,
+        r.right_context,
+        r.probability,
+        r.left_string.empty() ? ContextAutomaton::NO_PATTERN
+                              : m_left_contexts.Add(r.left_string),
+        r.right_string.empty() or tree ? ContextAutomaton::NO_PATTERN
+                                       : m_right_contexts.Add(reversed),
+        tree ? (uint32_t)m_tree_contexts.size() - 1
+             : ContextAutomaton::NO_PATTERN};
+    m_rule_bodies += r.replacement;
+    m_has_contexts |= r.HasContext();
+  }
+  m_left_contexts.Build();
+  m_right_contexts.Build();
+
+  // Same again for the parametric rules, but by index
+  uint32_t p_counts[128] = {0};
+  for (const ParametricRule &r : parametric_rules) {
+    unsigned char t = r.target;
+    assert(t < 128);
+    ++p_counts[t];
+  }
+  m_first_prule[0] = 0;
+  for (int c = 0; c < 128; ++c) {
+    m_first_prule[c + 1] = m_first_prule[c] + p_counts[c];
+  }
+  m_prule_order.resize(parametric_rules.size());
+  std::copy(m_first_prule, m_first_prule + 128, next);
+  for (int i = 0; i < (int)parametric_rules.size(); ++i) {
+    m_prule_order[next[(unsigned char)parametric_rules[i].target]++] = i;
+  }
+
+  // Mirrors FindReplacement: a symbol can stay as it is unless its rules
+  // without a context always pick one of themselves
+  for (int c = 0; c < 128; ++c) {
+    uint32_t most = 0;
+    double remaining = 1.0;
+    for (uint32_t i = m_first_rule[c]; i < m_first_rule[c + 1]; ++i) {
+      const CompiledRule &r = m_compiled[i];
+      most = std::max(most, r.length);
+      if (r.left_context == CON_IGNORE and r.right_context == CON_IGNORE and
+          r.left_pattern == ContextAutomaton::NO_PATTERN and
+          r.right_pattern == ContextAutomaton::NO_PATTERN and
+          r.right_tree == ContextAutomaton::NO_PATTERN) {
+        remaining -= r.probability;
+      }
+    }
+    m_max_growth[c] = remaining > 0 ? std::max(most, 1u) : most;
+  }
+  // Parametric rules replace the others, and any symbol can stay as it is,
+  // keeping its parameters, if no condition holds
+  m_max_arity = 0;
+  if (IsParametric()) {
+    std::fill(m_max_growth, m_max_growth + 128, 1u);
+    for (const ParametricRule &r : parametric_rules) {
+      uint32_t &most = m_max_growth[(unsigned char)r.target];
+      most = std::max(most, (uint32_t)r.successor.size());
+      m_max_arity = std::max(m_max_arity, r.arity);
+      for (uint8_t arity : r.successor_arity) {
+        m_max_arity = std::max(m_max_arity, (int)arity);
+      }
+    }
+    for (size_t i = 0; i + 1 < m_params.start.size(); ++i) {
+      m_max_arity = std::max(m_max_arity, m_params.Count(i));
+    }
+  }
+
+  m_compiled_seed = seed;
+  m_compiled_can_seek = CanSeek();
+  m_outdated = false;
+  Revise();
+}
+
+void LSystem::Update(std::string *error) {
+  // Stochastic and context-sensitive rules can change anywhere after an edit,
+  // as can anything when the seed changes
+  if (m_stage == 0 or !m_compiled_can_seek or !CanSeek() or
+      seed != m_compiled_seed) {
+    Reset();
+    return;
+  }
+  const int stage = m_stage;
+
+  // The old replacements are still in the arena, the new ones are the first
+  // rule for each target (as with seeking)
+  std::string_view before[128], after[128];
+  std::bitset<128> changed;
+  for (int c = 0; c < 128; ++c) {
+    before[c] = CompiledReplacement(c);
+    after[c] = std::string_view(m_rule_bodies.data() + c, 1);
+  }
+  for (int i = rules.size() - 1; i >= 0; --i) {
+    after[(unsigned char)rules[i].target] = rules[i].replacement;
+  }
+  for (int c = 0; c < 128; ++c) {
+    changed[c] = before[c] != after[c];
+  }
+  if (changed.none()) {
+    Compile();
+    return;
+  }
+
+  // For each symbol c expanded k times: the lengths before and after, and
+  // which symbols' rules the old expansion used. An expansion using none of
+  // the changed rules is the same as it was.
+  std::vector<std::array<uint64_t, 128>> old_len(stage + 1), new_len(stage + 1);
+  std::vector<std::array<std::bitset<128>, 128>> uses(stage + 1);
+  old_len[0].fill(1);
+  new_len[0].fill(1);
+  for (int k = 1; k <= stage; ++k) {
+    for (int c = 0; c < 128; ++c) {
+      uint64_t o = 0, n = 0;
+      uses[k][c][c] = true;
+      for (char r : before[c]) {
+        o = std::min(o + old_len[k - 1][(unsigned char)r], UINT64_MAX / 2);
+        uses[k][c] |= uses[k - 1][(unsigned char)r];
+      }
+      for (char r : after[c]) {
+        n = std::min(n + new_len[k - 1][(unsigned char)r], UINT64_MAX / 2);
+      }
+      old_len[k][c] = o;
+      new_len[k][c] = n;
+    }
+  }
+
+  uint64_t total = 0;
+  for (char c : seed) {
+    total = std::min(total + new_len[stage][(unsigned char)c], UINT64_MAX / 2);
+  }
+  // Too big, so keep the old value rather than throwing it away. The arena
+  // still holds the rules it was expanded with, so the next Update compares
+  // against those. Seeking uses the new rules.
+  const double bytes = StepBytes(Value().size(), total);
+  if (total > m_next.max_size() / 2 or
+      (memory_budget and bytes > memory_budget)) {
+    if (error) {
+      char message[160];
+      snprintf(message, sizeof(message),
+               "Stage %d would need %.1f MB after this edit, over the memory "
+               "budget of %.1f MB, so it still shows the old rules",
+               stage, bytes / (1 << 20), memory_budget / (double)(1 << 20));
+      *error = message;
+    }
+    m_outdated = true;
+    m_lengths.clear();
+    Revise();
+    return;
+  }
+
+  // Where each expansion first appears in the old value. Only the first
+  // occurrence of each is walked into, so this visits at most 128 * stage
+  // replacements rather than the whole derivation.
+  const uint64_t NONE = UINT64_MAX;
+  std::vector<std::array<uint64_t, 128>> old_at(stage + 1), new_at(stage + 1);
+  for (int k = 0; k <= stage; ++k) {
+    old_at[k].fill(NONE);
+    new_at[k].fill(NONE);
+  }
+  auto find = [&](auto &self, unsigned char c, int k, uint64_t at) -> void {
+    if (old_at[k][c] != NONE) {
+      return;
+    }
+    old_at[k][c] = at;
+    if (k > 0) {
+      for (char r : before[c]) {
+        self(self, r, k - 1, at);
+        at += old_len[k - 1][(unsigned char)r];
+      }
+    }
+  };
+  uint64_t at = 0;
+  for (char c : seed) {
+    find(find, c, stage, at);
+    at += old_len[stage][(unsigned char)c];
+  }
+
+  // Unchanged expansions are copied from the old value, and changed ones are
+  // expanded with the new rules once, then copied from the new value. The
+  // output is reserved up front so copying from itself is safe.
+  const std::string_view old_value = Value();
+  m_next.clear();
+  m_next.reserve(total);
+  auto expand = [&](auto &self, unsigned char c, int k) -> void {
+    if (!(uses[k][c] & changed).any() and old_at[k][c] != NONE) {
+      m_next.append(old_value.data() + old_at[k][c], old_len[k][c]);
+    } else if (new_at[k][c] != NONE) {
+      m_next.append(m_next.data() + new_at[k][c], new_len[k][c]);
+    } else if (k == 0) {
+      m_next += c;
+    } else {
+      const uint64_t start = m_next.size();
+      for (char r : after[c]) {
+        self(self, r, k - 1);
+      }
+      new_at[k][c] = start;
+    }
+  };
+  for (char c : seed) {
+    expand(expand, c, stage);
+  }
+
+  std::swap(m_value, m_next);
+  m_brackets.clear();
+  m_preloaded = {};
+  m_preloaded_owner.reset();
+  m_lengths.clear();
+  Compile();
 }
 
 void LSystem::RegenerateRNG() { rng_seed = rand(); }
@@ -94,59 +647,649 @@ bool LSystem::CharUsed(char c) const {
     // Used in seed
     return true;
   }
-  for (Rule r : rules) {
+  for (const Rule &r : rules) {
     if (r.target == c or r.left_context == c or r.right_context == c) {
       return true;
     }
+    if (r.left_string.find(c) != std::string::npos or
+        r.right_string.find(c) != std::string::npos) {
+      return true;
+    }
     if (r.replacement.find(c) != std::string::npos) {
       return true;
     }
   }
+  for (const ParametricRule &r : parametric_rules) {
+    if (r.target == c or r.successor.find(c) != std::string::npos) {
+      return true;
+    }
+  }
   return false;
 }
 
-std::string LSystem::FindReplacement(char t, char c_l, char c_r) const {
-  // Since rules are currently in a flat list, we just try each one until one
-  // works. For stochastic rules we need to keep track of the probability.
+StageStats LSystem::Predict(int stage) const {
+  StageStats stats;
+
+  // Parametric seeds are written with their parameters, which aren't symbols
+  std::string start = seed;
+  if (IsParametric()) {
+    ParamBuffer params;
+    std::string error;
+    if (!ParseModules(seed, start, params, &error)) {
+      start = seed;
+    }
+  }
+
+  // Only the symbols that appear in the system get a row in the matrix
+  int index[128];
+  std::fill(index, index + 128, -1);
+  std::vector<char> symbols;
+  auto add_symbol = [&](char c) {
+    unsigned char u = c;
+    assert(u < 128);
+    if (index[u] == -1) {
+      index[u] = symbols.size();
+      symbols.push_back(c);
+    }
+  };
+  for (char c : start) {
+    add_symbol(c);
+  }
+  for (const Rule &r : rules) {
+    add_symbol(r.target);
+    for (char c : r.replacement) {
+      add_symbol(c);
+    }
+  }
+  for (const ParametricRule &r : parametric_rules) {
+    add_symbol(r.target);
+    for (char c : r.successor) {
+      add_symbol(c);
+    }
+  }
+  const int n = symbols.size();
 
-  // Only one probability is needed, as although the list of rules is not sorted
-  // only one target can match the input at a time.
+  // growth[i * n + j] is how many of symbol j replace one symbol i per step.
+  // Each symbol also keeps the list of replacements it could step to, so the
+  // stack depth can be tracked below.
+  std::vector<double> growth(n * n, 0.0);
+  std::vector<std::vector<const std::string *>> choices(n);
+  for (int i = 0; i < n; ++i) {
+    const char t = symbols[i];
+    double *row = &growth[i * n];
 
-  // TODO - Context sensitive rules should take priority
-  float s = rand() / (float)RAND_MAX;
+    // Mirrors FindReplacement, which walks the rules in order and keeps
+    // whatever probability is left over for the symbol staying as it is
+    double remaining = 1.0;
+    bool uncertain = false; // Whether some rule depends on more than the rng
+    std::vector<const std::string *> candidates;
+    for (const Rule &r : rules) {
+      if (r.target != t) {
+        continue;
+      }
+      candidates.push_back(&r.replacement);
+      if (r.HasContext()) {
+        uncertain = true;
+        continue;
+      }
+      if (remaining <= 0.0) {
+        continue;
+      }
+      double p = std::min((double)r.probability, remaining);
+      if (p < 1.0) {
+        stats.exact = false;
+      }
+      remaining -= p;
+      for (char c : r.replacement) {
+        row[index[(unsigned char)c]] += p;
+      }
+      choices[i].push_back(&r.replacement);
+    }
+    if (remaining > 0.0) {
+      row[i] += remaining;
+      choices[i].push_back(nullptr); // Stays as it is
+    }
+    if (IsParametric()) {
+      // Only parametric rules are used, and their conditions depend on
+      // parameters, so any of them could apply or none at all
+      uncertain = true;
+      candidates.clear();
+      for (const ParametricRule &r : parametric_rules) {
+        if (r.target == t) {
+          candidates.push_back(&r.successor);
+        }
+      }
+      remaining = 1.0;
+    }
+
+    if (uncertain) {
+      // Any of the replacements could win at any point, or none of them
+      // where probability is left over (the same ones as m_max_growth), so
+      // take the most of each symbol any of them gives. Then every count is
+      // a bound, not just the length.
+      stats.exact = false;
+      std::fill(row, row + n, 0.0);
+      choices[i] = candidates;
+      if (remaining > 0.0) {
+        row[i] = 1.0;
+        choices[i].push_back(nullptr);
+      }
+      std::vector<double> counts(n);
+      for (const std::string *candidate : candidates) {
+        std::fill(counts.begin(), counts.end(), 0.0);
+        for (char c : *candidate) {
+          counts[index[(unsigned char)c]] += 1.0;
+        }
+        for (int j = 0; j < n; ++j) {
+          row[j] = std::max(row[j], counts[j]);
+        }
+      }
+    }
+  }
+
+  // counts = seed * growth^stage, with the power found by squaring
+  auto multiply = [n](const std::vector<double> &a,
+                      const std::vector<double> &b) {
+    std::vector<double> c(n * n, 0.0);
+    for (int i = 0; i < n; ++i) {
+      for (int k = 0; k < n; ++k) {
+        const double a_ik = a[i * n + k];
+        if (a_ik == 0.0) {
+          continue;
+        }
+        for (int j = 0; j < n; ++j) {
+          c[i * n + j] += a_ik * b[k * n + j];
+        }
+      }
+    }
+    return c;
+  };
+  std::vector<double> power(n * n, 0.0);
+  for (int i = 0; i < n; ++i) {
+    power[i * n + i] = 1.0;
+  }
+  for (int e = stage; e > 0; e >>= 1) {
+    if (e & 1) {
+      power = multiply(power, growth);
+    }
+    if (e > 1) {
+      growth = multiply(growth, growth);
+    }
+  }
+
+  for (char c : start) {
+    const double *row = &power[index[(unsigned char)c] * n];
+    for (int j = 0; j < n; ++j) {
+      stats.counts[(unsigned char)symbols[j]] += row[j];
+    }
+  }
+  for (int j = 0; j < n; ++j) {
+    stats.length += stats.counts[(unsigned char)symbols[j]];
+  }
+
+  // Stack depth isn't linear in the counts, so it is stepped separately.
+  // For each symbol we track the change in depth over its expansion, and the
+  // deepest point reached along the way.
+  std::vector<double> net(n, 0.0), depth(n, 0.0);
+  for (int i = 0; i < n; ++i) {
+    net[i] = (symbols[i] == '[') - (symbols[i] == ']');
+    depth[i] = std::max(net[i], 0.0);
+  }
+  auto expand = [&](const std::string &s, double &s_net, double &s_depth) {
+    s_net = 0;
+    s_depth = 0;
+    for (char c : s) {
+      const int j = index[(unsigned char)c];
+      s_depth = std::max(s_depth, s_net + depth[j]);
+      s_net += net[j];
+    }
+  };
+  std::vector<double> next_net(n), next_depth(n);
+  for (int s = 0; s < stage; ++s) {
+    for (int i = 0; i < n; ++i) {
+      next_net[i] = -HUGE_VAL;
+      next_depth[i] = 0;
+      for (const std::string *choice : choices[i]) {
+        double c_net = net[i], c_depth = depth[i];
+        if (choice) {
+          expand(*choice, c_net, c_depth);
+        }
+        next_net[i] = std::max(next_net[i], c_net);
+        next_depth[i] = std::max(next_depth[i], c_depth);
+      }
+    }
+    std::swap(net, next_net);
+    std::swap(depth, next_depth);
+  }
+  double seed_net;
+  expand(start, seed_net, stats.max_depth);
+
+  return stats;
+}
+
+bool LSystem::CanSeek() const {
+  if (IsParametric()) {
+    return false;
+  }
   for (const Rule &r : rules) {
-    if (r.Match(t, c_l, c_r)) {
+    if (r.HasContext() or r.probability < 1.0f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LSystem::BuildLengths(int stage) {
+  if (m_lengths.empty()) {
+    // Only the first rule for each target can ever be picked
+    std::fill(m_seek_rules, m_seek_rules + 128, -1);
+    for (int i = 0; i < (int)rules.size(); ++i) {
+      unsigned char t = rules[i].target;
+      assert(t < 128);
+      if (m_seek_rules[t] == -1) {
+        m_seek_rules[t] = i;
+      }
+    }
+
+    m_lengths.emplace_back();
+    m_lengths[0].fill(1);
+  }
+
+  while ((int)m_lengths.size() <= stage) {
+    const auto &prev = m_lengths.back();
+    std::array<uint64_t, 128> next;
+    for (int c = 0; c < 128; ++c) {
+      if (m_seek_rules[c] == -1) {
+        next[c] = 1;
+        continue;
+      }
+      uint64_t total = 0;
+      for (char r : rules[m_seek_rules[c]].replacement) {
+        // Saturate rather than wrap, nothing that long can be generated anyway
+        total = std::min(total + prev[(unsigned char)r], UINT64_MAX / 2);
+      }
+      next[c] = total;
+    }
+    m_lengths.push_back(next);
+  }
+}
+
+// The whole value at the provided stage, generated if it isn't already
+std::string_view LSystem::GeneratedValue(int stage, std::string *error) {
+  if (IsParametric() and m_stage != stage) {
+    if (error) {
+      *error = "Stage " + std::to_string(stage) +
+               " hasn't been generated yet, parametric systems are generated "
+               "by their turtle";
+    }
+    return {};
+  }
+  return Generate(stage, error);
+}
+
+// Length of the value at the provided stage
+uint64_t LSystem::Length(int stage, std::string *error) {
+  if (!CanSeek()) {
+    const std::string_view value = GeneratedValue(stage, error);
+    return m_stage == stage ? value.size() : 0;
+  }
+  BuildLengths(stage);
+  uint64_t total = 0;
+  for (char c : seed) {
+    total =
+        std::min(total + m_lengths[stage][(unsigned char)c], UINT64_MAX / 2);
+  }
+  return total;
+}
+
+// Returns up to count symbols of the value at the provided stage, starting at
+// position start. Seeking costs O(stage), rather than generating every symbol
+// before start.
+std::string LSystem::Window(int stage, uint64_t start, size_t count,
+                            std::string *error) {
+  std::string out;
+
+  if (!CanSeek()) {
+    std::string_view value = GeneratedValue(stage, error);
+    if (m_stage == stage and start < value.size()) {
+      out = value.substr(start, count);
+    }
+    return out;
+  }
+  BuildLengths(stage);
+
+  // Walks down the derivation tree, each frame is one replacement string
+  // whose symbols still have 'level' steps left to expand.
+  struct Frame {
+    const std::string *s;
+    size_t i;
+    int level;
+  };
+  std::vector<Frame> frames = {{&seed, 0, stage}};
+
+  // Find the leaf containing start, skipping whole subtrees by their length
+  uint64_t skip = start;
+  while (true) {
+    Frame &f = frames.back();
+    while (f.i < f.s->size()) {
+      uint64_t len = m_lengths[f.level][(unsigned char)(*f.s)[f.i]];
+      if (skip < len) {
+        break;
+      }
+      skip -= len;
+      ++f.i;
+    }
+    if (f.i == f.s->size()) {
+      return out; // start is past the end
+    }
+    const int rule = m_seek_rules[(unsigned char)(*f.s)[f.i]];
+    if (f.level == 0 or rule == -1) {
+      break;
+    }
+    frames.push_back({&rules[rule].replacement, 0, f.level - 1});
+  }
+
+  // Then read leaves in order until we have enough
+  out.reserve(count);
+  while (out.size() < count and !frames.empty()) {
+    Frame &f = frames.back();
+    if (f.i == f.s->size()) {
+      frames.pop_back();
+      if (!frames.empty()) {
+        ++frames.back().i;
+      }
+      continue;
+    }
+    char c = (*f.s)[f.i];
+    const int rule = m_seek_rules[(unsigned char)c];
+    if (f.level == 0 or rule == -1) {
+      out += c;
+      ++f.i;
+    } else {
+      frames.push_back({&rules[rule].replacement, 0, f.level - 1});
+    }
+  }
+
+  return out;
+}
+
+template <typename F>
+bool LSystem::Expand(int stage, F &&piece, std::string *error) {
+  if (!CanSeek()) {
+    const std::string_view value = GeneratedValue(stage, error);
+    if (m_stage != stage) {
+      return false;
+    }
+    piece(value);
+    return true;
+  }
+  BuildLengths(stage);
+
+  // As in Window, each frame is one replacement string whose symbols still
+  // have 'level' steps left to expand. Replacements at level 0 and runs of
+  // symbols without a rule are passed on whole.
+  struct Frame {
+    std::string_view s;
+    size_t i;
+    int level;
+  };
+  std::vector<Frame> frames;
+  frames.reserve(stage + 1);
+  frames.push_back({seed, 0, stage});
+  while (!frames.empty()) {
+    Frame &f = frames.back();
+    size_t end = f.i;
+    while (end < f.s.size() and
+           (f.level == 0 or m_seek_rules[(unsigned char)f.s[end]] == -1)) {
+      ++end;
+    }
+    if (end > f.i) {
+      piece(f.s.substr(f.i, end - f.i));
+      f.i = end;
+    }
+    if (f.i == f.s.size()) {
+      frames.pop_back();
+      continue;
+    }
+    const int rule = m_seek_rules[(unsigned char)f.s[f.i++]];
+    const int level = f.level - 1;
+    frames.push_back({rules[rule].replacement, 0, level});
+  }
+  return true;
+}
+
+// The returned view points into m_rule_bodies, so is only valid until the
+// next Compile. s is a random number in [0, 1), to choose between stochastic
+// rules. s_l and s_r are the states of the context automata, see
+// FindNeighbours, and at is where t is in the value.
+std::string_view LSystem::FindReplacement(char t, char c_l, char c_r, float s,
+                                          uint32_t s_l, uint32_t s_r,
+                                          size_t at) const {
+  // Rules are grouped by target, so we just try each one for this target until
+  // one works. For stochastic rules we need to keep track of the probability.
+
+  // TODO - Context sensitive rules should take priority
+  unsigned char u = t;
+  for (uint32_t i = m_first_rule[u]; i < m_first_rule[u + 1]; ++i) {
+    const CompiledRule &r = m_compiled[i];
+    if (ContextMatches(r.left_context, c_l) and
+        ContextMatches(r.right_context, c_r) and
+        m_left_contexts.Matches(s_l, r.left_pattern) and
+        m_right_contexts.Matches(s_r, r.right_pattern) and
+        (r.right_tree == ContextAutomaton::NO_PATTERN or
+         RightTreeMatches(at, m_tree_contexts[r.right_tree]))) {
       if (s < r.probability) {
-        return r.replacement;
+        return {m_rule_bodies.data() + r.offset, r.length};
       } else {
         s -= r.probability;
       }
     }
   }
 
-  return std::string(1, t);
+  return {m_rule_bodies.data() + u, 1};
 }
 void LSystem::Step() {
+  if (IsParametric()) {
+    StepParametric();
+    return;
+  }
+
   ++m_stage;
 
-  // Seed the rng so the output is constant
-  srand(rng_seed);
+  const size_t size = Value().size();
+  if (m_has_contexts) {
+    FindNeighbours();
+  }
+  const int n = StepThreads(size);
 
-  std::string next = "";
+  // Every symbol is rewritten independently, so each thread takes a slice and
+  // the slices are joined in order. This thread does the first, straight into
+  // m_next.
+  m_next_parts.resize(n - 1);
+  m_lineage.resize(track_lineage ? size + 1 : 0);
+  uint64_t *lineage = track_lineage ? m_lineage.data() : nullptr;
+  std::vector<std::thread> pool;
+  for (int t = 1; t < n; ++t) {
+    pool.emplace_back([this, t, n, size, lineage]() {
+      const size_t begin = size * t / n;
+      StepRange(begin, size * (t + 1) / n, m_next_parts[t - 1],
+                lineage ? lineage + begin : nullptr);
+    });
+  }
+  StepRange(0, size / n, m_next, lineage);
+  for (int t = 1; t < n; ++t) {
+    pool[t - 1].join();
+    // Each slice's lineage starts from 0, so shift it to where it ends up
+    if (lineage) {
+      for (size_t i = size * t / n; i < size * (t + 1) / n; ++i) {
+        lineage[i] += m_next.size();
+      }
+    }
+    m_next += m_next_parts[t - 1];
+  }
+  if (lineage) {
+    lineage[size] = m_next.size();
+  }
 
-  for (int idx_c = 0; idx_c < m_value.size(); ++idx_c) {
+  std::swap(m_value, m_next);
+  m_preloaded = {};
+  m_preloaded_owner.reset();
+  if (m_has_contexts) {
+    IndexBrackets();
+  } else {
+    m_brackets.clear();
+  }
+}
 
-    char c = m_value[idx_c];
-    char l_context = FindLNeighbour(idx_c - 1);
-    char r_context = FindRNeighbour(idx_c + 1);
+int LSystem::StepThreads(size_t size) const {
+  int n = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+  n = std::clamp<size_t>(size / PARALLEL_STEP_LENGTH, 1, std::max(n, 1));
+  // Only the page's threaded build (fern-mt.js, see the Makefile) has them
+#if defined(BUILD_WASM) and !defined(__EMSCRIPTEN_PTHREADS__)
+  n = 1;
+#endif
+  return n;
+}
+
+// Rewrites the symbols [begin, end) of the current value into out, and if
+// lineage isn't null, where each one's replacement starts in out
+void LSystem::StepRange(size_t begin, size_t end, std::string &out,
+                        uint64_t *lineage) const {
+  // Seed the rng so the output is constant, and skip to this range's share
+  Random rng;
+  rng.Seed(rng_seed);
+  rng.Skip(begin);
 
-    next += FindReplacement(c, l_context, r_context);
+  out.clear();
+
+  const std::string_view value = Value();
+  if (!m_has_contexts) {
+    for (size_t i = begin; i < end; ++i) {
+      if (lineage) {
+        lineage[i - begin] = out.size();
+      }
+      out += FindReplacement(value[i], CON_END, CON_END, rng.Next());
+    }
+    return;
+  }
+  const bool states = !m_left_state.empty();
+  for (size_t i = begin; i < end; ++i) {
+    if (lineage) {
+      lineage[i - begin] = out.size();
+    }
+    out += FindReplacement(value[i], m_left[i], m_right[i], rng.Next(),
+                           states ? m_left_state[i] : 0,
+                           states ? m_right_state[i] : 0, i);
+  }
+}
+
+// Whether what follows the symbol at is pattern, a right context with
+// branches as in ABoP's BC < S > G[H]M. A symbol of the pattern skips any
+// branches in its way, as neighbours do, '[' enters the branch that's next,
+// and ']' skips whatever is left of the branch it entered. So G[H]M matches
+// the right of S in SG[HI[JK]L]MNO. Needs m_brackets, and never matches
+// when brackets are ignored.
+bool LSystem::RightTreeMatches(size_t at, std::string_view pattern) const {
+  if (IsIgnored('[') or IsIgnored(']')) {
+    return false;
+  }
+  const std::string_view value = Value();
+  const uint64_t n = value.size();
+  uint64_t i = at + 1;
+  for (char p : pattern) {
+    if (p == ']') {
+      while (i < n and value[i] != ']') {
+        i = value[i] == '[' ? m_brackets[i] : i;
+        if (i == NO_BRACKET) {
+          return false;
+        }
+        ++i;
+      }
+      if (i == n) {
+        return false;
+      }
+      ++i;
+      continue;
+    }
+    while (i < n and (IsIgnored(value[i]) or (p != '[' and value[i] == '['))) {
+      i = value[i] == '[' ? m_brackets[i] : i;
+      if (i == NO_BRACKET) {
+        return false;
+      }
+      ++i;
+    }
+    if (i == n or value[i] != p) {
+      return false;
+    }
+    ++i;
+  }
+  return true;
+}
+
+uint64_t LSystem::MatchingBracket(uint64_t i) {
+  if (m_brackets.size() != Value().size()) {
+    IndexBrackets();
+  }
+  return i < m_brackets.size() ? m_brackets[i] : NO_BRACKET;
+}
+
+std::string_view LSystem::Branch(uint64_t i) {
+  const uint64_t j = MatchingBracket(i);
+  if (j == NO_BRACKET) {
+    return {};
+  }
+  return Value().substr(std::min(i, j), std::max(i, j) - std::min(i, j) + 1);
+}
+
+void LSystem::IndexBrackets() {
+  const std::string_view value = Value();
+  const size_t size = value.size();
+  m_brackets.assign(size, NO_BRACKET);
+  const int n = StepThreads(size);
+
+  // Each thread pairs up the brackets in its own slice, like Step, leaving
+  // the ones whose match is in another slice to be paired up in order after
+  struct Unpaired {
+    std::vector<uint64_t> close, open;
+  };
+  std::vector<Unpaired> unpaired(n);
+  auto pair = [this, value, size, n, &unpaired](int t) {
+    std::vector<uint64_t> &open = unpaired[t].open;
+    for (size_t i = size * t / n; i < size * (t + 1) / n; ++i) {
+      if (value[i] == '[') {
+        open.push_back(i);
+      } else if (value[i] == ']') {
+        if (open.empty()) {
+          unpaired[t].close.push_back(i);
+        } else {
+          m_brackets[i] = open.back();
+          m_brackets[open.back()] = i;
+          open.pop_back();
+        }
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int t = 1; t < n; ++t) {
+    pool.emplace_back(pair, t);
+  }
+  pair(0);
+  for (std::thread &t : pool) {
+    t.join();
   }
 
-  m_value = next;
+  std::vector<uint64_t> open;
+  for (const Unpaired &u : unpaired) {
+    for (size_t k = 0; k < u.close.size() and !open.empty(); ++k) {
+      m_brackets[u.close[k]] = open.back();
+      m_brackets[open.back()] = u.close[k];
+      open.pop_back();
+    }
+    open.insert(open.end(), u.open.begin(), u.open.end());
+  }
 }
 
-char LSystem::FindLNeighbour(int position, int depth) const {
+void LSystem::FindNeighbours() {
   /* Description taken from 'A MODEL STUDY ON BIOMORPHOLOGICAL DESCRIPTION'. P. HOGEWEG (1973)
 (1) When the left neighbouring symbol is an
   alphabetic symbol, this symbol defines the context (as
@@ -162,75 +1305,150 @@ char LSystem::FindLNeighbour(int position, int depth) const {
   from the symbol by an equal number of opening and
   closing brackets (including the neighbouring closing
   bracket).
+(4) When the right neighbouring symbol is a closing
+  bracket, the rightsided context is defined by the symbol
+  at the end of the string, which represents the environ-
+  ment.
+(5) When the right-sided symbol is an opening
+  bracket, the rightsided context is defined bv the first al-
+  phabetic symbol towards the right, which is separated
+  from the symbol by an equal number of opening and
+  closing brackets (including the neighbouring closing
+  bracket). !!! This may be a mistake in the paper !!!
 
-NOTE - only production rules of the form X -> A[B] where A contains some
-non-ignored symbols will work correctly (otherwise multiple left-brackets will
-confuse the code)
+Rather than searching from every symbol, which costs up to the size of the
+branches skipped over, each direction is one pass. At the far end of a
+branch, what it returns to is what was seen at its other end, found through
+m_brackets.
 */
+  const std::string_view value = Value();
+  const size_t n = value.size();
+  const bool states = !m_left_contexts.pattern_state.empty() or
+                      !m_right_contexts.pattern_state.empty();
+  m_left.resize(n);
+  m_right.resize(n);
+  m_left_state.resize(states ? n : 0);
+  m_right_state.resize(states ? n : 0);
+  // An ignored bracket doesn't open or close anything, so the other kind
+  // never has a match
+  const bool branches = !IsIgnored('[') and !IsIgnored(']');
+  auto match = [&](size_t i) { return branches ? m_brackets[i] : NO_BRACKET; };
+
+  // Unless they already are, the brackets are paired up on the way, as in
+  // IndexBrackets but without a pass of its own
+  const bool indexed = m_brackets.size() == n;
+  if (!indexed) {
+    m_brackets.assign(n, NO_BRACKET);
+  }
+  std::vector<uint64_t> open;
 
-  while (position >= 0) {
+  // Left to right. A branch carries on from the symbol before its '[', and
+  // what follows its ']' carries on from there too (rules 1-3 below).
+  char c = CON_END;
+  uint32_t state = 0;
+  for (size_t i = 0; i < n; ++i) {
+    m_left[i] = c;
+    if (states) {
+      m_left_state[i] = state;
+    }
+    const char v = value[i];
+    if (!indexed and v == '[') {
+      open.push_back(i);
+    } else if (!indexed and v == ']' and !open.empty()) {
+      m_brackets[i] = open.back();
+      m_brackets[open.back()] = i;
+      open.pop_back();
+    }
+    if (IsIgnored(v) or v == '[') {
+      continue;
+    }
+    if (v == ']') {
+      const uint64_t open = match(i);
+      c = open != NO_BRACKET ? m_left[open] : CON_END;
+      state = open != NO_BRACKET and states ? m_left_state[open] : 0;
+    } else {
+      c = v;
+      state = m_left_contexts.Next(state, v);
+    }
+  }
 
-    char v = m_value[position];
+  // Right to left. The end of a branch has nothing to its right, and the
+  // symbol before a branch sees past it to whatever follows its ']' (rules
+  // 1, 4 and 5).
+  c = CON_END;
+  state = 0;
+  for (size_t i = n; i-- > 0;) {
+    m_right[i] = c;
+    if (states) {
+      m_right_state[i] = state;
+    }
+    const char v = value[i];
     if (IsIgnored(v)) {
-      --position;
       continue;
     }
-    if (v == '[') {
-      --position;
-      --depth;
-      depth = std::max(depth, 0);
-    } else if (v == ']') {
-      --position;
-      ++depth;
+    if (v == ']') {
+      c = CON_END;
+      state = 0;
+    } else if (v == '[') {
+      const uint64_t close = match(i);
+      c = close != NO_BRACKET ? m_right[close] : CON_END;
+      state = close != NO_BRACKET and states ? m_right_state[close] : 0;
     } else {
-      if (depth == 0) {
-        return v;
-      } else {
-        --position;
-      }
+      c = v;
+      state = m_right_contexts.Next(state, v);
     }
   }
-  return CON_END;
 }
 
-char LSystem::FindRNeighbour(int position, int depth) const {
-  /*Description taken from 'A MODEL STUDY ON BIOMORPHOLOGICAL DESCRIPTION'. P. HOGEWEG (1973)
-  (1) When the right neighbouring symbol is an
-  alphabetic symbol, this symbol defines the context (as
-  is the case in non-bracketed iL systems).
-  (4) When the right neighbouring symbol is a closing
-  bracket, the rightsided context is defined by the symbol
-  at the end of the string, which represents the environ-
-  ment.
-  (5) When the right-sided symbol is an opening
-  bracket, the rightsided context is defined bv the first al-
-  phabetic symbol towards the right, which is separated
-  from the symbol by an equal number of opening and
-  closing brackets (including the neighbouring closing
-  bracket). !!! This may be a mistake in the paper !!!
-  */
-  while (position < m_value.size()) {
+void LSystem::StepParametric() {
+  ++m_stage;
 
-    char v = m_value[position];
-    if (IsIgnored(v)) {
-      ++position;
-    } else if (v == '[') {
-      ++position;
-      ++depth;
-    } else if (v == ']') {
-      if (depth == 0) {
-        return CON_END;
-      } else {
-        ++position;
-        --depth;
-      }
-    } else { // v is valid symbol
-      if (depth == 0) {
-        return v;
-      } else {
-        ++position;
+  const std::string_view value = Value();
+  if (m_params.start.size() != value.size() + 1) {
+    // e.g. preloaded without parameters
+    m_params.start.assign(value.size() + 1, 0);
+    m_params.values.clear();
+  }
+
+  m_next.clear();
+  m_next_params.Clear();
+  m_lineage.resize(track_lineage ? value.size() + 1 : 0);
+
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (track_lineage) {
+      m_lineage[i] = m_next.size();
+    }
+    const unsigned char c = value[i];
+    const float *params = m_params.Get(i);
+    const int arity = m_params.Count(i);
+
+    // The first rule with a matching arity and condition is applied, any
+    // symbol without one stays as it is
+    const ParametricRule *match = nullptr;
+    for (uint32_t j = m_first_prule[c]; j < m_first_prule[c + 1]; ++j) {
+      const ParametricRule &r = parametric_rules[m_prule_order[j]];
+      if (r.arity == arity and r.Condition(params)) {
+        match = &r;
+        break;
       }
     }
+
+    if (match) {
+      match->Apply(params, m_next, m_next_params);
+    } else {
+      m_next += c;
+      m_next_params.values.insert(m_next_params.values.end(), params,
+                                  params + arity);
+      m_next_params.start.push_back(m_next_params.values.size());
+    }
   }
-  return CON_END;
+  if (track_lineage) {
+    m_lineage[value.size()] = m_next.size();
+  }
+
+  std::swap(m_value, m_next);
+  std::swap(m_params, m_next_params);
+  m_brackets.clear();
+  m_preloaded = {};
+  m_preloaded_owner.reset();
 }
@@ -1,60 +1,112 @@
 #include "app.h"
+#include "demo.h"
+#include "examples.h"
+#include "export.h"
+#include "grammar.h"
+#include "growth.h"
+#include "headless.h"
 #include "lsystem.h"
+#include "scene.h"
+#include "serialize.h"
 #include "turtle.h"
 
 #ifdef BUILD_WASM
 #include <emscripten.h>
 #endif
 
+#include <map>
 #include <string>
 
 // TODO - Think about char sizes/Unicode
 
-// Window dimensions
-constexpr int WIDTH = 900;
-constexpr int HEIGHT = 600;
-
-// ImGui scroll bar that controls LSystem development
-constexpr int STAGE_BAR_H = 64;
-constexpr int STAGE_BAR_Y = HEIGHT - STAGE_BAR_H;
-
-struct Demo {
-  LSystem ls;
-  TurtleMap tm;
-
-  // Window params.
-  SDL_FPoint origin = {WIDTH / 2.0f, STAGE_BAR_Y - 5.0f};
-  float zoom = 1;
-  int stage = 0;
-  int max_stage = 7;
-  SDL_Colour clear_colour = {0, 0, 0, 0};
-
-  // Turtle params.
-  int step_size = 5;
-  float angle_delta = 0.071;
-  SDL_Colour turtle_colour = {255, 0, 255, 0};
-};
+// Stages that would take more than this to generate are refused, or drawn
+// straight from their rules if they can be (see LSystem::Generate)
+uint64_t g_memory_budget_mb = DEFAULT_MEMORY_BUDGET >> 20;
 
 // The current demo, modified by UI/input functions defined below
 Demo g_demo;
 
-// Example L-Systems the user can switch between
+// Set when the last Reinterpret failed, displayed until the next one
+std::string g_draw_error;
+
+// Set when an edit left the current stage outdated (see LSystem::Update),
+// displayed instead of g_draw_error until the stage is generated again
+std::string g_update_error;
+
+// Merge and deduplicate the turtle's segments before drawing them
+bool g_simplify = false;
+
+// Interpret seekable systems straight from their rules, without generating
+// the string for each stage (see LSystem::Expand). Others are always
+// generated.
+bool g_from_rules = true;
+
+// The turtle's output for the current stage, in steps. Panning, zooming and
+// resizing only redraw this, without generating or interpreting anything.
+Drawing g_drawing;
+
+// Growing the current stage into the next, see growth.h. The parts of the
+// drawing that don't move are kept in g_grown, and each frame draws what does
+// on top of a copy of it.
+Growth g_growth;
+float g_growth_t = 0;
+const float SECONDS_PER_STAGE = 2;
+SDL_Texture *g_grown = nullptr;
+SDL_FPoint g_grown_origin;
+float g_grown_step = 0;
+Drawing g_growing;
+
+// Rows of plants of the current system, drawn instead of it (see scene.h).
+// Stale once the system or turtle changes, until it's copied again.
+bool g_show_scene = false;
+bool g_scene_stale = true;
+Scene g_scene;
+SceneRows g_scene_rows;
+
+// Predictions for the stage bar, which wants several each frame. Kept until
+// the system's revision changes.
+uint64_t g_predicted_revision = 0;
+std::map<int, StageStats> g_predicted;
+
+const StageStats &PredictCached(int stage)
+{
+  if (g_predicted_revision != g_demo.ls.m_revision) {
+    g_predicted.clear();
+    g_predicted_revision = g_demo.ls.m_revision;
+  }
+  auto it = g_predicted.find(stage);
+  if (it == g_predicted.end()) {
+    it = g_predicted.emplace(stage, g_demo.ls.Predict(stage)).first;
+  }
+  return it->second;
+}
+
+// Demo origins are laid out for a WIDTH x HEIGHT window. Bigger or smaller
+// windows keep the bottom centre (where the plants grow from) in place.
+SDL_FPoint LayoutOffset()
+{
+  return {(App::g_width - WIDTH) / 2.0f, (float)(App::g_height - HEIGHT)};
+}
+
+// Example L-Systems the user can switch between: the built in ones (see
+// examples.h), then any loaded at startup, which are kept here
 std::vector<Demo> examples;
-std::vector<const char *> example_names; // Displayed in ImGui
+std::vector<std::string> example_names; // Displayed in ImGui
 
 // Returns whether the window needs to be redrawn
 bool HandleWindowEvents(SDL_Event e)
 {
   switch (e.type) {
 
-    // TODO - panning doesn't need a redraw, could draw different portion of
-    // larger texture
+    // Panning only moves the view over the screen texture, and the view stays
+    // where the drag left it. The screen is only redrawn (which recentres
+    // it) once the view runs out of margin, or when something else changes.
   case SDL_MOUSEMOTION: {
     Uint32 state = SDL_GetMouseState(nullptr, nullptr);
     if (SDL_BUTTON_LMASK & state) {
       g_demo.origin.x += e.motion.xrel;
       g_demo.origin.y += e.motion.yrel;
-      return true;
+      return !App::Scroll(-e.motion.xrel, -e.motion.yrel);
     }
   } break; // case SDL_MOUSEMOTION
 
@@ -62,20 +114,91 @@ bool HandleWindowEvents(SDL_Event e)
     g_demo.zoom *= (e.wheel.y > 0) ? 1.1f : 0.9f;
     return true;
   } break; // case SDL_MOUSEWHEEL
+
+    // App has already resized the screen texture, which needs filling
+  case SDL_WINDOWEVENT: {
+    return e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED;
+  } break; // case SDL_WINDOWEVENT
   }
 
   return false;
 }
 
+// Only re-expands what the edit affects, see LSystem::Update
 void ResetSystem()
 {
-  g_demo.ls.Reset();
+  g_update_error.clear();
+  g_demo.ls.Update(&g_update_error);
   UpdateTurtleMap(g_demo.tm, g_demo.ls);
+  g_scene_stale = true;
 }
 
-void Redraw()
+// Grows the scene's plants around the current stage, sharing what's already
+// grown unless the system has changed
+void GrowCurrentScene()
+{
+  if (g_scene_stale or g_scene.systems.empty()) {
+    g_scene.systems = {g_demo};
+    g_scene.systems[0].ls.Reset();
+    g_scene.cache.clear();
+    g_scene_stale = false;
+  }
+  g_scene.systems[0].ls.memory_budget = g_demo.ls.memory_budget;
+  PlantRows(g_scene, g_scene_rows, g_demo.stage);
+  GrowScene(g_scene, &g_draw_error);
+}
+
+// Runs the turtle over the current stage, regenerating it if needed
+void Reinterpret()
+{
+  g_draw_error.clear();
+  if (g_show_scene) {
+    GrowCurrentScene();
+    return;
+  }
+  if (g_from_rules) {
+    Interpret2D(g_demo.ls, g_demo.stage, g_demo.tm, g_demo.angle_delta,
+                g_drawing, &g_draw_error);
+  } else {
+    const std::string_view value =
+        Generate2D(g_demo.ls, g_demo.stage, g_demo.tm, g_demo.angle_delta,
+                   &g_draw_error);
+    if (g_demo.ls.m_stage == g_demo.stage) {
+      Interpret2D(value, g_demo.tm, g_demo.angle_delta, g_drawing,
+                  g_demo.ls.Params(), &g_draw_error);
+    } else if (g_demo.ls.CanSeek()) {
+      // Too big to generate, but it can still be drawn from its rules
+      g_draw_error.clear();
+      Interpret2D(g_demo.ls, g_demo.stage, g_demo.tm, g_demo.angle_delta,
+                  g_drawing, &g_draw_error);
+    } else {
+      g_drawing = {};
+    }
+  }
+  if (g_simplify) {
+    Simplify(g_drawing);
+  }
+  // Still drawn with the rules from before the last edit
+  if (g_demo.ls.m_outdated and g_demo.ls.m_stage == g_demo.stage) {
+    g_draw_error = g_update_error;
+  }
+}
+
+// Where the turtle starts on App::screen, and how many pixels a step covers
+SDL_FPoint ScreenOrigin()
+{
+  const SDL_FPoint layout = LayoutOffset();
+  return App::ToScreen(
+      {g_demo.origin.x + layout.x, g_demo.origin.y + layout.y});
+}
+float ScreenStep()
+{
+  return g_demo.step_size * g_demo.zoom * App::g_pixel_scale;
+}
+
+// Clears the current render target and draws d on it
+void RenderDemo(const Drawing &d)
 {
-  SDL_SetRenderTarget(App::renderer, App::screen);
   SDL_SetRenderDrawColor(App::renderer, g_demo.clear_colour.r,
                          g_demo.clear_colour.g, g_demo.clear_colour.b,
                          g_demo.clear_colour.a);
@@ -84,18 +207,81 @@ void Redraw()
   SDL_SetRenderDrawColor(App::renderer, g_demo.turtle_colour.r,
                          g_demo.turtle_colour.g, g_demo.turtle_colour.b,
                          g_demo.turtle_colour.a);
-  Draw(App::renderer, g_demo.ls.Generate(g_demo.stage), g_demo.tm,
-       g_demo.origin, g_demo.step_size * g_demo.zoom, g_demo.angle_delta);
+  Render(App::renderer, d, ScreenOrigin(), ScreenStep(), g_demo.stroke);
+}
+
+void Redraw()
+{
+  SDL_SetRenderTarget(App::renderer, App::screen);
+  if (g_show_scene) {
+    RenderDemo(Drawing());
+    RenderScene(App::renderer, g_scene, ScreenOrigin(), ScreenStep(),
+                g_demo.stroke);
+  } else {
+    RenderDemo(g_drawing);
+  }
   SDL_SetRenderTarget(App::renderer, NULL);
+  App::ResetScroll();
+}
+
+// Starts growing from the current stage, or from the first if there's no
+// further to go. If the next stage is over the memory budget, the current one
+// is interpreted instead (and needs redrawing), with that as the error.
+void StartGrowth()
+{
+  if (g_demo.stage >= g_demo.max_stage) { g_demo.stage = 0; }
+  g_growth_t = 0;
+  g_grown_step = 0; // Draw the new fixed part
+  std::string error;
+  if (!PrepareGrowth(g_demo.ls, g_demo.stage, g_demo.tm, g_demo.angle_delta,
+                     g_growth, &error)) {
+    Reinterpret();
+    g_draw_error = error;
+  }
+}
+
+// Draws the growth at g_growth_t. The fixed part is only drawn again when it
+// changes, or the view moves, or retain is false.
+void RedrawGrowth(bool retain)
+{
+  int w, h, grown_w = 0, grown_h = 0;
+  SDL_QueryTexture(App::screen, nullptr, nullptr, &w, &h);
+  if (g_grown) {
+    SDL_QueryTexture(g_grown, nullptr, nullptr, &grown_w, &grown_h);
+  }
+  if (!g_grown or grown_w != w or grown_h != h) {
+    if (g_grown) { SDL_DestroyTexture(g_grown); }
+    g_grown = SDL_CreateTexture(App::renderer, SDL_PIXELFORMAT_RGBA8888,
+                                SDL_TEXTUREACCESS_TARGET, w, h);
+    retain = false;
+  }
+  const SDL_FPoint origin = ScreenOrigin();
+  const float step = ScreenStep();
+  if (!retain or origin.x != g_grown_origin.x or
+      origin.y != g_grown_origin.y or step != g_grown_step) {
+    SDL_SetRenderTarget(App::renderer, g_grown);
+    RenderDemo(g_growth.fixed);
+    g_grown_origin = origin;
+    g_grown_step = step;
+  }
+
+  SDL_SetRenderTarget(App::renderer, App::screen);
+  SDL_RenderCopy(App::renderer, g_grown, NULL, NULL);
+  DrawGrowth(g_growth, g_growth_t, g_growing);
+  Render(App::renderer, g_growing, origin, step, g_demo.stroke);
+  SDL_SetRenderTarget(App::renderer, NULL);
+  App::ResetScroll();
 }
 
 void main_loop()
 {
-  App::ClearScreen(g_demo.clear_colour);
+  App::NewFrame();
 
   ImGuiIO &io = ImGui::GetIO();
+  g_demo.ls.memory_budget = g_memory_budget_mb << 20;
 
   bool system_changed = false;
+  bool reinterpret = false;
   bool redraw = false;
 
   SDL_Event e;
@@ -137,6 +323,18 @@ void main_loop()
       ImGui::TreePop();
     }
 
+    if (ImGui::TreeNode("memory options...")) {
+      // A stage that was refused may fit now
+      reinterpret |= ImGui::InputScalar("budget (MB)", ImGuiDataType_U64,
+                                        &g_memory_budget_mb);
+      // Kept in bytes, so anything bigger would wrap
+      g_memory_budget_mb =
+          std::min<uint64_t>(g_memory_budget_mb, UINT64_MAX >> 20);
+      ImGui::TextWrapped("Stages that would need more are not generated. "
+                         "0 means no limit.");
+      ImGui::TreePop();
+    }
+
     if (ImGui::BeginTable("table1", 4)) {
       for (int i = 0; i < g_demo.ls.rules.size();) {
         Rule &r = g_demo.ls.rules[i];
@@ -195,20 +393,78 @@ void main_loop()
       }
     }
 
+    // Written as text, e.g. 'F(l) : l > 1 -> F(l*0.7)[+F(l*0.5)]'. While there
+    // are any, the rules in the table above aren't used.
+    if (ImGui::TreeNode("parametric rules...")) {
+      static std::string parse_error;
+      // What's typed into each rule, with the text it was typed over. Only
+      // text that parses reaches the rule, and an edit is dropped once its
+      // rule changes some other way (e.g. another demo is loaded).
+      static std::vector<std::pair<std::string, std::string>> edits;
+      edits.resize(g_demo.ls.parametric_rules.size());
+      for (int i = 0; i < (int)g_demo.ls.parametric_rules.size();) {
+        ParametricRule &r = g_demo.ls.parametric_rules[i];
+        auto &[from, text] = edits[i];
+        if (from != r.text) {
+          from = r.text;
+          text = r.text;
+        }
+        ImGui::PushID(i);
+        if (ImGui::InputText("##rule", &text,
+                             ImGuiInputTextFlags_CallbackCharFilter,
+                             SafeChar::Filter)) {
+          parse_error.clear();
+          ParametricRule parsed;
+          if (ParseParametricRule(text, &parsed, &parse_error)) {
+            r = parsed;
+            from = r.text;
+            system_changed = true;
+          }
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Remove")) {
+          g_demo.ls.parametric_rules.erase(
+              g_demo.ls.parametric_rules.begin() + i);
+          edits.erase(edits.begin() + i);
+          system_changed = true;
+        } else {
+          ++i;
+        }
+        ImGui::PopID();
+      }
+      if (ImGui::Button("Add rule")) {
+        ParametricRule r;
+        ParseParametricRule("F(x) -> F(x)", &r, &parse_error);
+        g_demo.ls.parametric_rules.push_back(r);
+        system_changed = true;
+      }
+      if (!parse_error.empty()) {
+        ImGui::TextWrapped("%s", parse_error.c_str());
+      }
+      ImGui::TreePop();
+    }
+
     ImGui::End();
   }
 
   // ======= ALLOW THE USER TO EDIT THE TURTLE BEHAVIOUR  ==========
   //
-  // Any changes will not change the system, but will require a redraw
-  //                          (redraw = true)
+  // Any changes will not change the system, but will require the turtle to
+  // run again, apart from the step size which just scales the drawing
+  //                   (reinterpret = true, redraw = true)
   {
     ImGui::SetNextWindowSize({282, 219}, ImGuiCond_Once);
     ImGui::SetNextWindowPos({0, 242}, ImGuiCond_Once);
     ImGui::Begin("Turtle Instructions");
 
     redraw |= ImGui::InputInt("step size", &(g_demo.step_size));
-    redraw |= ImGui::InputFloat("angle(turns)", &(g_demo.angle_delta));
+    // Scales the widths set by NARROW, 1 pixel lines if 0
+    redraw |= ImGui::InputFloat("line width", &(g_demo.stroke.width));
+    bool turtle_changed =
+        ImGui::InputFloat("angle(turns)", &(g_demo.angle_delta));
+    reinterpret |= turtle_changed;
+    reinterpret |= ImGui::Checkbox("merge segments", &g_simplify);
+    reinterpret |= ImGui::Checkbox("draw from rules", &g_from_rules);
 
     if (ImGui::BeginTable("inst. table", 2, ImGuiTableFlags_SizingFixedFit)) {
       int id = 0;
@@ -227,7 +483,8 @@ void main_loop()
             const bool is_selected = ((TurtleInstruction)n == ins);
             if (ImGui::Selectable(instuction_labels[n], is_selected)) {
               ins = (TurtleInstruction)n;
-              redraw = true;
+              reinterpret = true;
+              turtle_changed = true;
             }
             if (is_selected) { ImGui::SetItemDefaultFocus(); }
           }
@@ -240,36 +497,100 @@ void main_loop()
     }
     if (ImGui::Button("Clear unused")) { CleanTurtleMap(g_demo.tm, g_demo.ls); }
     ImGui::End();
+
+    g_scene_stale |= turtle_changed;
+    // Open systems were grown with the old turtle answering their queries
+    if (turtle_changed and
+        (IsOpen(g_demo.ls, g_demo.tm) or g_demo.ls.m_answered >= 0)) {
+      system_changed = true;
+    }
   }
 
   // ======= INCREASE/DECREASE STAGE OF THE SYSTEM  ==========
   //
   // system_changed not required as lsystem will reset itself based on the stage
   //                        requested when we draw
-  //                          (redraw = true)
+  //                        (reinterpret = true)
   {
-    ImGui::SetNextWindowSize({WIDTH, STAGE_BAR_H}, ImGuiCond_Always);
-    ImGui::SetNextWindowPos({0, STAGE_BAR_Y}, ImGuiCond_Always);
+    ImGui::SetNextWindowSize({(float)App::g_width, STAGE_BAR_H},
+                             ImGuiCond_Always);
+    ImGui::SetNextWindowPos({0, (float)App::g_height - STAGE_BAR_H},
+                            ImGuiCond_Always);
     ImGui::Begin("Slider", nullptr,
                  ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoResize |
                      ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoNavInputs);
 
-    ImGui::PushItemWidth(800);
-    redraw |= ImGui::SliderInt(" ", &(g_demo.stage), 0, g_demo.max_stage);
+    auto predict_mb = [](int stage, StageStats *stats) {
+      *stats = PredictCached(stage);
+      const double before = stage > 0 ? PredictCached(stage - 1).length : 0;
+      return g_demo.ls.StepBytes(before, stats->length) / (1 << 20);
+    };
+    const uint64_t budget_mb = g_demo.ls.memory_budget >> 20;
+
+    // The predicted size of the stage is shown on the slider
+    StageStats current;
+    const double current_mb = predict_mb(g_demo.stage, &current);
+    char format[96];
+    snprintf(format, sizeof(format), "%%d  (%s%.3g symbols, %s%.3g MB)",
+             current.exact ? "" : "~", current.length,
+             current.exact ? "" : "~", current_mb);
+    ImGui::PushItemWidth(std::max(100, App::g_width - 100));
+    reinterpret |= ImGui::SliderInt(" ", &(g_demo.stage), 0,
+                                    g_demo.max_stage, format);
     ImGui::PopItemWidth();
 
     ImGui::SameLine();
     ImGui::BeginGroup();
     if (ImGui::SmallButton("+")) { ++g_demo.max_stage; }
+    if (ImGui::IsItemHovered()) {
+      StageStats next;
+      const double next_mb = predict_mb(g_demo.max_stage + 1, &next);
+      const char *warning = "";
+      if (budget_mb and next_mb > budget_mb) {
+        warning = g_demo.ls.CanSeek()
+                      ? "\nOver the memory budget, so it will be drawn "
+                        "straight from the rules"
+                      : "\nOver the memory budget, so it won't be generated";
+      }
+      ImGui::SetTooltip(
+          "Stage %d: %s%.3g symbols, %.3g lines, stack %.0f, %.3g MB%s",
+          g_demo.max_stage + 1, next.exact ? "" : "~", next.length,
+          CountSegments(next, g_demo.tm), next.max_depth, next_mb, warning);
+    }
     if (ImGui::SmallButton("-")) {
       --g_demo.max_stage;
       if (g_demo.stage > g_demo.max_stage) {
         g_demo.stage = g_demo.max_stage;
-        redraw = true;
+        reinterpret = true;
       }
     }
     ImGui::EndGroup();
 
+    // Animates each stage growing into the next, up to the last. Scenes
+    // don't grow.
+    ImGui::SameLine();
+    if (g_show_scene) {
+      ImGui::TextDisabled("grow");
+    } else if (g_growth.Active() ? ImGui::SmallButton("stop")
+                                 : ImGui::SmallButton("grow")) {
+      if (g_growth.Active()) {
+        g_growth.stage = -1;
+        reinterpret = true;
+      } else {
+        StartGrowth();
+        redraw |= !g_growth.Active();
+      }
+    }
+
+    ImGui::End();
+  }
+
+  // ======= REPORT DRAWING ERRORS ==========
+  if (!g_draw_error.empty()) {
+    ImGui::SetNextWindowPos({App::g_width / 2.0f - 150, 0}, ImGuiCond_Once);
+    ImGui::SetNextWindowSize({300, 60}, ImGuiCond_Once);
+    ImGui::Begin("Error");
+    ImGui::TextWrapped("%s", g_draw_error.c_str());
     ImGui::End();
   }
 
@@ -280,23 +601,60 @@ void main_loop()
     ImGui::SetNextWindowPos({734, 361}, ImGuiCond_Once);
     ImGui::SetNextWindowCollapsed(true, ImGuiCond_Once);
     ImGui::Begin("Raw String (preview)");
+    // Systems that can't seek are left for the turtle to generate, which
+    // answers the queries of open ones (see Generate2D), and runs after this
+    if (!g_demo.ls.CanSeek() and g_demo.ls.m_stage != g_demo.stage) {
+      ImGui::TextDisabled("Stage %d isn't generated", g_demo.stage);
+    } else {
+      // Exports are streamed from the derivation (see export.h), so they work
+      // for stages far too large to copy
+      const uint64_t length = g_demo.ls.Length(g_demo.stage);
+      static std::string export_error;
 #ifdef BUILD_WASM
-    // Clipboard doesn't work in the browser, so we console log instead
-    if (ImGui::Button("Print to console")) {
-      std::cout << g_demo.ls.m_value << '\n';
-    }
+      // Clipboard doesn't work in the browser, so we download instead
+      if (ImGui::Button("Download")) {
+        export_error.clear();
+        DownloadValue(g_demo.ls, g_demo.stage, "system.txt", &export_error);
+      }
 #else
-    if (ImGui::Button("Copy to clipboard")) {
-      ImGui::LogToClipboard();
-      ImGui::LogText(g_demo.ls.m_value.c_str());
-      ImGui::LogFinish();
-    }
+      // The clipboard needs the whole string in one buffer
+      const uint64_t CLIPBOARD_LIMIT = 1 << 24;
+      if (length <= CLIPBOARD_LIMIT and ImGui::Button("Copy to clipboard")) {
+        ImGui::SetClipboardText(
+            g_demo.ls.Window(g_demo.stage, 0, length).c_str());
+      }
+      static std::string export_path = "system.txt";
+      ImGui::InputText("##path", &export_path);
+      ImGui::SameLine();
+      if (ImGui::Button("Save")) {
+        export_error.clear();
+        ExportValue(g_demo.ls, g_demo.stage, export_path.c_str(),
+                    &export_error);
+      }
+      ImGui::SameLine();
+      if (ImGui::Button("Print")) {
+        export_error.clear();
+        ExportValue(g_demo.ls, g_demo.stage, STDOUT_FILENO, &export_error);
+      }
 #endif
-    if (g_demo.ls.m_value.size() < 9000) {
-      ImGui::TextWrapped("%s", g_demo.ls.m_value.c_str());
-    } else {
-      ImGui::TextWrapped("String has been truncated to (9000): %s",
-                         g_demo.ls.m_value.substr(0, 9000).c_str());
+      if (!export_error.empty()) {
+        ImGui::TextWrapped("%s", export_error.c_str());
+      }
+
+      // The window is read straight from the derivation, so this can scroll
+      // through stages far too large to generate
+      const uint64_t PREVIEW_SIZE = 9000;
+      static uint64_t preview_start = 0;
+      ImGui::InputScalar("start", ImGuiDataType_U64, &preview_start,
+                         &PREVIEW_SIZE);
+      preview_start = std::min(preview_start, length);
+
+      std::string preview =
+          g_demo.ls.Window(g_demo.stage, preview_start, PREVIEW_SIZE);
+      ImGui::TextWrapped("Showing [%llu, %llu) of %llu: %s",
+                         (unsigned long long)preview_start,
+                         (unsigned long long)(preview_start + preview.size()),
+                         (unsigned long long)length, preview.c_str());
     }
     ImGui::End();
   }
@@ -318,6 +676,29 @@ void main_loop()
       g_demo.turtle_colour = CreateFrom(tmp_turtle_colour);
       redraw = true;
     }
+
+    // For the turtle's colour indexes, see NEXT_COLOUR
+    std::vector<SDL_Colour> &palette = g_demo.stroke.palette;
+    for (size_t i = 0; i < palette.size(); ++i) {
+      ImVec4 tmp_colour = CreateFrom(palette[i]);
+      const std::string label = "Colour " + std::to_string(i);
+      if (ImGui::ColorEdit3(label.c_str(), (float *)&tmp_colour, 0)) {
+        palette[i] = CreateFrom(tmp_colour);
+        redraw = true;
+      }
+    }
+    if (ImGui::SmallButton("add colour")) {
+      palette.push_back(palette.empty() ? g_demo.turtle_colour
+                                        : palette.back());
+      redraw = true;
+    }
+    if (!palette.empty()) {
+      ImGui::SameLine();
+      if (ImGui::SmallButton("remove colour")) {
+        palette.pop_back();
+        redraw = true;
+      }
+    }
     ImGui::End();
   }
 
@@ -327,66 +708,163 @@ void main_loop()
     ImGui::SetNextWindowPos({0, 0}, ImGuiCond_Once);
     ImGui::Begin("Examples");
     if (ImGui::BeginCombo("Load example", nullptr, ImGuiComboFlags_NoPreview)) {
-      for (int n = 0; n < examples.size(); ++n) {
+      for (int n = 0; n < (int)example_names.size(); ++n) {
         const bool is_selected = false;
-        if (ImGui::Selectable(example_names[n], is_selected)) {
-          g_demo = examples[n];
-          system_changed = true;
+        if (ImGui::Selectable(example_names[n].c_str(), is_selected)) {
+          // Built when picked, and like loaded examples there's nothing to
+          // regenerate until the stage is drawn
+          g_demo = PickExample(n, examples);
+          UpdateTurtleMap(g_demo.tm, g_demo.ls);
+          g_scene_stale = true;
+          reinterpret = true;
         }
       }
       ImGui::EndCombo();
     }
+
+#ifndef BUILD_WASM
+    // Save/load the current demo, see serialize.h for the format
+    if (ImGui::TreeNode("file options...")) {
+      static std::string path = "system.lsb";
+      static bool with_stage = false;
+      static std::string file_error;
+      ImGui::InputText("file", &path);
+      ImGui::Checkbox("include stage", &with_stage);
+      if (ImGui::Button("Save")) {
+        file_error.clear();
+        SaveDemo(g_demo, with_stage ? STAGE_RAW : STAGE_NONE, path.c_str(),
+                 &file_error);
+      }
+      ImGui::SameLine();
+      if (ImGui::Button("Load")) {
+        file_error.clear();
+        if (LoadDemo(path.c_str(), g_demo, &file_error)) {
+          g_scene_stale = true;
+          reinterpret = true;
+        }
+      }
+      if (!file_error.empty()) {
+        ImGui::TextWrapped("%s", file_error.c_str());
+      }
+      ImGui::TreePop();
+    }
+#endif
     ImGui::End();
   }
 
+  // ======= GROW A SCENE OF MANY PLANTS ==========
+  //
+  // Rows of the current system, each plant with its own seed and stage
+  //                   (reinterpret = true)
+  {
+    ImGui::SetNextWindowSize({220, 180}, ImGuiCond_Once);
+    ImGui::SetNextWindowPos({App::g_width - 220.0f, 0}, ImGuiCond_Once);
+    ImGui::SetNextWindowCollapsed(true, ImGuiCond_Once);
+    ImGui::Begin("Scene");
+    reinterpret |= ImGui::Checkbox("show scene", &g_show_scene);
+    bool rows_changed = ImGui::InputInt("plants", &g_scene_rows.count);
+    rows_changed |= ImGui::InputInt("per row", &g_scene_rows.columns);
+    rows_changed |= ImGui::InputFloat("spacing", &g_scene_rows.spacing);
+    rows_changed |= ImGui::Checkbox("vary seeds", &g_scene_rows.vary_seeds);
+    rows_changed |= ImGui::SliderInt("stage spread",
+                                     &g_scene_rows.stage_spread, 0, 4);
+    g_scene_rows.count = std::clamp(g_scene_rows.count, 0, 10000);
+    g_scene_rows.columns = std::max(1, g_scene_rows.columns);
+    reinterpret |= rows_changed and g_show_scene;
+    if (g_show_scene) {
+      ImGui::Text("%zu plants, %zu drawings", g_scene.plants.size(),
+                  g_scene.cache.size());
+    }
+    ImGui::End();
+  }
+
+  // Anything else that changes the drawing stops the growth
+  if (g_growth.Active() and (system_changed or reinterpret)) {
+    g_growth.stage = -1;
+    reinterpret = true;
+  }
+  if (g_growth.Active()) {
+    g_growth_t += io.DeltaTime / SECONDS_PER_STAGE;
+    if (g_growth_t >= 1) {
+      // The system has already been stepped to the next stage
+      ++g_demo.stage;
+      if (g_demo.stage < g_demo.max_stage) {
+        StartGrowth();
+        redraw |= !g_growth.Active();
+      } else {
+        g_growth.stage = -1;
+        reinterpret = true;
+      }
+    }
+  }
+
   // System must recalculate its value regardless of its current stage
   if (system_changed) {
     ResetSystem();
-    redraw = true;
+    reinterpret = true;
   }
 
-  // System must redraw,
+  // Turtle must run again,
   // it may recalculate its value depending on its current stage
-  if (redraw) { Redraw(); }
+  if (reinterpret) {
+    Reinterpret();
+    redraw = true;
+  }
+
+  if (g_growth.Active()) {
+    RedrawGrowth(!redraw);
+  } else if (redraw) {
+    Redraw();
+  }
 
   App::Present();
 }
 
 int main(int argc, char *argv[])
 {
-  App::Setup("fern", WIDTH, HEIGHT, SDL_WINDOW_RESIZABLE,
-             SDL_RENDERER_PRESENTVSYNC);
-
-#include "examples.h"
-
-#define ADD_EXAMPLE(INTERNAL_NAME, READABLE_NAME)                              \
-  examples.push_back(INTERNAL_NAME);                                           \
-  example_names.push_back(READABLE_NAME);
-
-  ADD_EXAMPLE(AB_1_24a, "Simple branching - ABoP 1.24a");
-  ADD_EXAMPLE(AB_1_24b, "Simple branching - ABoP 1.24b");
-  ADD_EXAMPLE(AB_1_24c, "Simple branching - ABoP 1.24c");
-  ADD_EXAMPLE(AB_1_24d, "Simple branching - ABoP 1.24d");
-  ADD_EXAMPLE(AB_1_24e, "Simple branching - ABoP 1.24e");
-  ADD_EXAMPLE(AB_1_24f, "Simple branching - ABoP 1.24f");
+  HeadlessOptions headless;
+  std::vector<const char *> files;
+  std::string arg_error;
+  if (!ParseHeadlessArgs(argc, argv, headless, files, &arg_error)) {
+    std::cerr << arg_error << '\n';
+    return 1;
+  }
 
-  ADD_EXAMPLE(AB_1_27, "Stochastic branching - ABoP 1.27");
+  for (const Example &e : EXAMPLES) {
+    example_names.push_back(e.name);
+  }
 
-  ADD_EXAMPLE(AB_1_30_a, "Acropetal development - ABoP 1.30a");
-  ADD_EXAMPLE(AB_1_30_b, "Basipetal development - ABoP 1.30b");
+  // Any systems passed on the command line are added to the examples. These
+  // are either text grammars (see grammar.h) or saved .lsb files, whose saved
+  // stages are mapped rather than regenerated.
+  for (const char *file : files) {
+    std::string path = file;
+    std::string error;
+    bool loaded;
+    if (path.size() > 4 and path.substr(path.size() - 4) == ".lsb") {
+      Demo demo;
+      loaded = LoadDemo(file, demo, &error);
+      if (loaded) {
+        examples.push_back(std::move(demo));
+        example_names.push_back(path);
+      }
+    } else {
+      loaded = LoadGrammarFile(file, examples, example_names, &error);
+    }
+    if (!loaded) { std::cerr << error << '\n'; }
+  }
 
-  ADD_EXAMPLE(AB_1_31_a, "Context sensitive - ABoP 1.31a");
-  ADD_EXAMPLE(AB_1_31_b, "Context sensitive - ABoP 1.31b");
-  ADD_EXAMPLE(AB_1_31_c, "Context sensitive - ABoP 1.31c");
-  ADD_EXAMPLE(AB_1_31_d, "Context sensitive - ABoP 1.31d");
-  ADD_EXAMPLE(AB_1_31_e, "Context sensitive - ABoP 1.31e");
+  // Exports don't need a window
+  if (headless.Enabled()) {
+    return RunHeadless(headless, examples);
+  }
 
-  ADD_EXAMPLE(GAoL_1_e, "Dragon Curve - GAoL 1e");
-  ADD_EXAMPLE(GAoL_1_f, "Hilbert Curve - GAoL 1f");
-  ADD_EXAMPLE(GAoL_2_a, "Sierpinski arrowhead - GAoL 2a");
+  App::Setup("fern", WIDTH, HEIGHT, SDL_WINDOW_RESIZABLE,
+             SDL_RENDERER_PRESENTVSYNC);
 
-  g_demo = examples[0];
+  g_demo = PickExample(0, examples);
   ResetSystem();
+  Reinterpret();
   Redraw();
 
 #ifdef BUILD_WASM
@@ -0,0 +1,562 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+Parametric L-Systems, as in chapter 1.10 of ABoP. Symbols carry a list of
+float parameters, e.g. F(1.5), and rules can read them:
+
+  F(l) : l > 1 -> F(l*0.7)[+F(l*0.5)]
+
+Expressions are compiled once into a small stack based bytecode, so applying
+a rule is a straight walk over an array of ops with no parsing or lookups.
+*/
+
+enum ExprOp : uint8_t {
+  OP_CONST,
+  OP_PARAM,
+  OP_NEG,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_POW,
+  OP_LT,
+  OP_GT,
+  OP_LE,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+  OP_AND,
+  OP_OR,
+};
+
+struct Op {
+  ExprOp code;
+  uint8_t param; // For OP_PARAM
+  float value;   // For OP_CONST
+};
+
+// Deepest the evaluation stack can get, checked when compiling
+const int EXPR_STACK_SIZE = 32;
+
+// Most parameters a module can have, as Op::param and the successor's
+// arities are bytes. Checked when parsing rules.
+const int MAX_ARITY = 255;
+
+// Runs the ops in [begin, end), which must come from CompileExpression
+float Evaluate(const Op *begin, const Op *end, const float *params) {
+  float stack[EXPR_STACK_SIZE];
+  int top = -1;
+  for (const Op *op = begin; op != end; ++op) {
+    switch (op->code) {
+    case OP_CONST: {
+      stack[++top] = op->value;
+    } break;
+    case OP_PARAM: {
+      stack[++top] = params[op->param];
+    } break;
+    case OP_NEG: {
+      stack[top] = -stack[top];
+    } break;
+    default: {
+      // Every other op is binary
+      float b = stack[top--];
+      float &a = stack[top];
+      switch (op->code) {
+      case OP_ADD: a = a + b; break;
+      case OP_SUB: a = a - b; break;
+      case OP_MUL: a = a * b; break;
+      case OP_DIV: a = a / b; break;
+      case OP_POW: a = powf(a, b); break;
+      case OP_LT: a = a < b; break;
+      case OP_GT: a = a > b; break;
+      case OP_LE: a = a <= b; break;
+      case OP_GE: a = a >= b; break;
+      case OP_EQ: a = a == b; break;
+      case OP_NE: a = a != b; break;
+      case OP_AND: a = (a != 0) and (b != 0); break;
+      case OP_OR: a = (a != 0) or (b != 0); break;
+      default: break;
+      }
+    } break;
+    }
+  }
+  return stack[0];
+}
+
+namespace Expr {
+
+// Recursive descent over the grammar
+//   or    := and ('||' and)*
+//   and   := cmp ('&&' cmp)*
+//   cmp   := add (('<' | '>' | '<=' | '>=' | '==' | '!=') add)?
+//   add   := mul (('+' | '-') mul)*
+//   mul   := unary (('*' | '/') unary)*
+//   unary := '-' unary | pow
+//   pow   := atom ('^' unary)?
+//   atom  := number | name | '(' or ')'
+struct Compiler {
+  std::string_view src;
+  const std::vector<std::string> &names; // Formal parameters
+  std::vector<Op> &out;
+  std::string *error;
+  size_t pos = 0;
+  int depth = 0, max_depth = 0;
+
+  bool Fail(const std::string &message) {
+    if (error->empty()) {
+      *error = message + " in '" + std::string(src) + "'";
+    }
+    return false;
+  }
+
+  void SkipSpace() {
+    while (pos < src.size() and src[pos] == ' ') {
+      ++pos;
+    }
+  }
+
+  bool Accept(std::string_view token) {
+    SkipSpace();
+    if (src.substr(pos, token.size()) == token) {
+      pos += token.size();
+      return true;
+    }
+    return false;
+  }
+
+  void Push(Op op) {
+    depth += (op.code == OP_CONST or op.code == OP_PARAM);
+    max_depth = std::max(max_depth, depth);
+    out.push_back(op);
+  }
+
+  // Folds constant operands as it goes, so e.g. 'l * (1/3)' is one multiply
+  void Binary(ExprOp code) {
+    const size_t n = out.size();
+    if (n >= 2 and out[n - 1].code == OP_CONST and
+        out[n - 2].code == OP_CONST) {
+      const Op ops[3] = {out[n - 2], out[n - 1], {code, 0, 0}};
+      out.resize(n - 2);
+      out.push_back({OP_CONST, 0, Evaluate(ops, ops + 3, nullptr)});
+    } else {
+      out.push_back({code, 0, 0});
+    }
+    --depth;
+  }
+
+  bool Atom() {
+    SkipSpace();
+    if (Accept("(")) {
+      if (!Or()) {
+        return false;
+      }
+      return Accept(")") or Fail("expected ')'");
+    }
+    if (pos < src.size() and (isdigit(src[pos]) or src[pos] == '.')) {
+      std::string number(src.substr(pos));
+      char *end;
+      float v = strtof(number.c_str(), &end);
+      pos += end - number.c_str();
+      Push({OP_CONST, 0, v});
+      return true;
+    }
+    size_t start = pos;
+    while (pos < src.size() and (isalnum(src[pos]) or src[pos] == '_')) {
+      ++pos;
+    }
+    std::string_view name = src.substr(start, pos - start);
+    if (name.empty()) {
+      return Fail("expected a value");
+    }
+    for (int i = 0; i < (int)names.size(); ++i) {
+      if (name == names[i]) {
+        Push({OP_PARAM, (uint8_t)i, 0});
+        return true;
+      }
+    }
+    return Fail("unknown parameter '" + std::string(name) + "'");
+  }
+
+  bool Unary() {
+    if (Accept("-")) {
+      if (!Unary()) {
+        return false;
+      }
+      if (out.back().code == OP_CONST) {
+        out.back().value = -out.back().value;
+      } else {
+        out.push_back({OP_NEG, 0, 0});
+      }
+      return true;
+    }
+    return Pow();
+  }
+
+  bool Pow() {
+    if (!Atom()) {
+      return false;
+    }
+    if (Accept("^")) {
+      if (!Unary()) {
+        return false;
+      }
+      Binary(OP_POW);
+    }
+    return true;
+  }
+
+  bool Mul() {
+    if (!Unary()) {
+      return false;
+    }
+    while (true) {
+      ExprOp code;
+      if (Accept("*")) {
+        code = OP_MUL;
+      } else if (Accept("/")) {
+        code = OP_DIV;
+      } else {
+        return true;
+      }
+      if (!Unary()) {
+        return false;
+      }
+      Binary(code);
+    }
+  }
+
+  bool Add() {
+    if (!Mul()) {
+      return false;
+    }
+    while (true) {
+      ExprOp code;
+      if (Accept("+")) {
+        code = OP_ADD;
+      } else if (Accept("-")) {
+        code = OP_SUB;
+      } else {
+        return true;
+      }
+      if (!Mul()) {
+        return false;
+      }
+      Binary(code);
+    }
+  }
+
+  bool Cmp() {
+    if (!Add()) {
+      return false;
+    }
+    // Two char operators first so '<=' isn't read as '<'
+    const std::pair<const char *, ExprOp> ops[] = {
+        {"<=", OP_LE}, {">=", OP_GE}, {"==", OP_EQ}, {"!=", OP_NE},
+        {"<", OP_LT},  {">", OP_GT},
+    };
+    for (auto [token, code] : ops) {
+      if (Accept(token)) {
+        if (!Add()) {
+          return false;
+        }
+        Binary(code);
+        return true;
+      }
+    }
+    return true;
+  }
+
+  bool And() {
+    if (!Cmp()) {
+      return false;
+    }
+    while (Accept("&&")) {
+      if (!Cmp()) {
+        return false;
+      }
+      Binary(OP_AND);
+    }
+    return true;
+  }
+
+  bool Or() {
+    if (!And()) {
+      return false;
+    }
+    while (Accept("||")) {
+      if (!And()) {
+        return false;
+      }
+      Binary(OP_OR);
+    }
+    return true;
+  }
+};
+
+} // namespace Expr
+
+// Compiles src, appending its ops to out. names are the formal parameters
+// that the expression can refer to.
+bool CompileExpression(std::string_view src,
+                       const std::vector<std::string> &names,
+                       std::vector<Op> &out, std::string *error) {
+  Expr::Compiler c{src, names, out, error};
+  if (!c.Or()) {
+    return false;
+  }
+  c.SkipSpace();
+  if (c.pos != src.size()) {
+    return c.Fail("unexpected '" + std::string(src.substr(c.pos)) + "'");
+  }
+  if (c.max_depth > EXPR_STACK_SIZE) {
+    return c.Fail("expression is too deeply nested");
+  }
+  return true;
+}
+
+// Each symbol i has the parameters values[start[i] .. start[i + 1])
+struct ParamBuffer {
+  std::vector<uint32_t> start = {0};
+  std::vector<float> values;
+
+  void Clear() {
+    start.assign(1, 0);
+    values.clear();
+  }
+  int Count(size_t i) const { return start[i + 1] - start[i]; }
+  const float *Get(size_t i) const { return values.data() + start[i]; }
+};
+
+struct ParametricRule {
+  std::string text; // As written, for display and saving
+
+  char target;
+  int arity; // Rule only applies to symbols with this many parameters
+
+  // All of the rule's expressions share one op buffer. The condition is
+  // ops[0, condition_end), and argument j of the successor is
+  // ops[arg_end[j - 1], arg_end[j]) (with arg_end[-1] = condition_end).
+  std::vector<Op> ops;
+  uint32_t condition_end = 0;
+  std::vector<uint32_t> arg_end;
+
+  // The successor, with module k having arity[k] arguments
+  std::string successor;
+  std::vector<uint8_t> successor_arity;
+
+  bool Condition(const float *params) const {
+    return condition_end == 0 or
+           Evaluate(ops.data(), ops.data() + condition_end, params) != 0.0f;
+  }
+
+  // Appends the successor, with its arguments evaluated for params
+  void Apply(const float *params, std::string &symbols,
+             ParamBuffer &out) const {
+    const Op *op = ops.data() + condition_end;
+    const uint32_t *end = arg_end.data();
+    for (int k = 0; k < (int)successor.size(); ++k) {
+      symbols += successor[k];
+      for (int j = 0; j < successor_arity[k]; ++j, ++end) {
+        out.values.push_back(Evaluate(op, ops.data() + *end, params));
+        op = ops.data() + *end;
+      }
+      out.start.push_back(out.values.size());
+    }
+  }
+};
+
+namespace Expr {
+
+// Splits 'a, f(b, c)' on the top level commas
+std::vector<std::string_view> SplitArgs(std::string_view s) {
+  std::vector<std::string_view> args;
+  int depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i < s.size(); ++i) {
+    depth += (s[i] == '(') - (s[i] == ')');
+    if (s[i] == ',' and depth == 0) {
+      args.push_back(s.substr(start, i - start));
+      start = i + 1;
+    }
+  }
+  args.push_back(s.substr(start));
+  return args;
+}
+
+// Calls module(symbol, args) for each module in a string like 'A(x,2)B[+C]'
+template <typename F>
+bool ForEachModule(std::string_view s, std::string *error, F module) {
+  size_t i = 0;
+  while (i < s.size()) {
+    char symbol = s[i++];
+    if (symbol == ' ') {
+      continue;
+    }
+    // Rules are looked up by symbol in tables of 128
+    if ((unsigned char)symbol >= 128) {
+      *error = "non-ASCII symbol in '" + std::string(s) + "'";
+      return false;
+    }
+    std::vector<std::string_view> args;
+    if (i < s.size() and s[i] == '(') {
+      int depth = 0;
+      size_t close = i;
+      for (; close < s.size(); ++close) {
+        depth += (s[close] == '(') - (s[close] == ')');
+        if (depth == 0) {
+          break;
+        }
+      }
+      if (close == s.size()) {
+        *error = "unmatched '(' in '" + std::string(s) + "'";
+        return false;
+      }
+      args = SplitArgs(s.substr(i + 1, close - i - 1));
+      i = close + 1;
+    }
+    if (!module(symbol, args)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace Expr
+
+// Parses a rule of the form 'F(a, b) : condition -> successor', where the
+// condition is optional.
+bool ParseParametricRule(const std::string &text, ParametricRule *rule,
+                         std::string *error) {
+  ParametricRule r;
+  r.text = text;
+
+  size_t arrow = text.find("->");
+  if (arrow == std::string::npos) {
+    *error = "rule is missing '->' in '" + text + "'";
+    return false;
+  }
+  std::string_view lhs = std::string_view(text).substr(0, arrow);
+  std::string_view rhs = std::string_view(text).substr(arrow + 2);
+  std::string_view condition;
+  size_t colon = lhs.find(':');
+  if (colon != std::string::npos) {
+    condition = lhs.substr(colon + 1);
+    lhs = lhs.substr(0, colon);
+  }
+
+  // Predecessor, whose arguments must be distinct names
+  auto is_name = [](std::string_view name) {
+    auto name_char = [](char c) {
+      return isalnum((unsigned char)c) or c == '_';
+    };
+    return !name.empty() and !isdigit((unsigned char)name[0]) and
+           std::all_of(name.begin(), name.end(), name_char);
+  };
+  std::vector<std::string> names;
+  int n_modules = 0;
+  bool ok = Expr::ForEachModule(
+      lhs, error, [&](char symbol, std::vector<std::string_view> &args) {
+        if (++n_modules > 1) {
+          *error = "expected a single predecessor in '" + text + "'";
+          return false;
+        }
+        if (args.size() > MAX_ARITY) {
+          *error = "more than " + std::to_string(MAX_ARITY) +
+                   " parameters in '" + text + "'";
+          return false;
+        }
+        r.target = symbol;
+        for (std::string_view a : args) {
+          size_t first = a.find_first_not_of(' ');
+          size_t last = a.find_last_not_of(' ');
+          std::string name(first == std::string::npos
+                               ? ""
+                               : a.substr(first, last - first + 1));
+          if (!is_name(name)) {
+            *error = name.empty() ? "empty parameter in '" + text + "'"
+                                  : "parameter '" + name +
+                                        "' isn't a name in '" + text + "'";
+            return false;
+          }
+          if (std::find(names.begin(), names.end(), name) != names.end()) {
+            *error = "parameter '" + name + "' appears twice in '" + text +
+                     "'";
+            return false;
+          }
+          names.push_back(name);
+        }
+        return true;
+      });
+  if (!ok) {
+    return false;
+  }
+  if (n_modules != 1) {
+    *error = "expected a single predecessor in '" + text + "'";
+    return false;
+  }
+  r.arity = names.size();
+
+  if (condition.find_first_not_of(' ') != std::string::npos) {
+    if (!CompileExpression(condition, names, r.ops, error)) {
+      return false;
+    }
+  }
+  r.condition_end = r.ops.size();
+
+  ok = Expr::ForEachModule(
+      rhs, error, [&](char symbol, std::vector<std::string_view> &args) {
+        if (args.size() > MAX_ARITY) {
+          *error = "more than " + std::to_string(MAX_ARITY) +
+                   " parameters in '" + text + "'";
+          return false;
+        }
+        r.successor += symbol;
+        r.successor_arity.push_back(args.size());
+        for (std::string_view a : args) {
+          if (!CompileExpression(a, names, r.ops, error)) {
+            return false;
+          }
+          r.arg_end.push_back(r.ops.size());
+        }
+        return true;
+      });
+  if (!ok) {
+    return false;
+  }
+
+  *rule = std::move(r);
+  return true;
+}
+
+// Parses a string of modules with constant arguments, e.g. a seed like
+// 'A(1)B(2, 3)', into its symbols and parameters.
+bool ParseModules(std::string_view s, std::string &symbols, ParamBuffer &params,
+                  std::string *error) {
+  symbols.clear();
+  params.Clear();
+  const std::vector<std::string> no_names;
+  std::vector<Op> ops;
+  return Expr::ForEachModule(
+      s, error, [&](char symbol, std::vector<std::string_view> &args) {
+        symbols += symbol;
+        for (std::string_view a : args) {
+          ops.clear();
+          if (!CompileExpression(a, no_names, ops, error)) {
+            return false;
+          }
+          params.values.push_back(
+              Evaluate(ops.data(), ops.data() + ops.size(), nullptr));
+        }
+        params.start.push_back(params.values.size());
+        return true;
+      });
+}
@@ -0,0 +1,326 @@
+#pragma once
+
+#include "demo.h"
+#include "lsystem.h"
+#include "turtle.h"
+
+#include "SDL.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+A scene of many plants, e.g. a forest, each one an instance of one of a few
+systems with its own position, rng seed and stage.
+
+Plants that would grow the same way share one drawing: the same system at the
+same stage, with the same seed too if the system is stochastic. Drawings are
+reference counted, and the scene's cache only holds weak references to them,
+so a drawing lives as long as some plant uses it. Growing a scene generates
+and interprets each distinct drawing once, handed out to a pool of threads
+like the seeds in RunEnsemble.
+
+Rendering is per drawing too. Each one is drawn once into its own texture, at
+the current scale, and every plant that uses it becomes a textured quad in a
+single SDL_RenderGeometry call. So a thousand plants of a few systems cost
+about as much as those few systems. Drawings too big for a texture are drawn
+line by line for each plant instead.
+
+Plants don't see each other, so open systems only answer their queries from
+their own drawing (see AnswerQueries).
+*/
+
+// Textures bigger than this each way are drawn line by line instead
+constexpr int SCENE_TEXTURE_MAX = 2048;
+
+struct SceneDrawing {
+  Drawing drawing;
+  Bounds bounds;
+
+  // drawing at step pixels per step, in colour and style, with the turtle's
+  // start at origin
+  SDL_Texture *texture = nullptr;
+  float step = 0;
+  SDL_Colour colour = {0, 0, 0, 0};
+  StrokeStyle style;
+  SDL_FPoint origin = {0, 0};
+  int width = 0, height = 0;
+
+  SceneDrawing() = default;
+  SceneDrawing(const SceneDrawing &) = delete;
+  SceneDrawing &operator=(const SceneDrawing &) = delete;
+  ~SceneDrawing() {
+    if (texture) { SDL_DestroyTexture(texture); }
+  }
+};
+
+struct ScenePlant {
+  int system = 0;               // Index into Scene::systems
+  SDL_FPoint position = {0, 0}; // From the scene's origin, in steps, y up
+  uint32_t rng_seed = 0;
+  int stage = 0;
+
+  // Set by GrowScene, and shared with every plant that grows the same way
+  std::shared_ptr<SceneDrawing> drawing;
+};
+
+struct Scene {
+  // Kept reset, each plant grows its own copy
+  std::vector<Demo> systems;
+  std::vector<ScenePlant> plants;
+  int threads = 0; // One per core if 0
+
+  // Clear this after editing any of the systems
+  std::map<std::string, std::weak_ptr<SceneDrawing>> cache;
+};
+
+// Whether the rng seed changes how ls grows. Parametric rules replace the
+// others (see LSystem::parametric_rules), and are deterministic.
+bool Stochastic(const LSystem &ls) {
+  if (ls.IsParametric()) {
+    return false;
+  }
+  return std::any_of(ls.rules.begin(), ls.rules.end(),
+                     [](const Rule &r) { return r.probability < 1.0f; });
+}
+
+// Plants with the same key share a drawing
+std::string PlantKey(const Scene &scene, const ScenePlant &p) {
+  std::string key =
+      std::to_string(p.system) + ":" + std::to_string(p.stage);
+  if (Stochastic(scene.systems[p.system].ls)) {
+    key += ":" + std::to_string(p.rng_seed);
+  }
+  return key;
+}
+
+// Gives every plant its drawing, growing the ones that aren't cached. Returns
+// false with an error naming the first plant that failed. Plants whose
+// drawings weren't grown are left without one.
+bool GrowScene(Scene &scene, std::string *error) {
+  struct Job {
+    std::string key;
+    size_t plant; // The first plant with this key
+    std::shared_ptr<SceneDrawing> out;
+  };
+  std::vector<Job> jobs;
+  std::map<std::string, size_t> job_of;
+  for (size_t i = 0; i < scene.plants.size(); ++i) {
+    ScenePlant &p = scene.plants[i];
+    const std::string key = PlantKey(scene, p);
+    auto cached = scene.cache.find(key);
+    if (cached != scene.cache.end()) {
+      p.drawing = cached->second.lock();
+      if (p.drawing) {
+        continue;
+      }
+    }
+    auto [job, added] = job_of.emplace(key, jobs.size());
+    if (added) {
+      jobs.push_back({key, i, std::make_shared<SceneDrawing>()});
+    }
+    p.drawing = jobs[job->second].out;
+  }
+
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  std::mutex lock; // Guards error
+  std::vector<char> grown(jobs.size(), false);
+
+  auto work = [&]() {
+    std::string e;
+    for (size_t j; !failed and (j = next++) < jobs.size();) {
+      const ScenePlant &p = scene.plants[jobs[j].plant];
+      Demo d = scene.systems[p.system];
+      // Drawings are already spread over the threads, unless there's only one
+      d.ls.threads = jobs.size() == 1 ? scene.threads : 1;
+      d.ls.rng_seed = p.rng_seed;
+      d.ls.Reset();
+      SceneDrawing &out = *jobs[j].out;
+      if (!Interpret2D(d.ls, p.stage, d.tm, d.angle_delta, out.drawing, &e)) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!failed) {
+          *error = "plant " + std::to_string(jobs[j].plant) + ": " + e;
+          failed = true;
+        }
+        break;
+      }
+      out.bounds.Extend(out.drawing);
+      grown[j] = true;
+    }
+  };
+
+  // The calling thread works too. WASM builds without pthreads can't start
+  // threads at all.
+  int threads = scene.threads > 0 ? scene.threads
+                                  : (int)std::thread::hardware_concurrency();
+  threads = std::clamp(threads, 1, (int)std::max<size_t>(1, jobs.size()));
+#if defined(BUILD_WASM) and !defined(__EMSCRIPTEN_PTHREADS__)
+  threads = 1;
+#endif
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; ++t) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (std::thread &t : pool) {
+    t.join();
+  }
+
+  for (size_t j = 0; j < jobs.size(); ++j) {
+    if (grown[j]) {
+      scene.cache[jobs[j].key] = jobs[j].out;
+    }
+  }
+  if (failed) {
+    for (ScenePlant &p : scene.plants) {
+      auto job = p.drawing ? job_of.find(PlantKey(scene, p)) : job_of.end();
+      if (job != job_of.end() and !grown[job->second]) {
+        p.drawing = nullptr;
+      }
+    }
+  }
+  // Forget drawings that no plant uses any more
+  for (auto it = scene.cache.begin(); it != scene.cache.end();) {
+    it = it->second.expired() ? scene.cache.erase(it) : std::next(it);
+  }
+  return !failed;
+}
+
+// Draws s into its texture at step pixels per step, in the current draw
+// colour, unless it's already there. Returns false if s is too big for one.
+bool UpdateSceneTexture(SDL_Renderer *r, SceneDrawing &s, float step,
+                        const StrokeStyle &style) {
+  SDL_Colour colour;
+  SDL_GetRenderDrawColor(r, &colour.r, &colour.g, &colour.b, &colour.a);
+  if (s.texture and s.step == step and colour.r == s.colour.r and
+      colour.g == s.colour.g and colour.b == s.colour.b and
+      colour.a == s.colour.a and s.style == style) {
+    return true;
+  }
+  if (s.bounds.Empty()) {
+    return false;
+  }
+  // Room for Render's squares and wide strokes, which reach past the bounds
+  float widest = 1;
+  for (float w : s.drawing.widths) {
+    widest = std::max(widest, w);
+  }
+  const float stroke = std::max(0.5f, 0.5f * widest * style.width * step);
+  const float pad = std::ceil(std::max(0.125f * step, 1.5f * stroke)) + 2;
+  const float w = (s.bounds.max_x - s.bounds.min_x) * step + 2 * pad;
+  const float h = (s.bounds.max_y - s.bounds.min_y) * step + 2 * pad;
+  if (w > SCENE_TEXTURE_MAX or h > SCENE_TEXTURE_MAX) {
+    if (s.texture) { SDL_DestroyTexture(s.texture); }
+    s.texture = nullptr;
+    return false;
+  }
+  if (!s.texture or s.width != (int)std::ceil(w) or
+      s.height != (int)std::ceil(h)) {
+    if (s.texture) { SDL_DestroyTexture(s.texture); }
+    s.width = (int)std::ceil(w);
+    s.height = (int)std::ceil(h);
+    s.texture = SDL_CreateTexture(r, SDL_PIXELFORMAT_RGBA8888,
+                                  SDL_TEXTUREACCESS_TARGET, s.width, s.height);
+    if (!s.texture) {
+      return false;
+    }
+    SDL_SetTextureBlendMode(s.texture, SDL_BLENDMODE_BLEND);
+  }
+  s.step = step;
+  s.colour = colour;
+  s.style = style;
+  s.origin = {pad - s.bounds.min_x * step, pad + s.bounds.max_y * step};
+
+  SDL_Texture *target = SDL_GetRenderTarget(r);
+  SDL_SetRenderTarget(r, s.texture);
+  SDL_SetRenderDrawColor(r, 0, 0, 0, 0);
+  SDL_RenderClear(r);
+  SDL_SetRenderDrawColor(r, colour.r, colour.g, colour.b, 255);
+  Render(r, s.drawing, s.origin, step, style);
+  SDL_SetRenderTarget(r, target);
+  SDL_SetRenderDrawColor(r, colour.r, colour.g, colour.b, colour.a);
+  return true;
+}
+
+// Draws every plant in the current draw colour and style, with the scene's
+// origin at origin and each step scaled to step pixels
+void RenderScene(SDL_Renderer *r, Scene &scene, SDL_FPoint origin, float step,
+                 const StrokeStyle &style = {}) {
+  // Plants grouped by drawing, so each drawing is one draw call
+  std::map<SceneDrawing *, std::vector<const ScenePlant *>> batches;
+  for (const ScenePlant &p : scene.plants) {
+    if (p.drawing) {
+      batches[p.drawing.get()].push_back(&p);
+    }
+  }
+
+  std::vector<SDL_Vertex> vertices;
+  std::vector<int> indices;
+  for (auto &[s, plants] : batches) {
+    if (!UpdateSceneTexture(r, *s, step, style)) {
+      for (const ScenePlant *p : plants) {
+        Render(r, s->drawing,
+               {origin.x + step * p->position.x,
+                origin.y - step * p->position.y},
+               step, style);
+      }
+      continue;
+    }
+    vertices.clear();
+    indices.clear();
+    for (const ScenePlant *p : plants) {
+      // Whole pixels, so the texture isn't resampled
+      const float x =
+          std::round(origin.x + step * p->position.x - s->origin.x);
+      const float y =
+          std::round(origin.y - step * p->position.y - s->origin.y);
+      const int first = vertices.size();
+      const SDL_Colour white = {255, 255, 255, 255};
+      vertices.push_back({{x, y}, white, {0, 0}});
+      vertices.push_back({{x + s->width, y}, white, {1, 0}});
+      vertices.push_back({{x + s->width, y + s->height}, white, {1, 1}});
+      vertices.push_back({{x, y + s->height}, white, {0, 1}});
+      for (int i : {0, 1, 2, 0, 2, 3}) {
+        indices.push_back(first + i);
+      }
+    }
+    SDL_RenderGeometry(r, s->texture, vertices.data(), vertices.size(),
+                       indices.data(), indices.size());
+  }
+}
+
+// Plants of systems[0] in rows, the front row centred on the scene's origin
+// and the others further back
+struct SceneRows {
+  int count = 100;
+  int columns = 10;
+  float spacing = 40;     // Steps between plants
+  bool vary_seeds = true; // Consecutive seeds from the system's own
+  int stage_spread = 0;   // Plants are up to this many stages younger
+};
+
+void PlantRows(Scene &scene, const SceneRows &rows, int stage) {
+  const int columns = std::max(1, rows.columns);
+  const uint32_t spread = std::max(0, rows.stage_spread);
+  const uint32_t seed = scene.systems[0].ls.rng_seed;
+  scene.plants.resize(std::max(0, rows.count));
+  for (int i = 0; i < (int)scene.plants.size(); ++i) {
+    ScenePlant &p = scene.plants[i];
+    p.system = 0;
+    p.position = {(i % columns - (columns - 1) / 2.0f) * rows.spacing,
+                  (i / columns) * rows.spacing / 2};
+    p.rng_seed = rows.vary_seeds ? seed + i : seed;
+    // Scattered, but the same every time
+    const uint32_t younger =
+        ((uint32_t)i * 2654435761u >> 16) % (spread + 1);
+    p.stage = std::max(0, stage - (int)younger);
+  }
+}
@@ -0,0 +1,465 @@
+#pragma once
+
+#include "demo.h"
+#include "lsystem.h"
+#include "turtle.h"
+
+// Files are mapped where there's mmap, and read into memory elsewhere
+#if !defined(BUILD_WASM) and (defined(__unix__) or defined(__APPLE__))
+#define SERIALIZE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/*
+Binary format for a Demo, optionally followed by a generated stage.
+
+Everything is little-endian and written field by field, so the struct layout
+of the host doesn't matter:
+
+  "LSYS", u32 version
+  view    f32 origin.x, f32 origin.y, f32 zoom, i32 stage, i32 max_stage,
+          u8[4] clear_colour, i32 step_size, f32 angle_delta,
+          u8[4] turtle_colour, f32 stroke.width, u32 n_colours,
+          n_colours * u8[4] stroke.palette
+  system  str seed, u64[2] ignore_list, u32 rng_seed,
+          u32 n_rules, n_rules * {u8 target, u8 left, u8 right,
+                                  f32 probability, str replacement,
+                                  str left_string, str right_string},
+          u32 n_prules, n_prules * str text
+  turtle  u32 n_entries, n_entries * {u8 symbol, u8 instruction}
+  stage   u32 encoding (STAGE_*), and unless STAGE_NONE:
+          i32 stage, u64 length, then
+            STAGE_RAW:    padding to 8 bytes, length * u8
+            STAGE_PACKED: u8 n_symbols, n_symbols * u8, u8 bits,
+                          ceil(length * bits / 64) * u64
+
+where str is a u32 length followed by that many bytes.
+
+rng_seed seeds Random in lsystem.h. Earlier builds of the app seeded the C
+library's rand with it instead, so a seed noted from one of them grows a
+different plant now.
+
+Raw stages are aligned so that they can be used straight out of the mapped
+file without a copy. Packed stages store each symbol as an index into the
+alphabet of the stage, which for most systems is 3 or 4 bits per symbol, but
+they must be unpacked when loaded. Stages of parametric systems aren't saved,
+as their parameters would be lost.
+*/
+
+const char SAVE_MAGIC[4] = {'L', 'S', 'Y', 'S'};
+const uint32_t SAVE_VERSION = 1;
+
+enum StageEncoding : uint32_t {
+  STAGE_NONE,
+  STAGE_RAW,
+  STAGE_PACKED,
+};
+
+namespace Serialize {
+
+struct Writer {
+  std::string out;
+
+  template <typename T> void Put(T v) {
+    out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+  }
+  void PutString(std::string_view s) {
+    Put<uint32_t>(s.size());
+    out.append(s);
+  }
+  void Align(int n) {
+    while (out.size() % n) {
+      out += '\0';
+    }
+  }
+};
+
+// Reads from a buffer, every read fails once any read has run off the end
+struct Reader {
+  const char *data;
+  size_t size;
+  size_t pos = 0;
+  bool ok = true;
+
+  template <typename T> T Get() {
+    T v{};
+    if (ok and pos + sizeof(T) <= size) {
+      memcpy(&v, data + pos, sizeof(T));
+      pos += sizeof(T);
+    } else {
+      ok = false;
+    }
+    return v;
+  }
+  std::string_view GetBytes(uint64_t n) {
+    if (!ok or n > size - pos) {
+      ok = false;
+      return {};
+    }
+    std::string_view v(data + pos, n);
+    pos += n;
+    return v;
+  }
+  std::string GetString() { return std::string(GetBytes(Get<uint32_t>())); }
+  void Align(int n) {
+    pos = std::min(size, (pos + n - 1) / n * n);
+  }
+};
+
+int BitsFor(int n_symbols) {
+  int bits = 1;
+  while ((1 << bits) < n_symbols) {
+    ++bits;
+  }
+  return bits;
+}
+
+} // namespace Serialize
+
+// Serializes the demo. If encoding is not STAGE_NONE, the value of the system
+// at demo.stage is generated and stored too.
+std::string SaveDemo(Demo &demo, StageEncoding encoding) {
+  Serialize::Writer w;
+  w.out.append(SAVE_MAGIC, 4);
+  w.Put(SAVE_VERSION);
+
+  w.Put(demo.origin.x);
+  w.Put(demo.origin.y);
+  w.Put(demo.zoom);
+  w.Put<int32_t>(demo.stage);
+  w.Put<int32_t>(demo.max_stage);
+  w.Put(demo.clear_colour);
+  w.Put<int32_t>(demo.step_size);
+  w.Put(demo.angle_delta);
+  w.Put(demo.turtle_colour);
+  w.Put(demo.stroke.width);
+  w.Put<uint32_t>(demo.stroke.palette.size());
+  for (SDL_Colour c : demo.stroke.palette) {
+    w.Put(c);
+  }
+
+  const LSystem &ls = demo.ls;
+  w.PutString(ls.seed);
+  w.Put(ls.ignore_list[0]);
+  w.Put(ls.ignore_list[1]);
+  w.Put(ls.rng_seed);
+  w.Put<uint32_t>(ls.rules.size());
+  for (const Rule &r : ls.rules) {
+    w.Put(r.target);
+    w.Put(r.left_context);
+    w.Put(r.right_context);
+    w.Put(r.probability);
+    w.PutString(r.replacement);
+    w.PutString(r.left_string);
+    w.PutString(r.right_string);
+  }
+  w.Put<uint32_t>(ls.parametric_rules.size());
+  for (const ParametricRule &r : ls.parametric_rules) {
+    w.PutString(r.text);
+  }
+
+  w.Put<uint32_t>(demo.tm.size());
+  for (auto [c, ins] : demo.tm) {
+    w.Put(c);
+    w.Put<uint8_t>(ins);
+  }
+
+  if (ls.IsParametric()) {
+    encoding = STAGE_NONE;
+  }
+  // Stages over the memory budget are left out, see LSystem::Generate
+  std::string_view value;
+  if (encoding != STAGE_NONE) {
+    value = demo.ls.Generate(demo.stage);
+    if (demo.ls.m_stage != demo.stage) {
+      encoding = STAGE_NONE;
+    }
+  }
+  w.Put<uint32_t>(encoding);
+  if (encoding == STAGE_NONE) {
+    return w.out;
+  }
+
+  w.Put<int32_t>(demo.stage);
+  w.Put<uint64_t>(value.size());
+
+  if (encoding == STAGE_RAW) {
+    w.Align(8);
+    w.out.append(value);
+    return w.out;
+  }
+
+  // STAGE_PACKED
+  int index[256];
+  std::fill(index, index + 256, -1);
+  std::string alphabet;
+  for (char c : value) {
+    if (index[(unsigned char)c] == -1) {
+      index[(unsigned char)c] = alphabet.size();
+      alphabet += c;
+    }
+  }
+  w.Put<uint8_t>(alphabet.size());
+  w.out.append(alphabet);
+  const int bits = Serialize::BitsFor(alphabet.size());
+  w.Put<uint8_t>(bits);
+
+  uint64_t word = 0;
+  int used = 0;
+  for (char c : value) {
+    const uint64_t code = index[(unsigned char)c];
+    word |= code << used;
+    used += bits;
+    if (used >= 64) {
+      w.Put(word);
+      used -= 64;
+      word = used ? code >> (bits - used) : 0;
+    }
+  }
+  if (used) {
+    w.Put(word);
+  }
+  return w.out;
+}
+
+// Read a demo from a buffer produced by SaveDemo. If the buffer has a raw
+// stage, the system uses it in place, so owner must keep data alive.
+bool LoadDemo(const char *data, size_t size, std::shared_ptr<const void> owner,
+              Demo &demo, std::string *error) {
+  Serialize::Reader r{data, size};
+
+  std::string_view magic = r.GetBytes(4);
+  if (!r.ok or memcmp(magic.data(), SAVE_MAGIC, 4) != 0) {
+    *error = "Not an L-System file";
+    return false;
+  }
+  const uint32_t version = r.Get<uint32_t>();
+  if (version != SAVE_VERSION) {
+    *error = "Unsupported version";
+    return false;
+  }
+
+  Demo d;
+  d.origin.x = r.Get<float>();
+  d.origin.y = r.Get<float>();
+  d.zoom = r.Get<float>();
+  d.stage = r.Get<int32_t>();
+  d.max_stage = r.Get<int32_t>();
+  d.clear_colour = r.Get<SDL_Colour>();
+  d.step_size = r.Get<int32_t>();
+  d.angle_delta = r.Get<float>();
+  d.turtle_colour = r.Get<SDL_Colour>();
+  d.stroke.width = r.Get<float>();
+  const uint32_t n_colours = r.Get<uint32_t>();
+  for (uint32_t i = 0; i < n_colours and r.ok; ++i) {
+    d.stroke.palette.push_back(r.Get<SDL_Colour>());
+  }
+
+  d.ls.seed = r.GetString();
+  d.ls.ignore_list[0] = r.Get<uint64_t>();
+  d.ls.ignore_list[1] = r.Get<uint64_t>();
+  d.ls.rng_seed = r.Get<uint32_t>();
+  const uint32_t n_rules = r.Get<uint32_t>();
+  for (uint32_t i = 0; i < n_rules and r.ok; ++i) {
+    Rule rule;
+    rule.target = r.Get<char>();
+    rule.left_context = r.Get<char>();
+    rule.right_context = r.Get<char>();
+    rule.probability = r.Get<float>();
+    rule.replacement = r.GetString();
+    rule.left_string = r.GetString();
+    rule.right_string = r.GetString();
+    d.ls.rules.push_back(rule);
+  }
+  const uint32_t n_prules = r.Get<uint32_t>();
+  for (uint32_t i = 0; i < n_prules and r.ok; ++i) {
+    ParametricRule rule;
+    if (!ParseParametricRule(r.GetString(), &rule, error)) {
+      return false;
+    }
+    d.ls.parametric_rules.push_back(rule);
+  }
+
+  const uint32_t n_entries = r.Get<uint32_t>();
+  for (uint32_t i = 0; i < n_entries and r.ok; ++i) {
+    char c = r.Get<char>();
+    uint8_t ins = r.Get<uint8_t>();
+    d.tm[c] = ins < N_INSTRUCTIONS ? (TurtleInstruction)ins : INS_NONE;
+  }
+
+  // Symbols are restricted to 0-127 everywhere else
+  auto valid = [](char c) { return (unsigned char)c < 128; };
+  bool symbols_ok = std::all_of(d.ls.seed.begin(), d.ls.seed.end(), valid);
+  for (const Rule &rule : d.ls.rules) {
+    for (const std::string &s :
+         {rule.replacement, rule.left_string, rule.right_string}) {
+      symbols_ok &= std::all_of(s.begin(), s.end(), valid);
+    }
+    symbols_ok &= valid(rule.target) and valid(rule.left_context) and
+                  valid(rule.right_context);
+  }
+  for (const ParametricRule &rule : d.ls.parametric_rules) {
+    symbols_ok &= valid(rule.target) and
+                  std::all_of(rule.successor.begin(), rule.successor.end(),
+                              valid);
+  }
+  for (auto [c, ins] : d.tm) {
+    symbols_ok &= valid(c);
+  }
+  if (r.ok and !symbols_ok) {
+    *error = "Symbols must be in the range 0-127";
+    return false;
+  }
+  d.ls.Reset();
+
+  const uint32_t encoding = r.Get<uint32_t>();
+  if (r.ok and encoding != STAGE_NONE) {
+    const int32_t stage = r.Get<int32_t>();
+    const uint64_t length = r.Get<uint64_t>();
+    if (r.ok and (stage < 0 or stage > d.max_stage)) {
+      *error = "Stored stage " + std::to_string(stage) + " is out of range";
+      return false;
+    }
+
+    if (encoding == STAGE_RAW) {
+      r.Align(8);
+      std::string_view value = r.GetBytes(length);
+      if (r.ok and !std::all_of(value.begin(), value.end(), valid)) {
+        *error = "Symbols must be in the range 0-127";
+        return false;
+      }
+      if (r.ok) {
+        d.ls.Preload(stage, value, owner);
+      }
+    } else if (encoding == STAGE_PACKED) {
+      const int n_symbols = r.Get<uint8_t>();
+      std::string_view alphabet = r.GetBytes(n_symbols);
+      const int bits = r.Get<uint8_t>();
+      if (n_symbols == 0 or bits != Serialize::BitsFor(n_symbols)) {
+        r.ok = false;
+      }
+      // Every symbol of the stage is one of these
+      if (r.ok and !std::all_of(alphabet.begin(), alphabet.end(), valid)) {
+        *error = "Symbols must be in the range 0-127";
+        return false;
+      }
+      // A corrupt length could wrap length * bits round to something small
+      if (r.ok and length > (r.size - r.pos) * 8 / bits) {
+        r.ok = false;
+      }
+      const uint64_t n_words = r.ok ? (length * bits + 63) / 64 : 0;
+      std::string_view words = r.GetBytes(n_words * 8);
+
+      if (r.ok) {
+        auto value = std::make_shared<std::string>(length, '\0');
+        const uint64_t mask = (1ull << bits) - 1;
+        uint64_t bit = 0;
+        for (uint64_t i = 0; i < length; ++i, bit += bits) {
+          uint64_t lo, hi = 0;
+          memcpy(&lo, words.data() + bit / 64 * 8, 8);
+          if (bit % 64 + bits > 64) {
+            memcpy(&hi, words.data() + (bit / 64 + 1) * 8, 8);
+          }
+          uint64_t code = lo >> (bit % 64);
+          if (bit % 64) {
+            code |= hi << (64 - bit % 64);
+          }
+          code &= mask;
+          (*value)[i] =
+              code < (uint64_t)n_symbols ? alphabet[code] : alphabet[0];
+        }
+        d.ls.Preload(stage, *value, value);
+      }
+    } else {
+      *error = "Unknown stage encoding";
+      return false;
+    }
+  }
+
+  if (!r.ok) {
+    *error = "File is truncated";
+    return false;
+  }
+
+  UpdateTurtleMap(d.tm, d.ls);
+  demo = std::move(d);
+  return true;
+}
+
+// Maps the file into memory and loads it, any stage stored raw is used
+// directly from the mapping rather than copied. Without mmap the file is read
+// into memory instead, and the stage is used from there.
+bool LoadDemo(const char *path, Demo &demo, std::string *error) {
+#ifdef SERIALIZE_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    *error = std::string("Couldn't open ") + path;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 or st.st_size == 0) {
+    close(fd);
+    *error = std::string("Couldn't read ") + path;
+    return false;
+  }
+  const size_t size = st.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // The mapping stays valid
+  if (data == MAP_FAILED) {
+    *error = std::string("Couldn't map ") + path;
+    return false;
+  }
+
+  std::shared_ptr<const void> mapping(data,
+                                      [size](const void *p) {
+                                        munmap(const_cast<void *>(p), size);
+                                      });
+  return LoadDemo((const char *)data, size, mapping, demo, error);
+#else
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    *error = std::string("Couldn't open ") + path;
+    return false;
+  }
+  auto bytes = std::make_shared<std::string>();
+  char buffer[1 << 16];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    bytes->append(buffer, n);
+  }
+  const bool ok = !ferror(f);
+  fclose(f);
+  if (!ok or bytes->empty()) {
+    *error = std::string("Couldn't read ") + path;
+    return false;
+  }
+  return LoadDemo(bytes->data(), bytes->size(), bytes, demo, error);
+#endif
+}
+
+bool SaveDemo(Demo &demo, StageEncoding encoding, const char *path,
+              std::string *error) {
+  std::string bytes = SaveDemo(demo, encoding);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    *error = std::string("Couldn't open ") + path;
+    return false;
+  }
+  bool ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+  ok &= fclose(f) == 0;
+  if (!ok) {
+    *error = std::string("Couldn't write ") + path;
+  }
+  return ok;
+}
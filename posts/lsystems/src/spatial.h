@@ -0,0 +1,171 @@
+#pragma once
+
+#include "geometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+Uniform grid over the segments of a 2D drawing, so the turtle's query modules
+(see AnswerQueries in turtle.h) can find what's near them without looking at
+every segment.
+
+Cells are about as big as the average segment, and each segment is only added
+to the cells its line passes through (walked as in Amanatides & Woo, "A Fast
+Voxel Traversal Algorithm", 1987), so a long one costs cells in proportion to
+its length rather than its bounding box. The cells' contents are packed back
+to back (like m_rule_bodies in LSystem), found through a prefix sum of their
+counts, so building is two passes over the segments with no per cell
+allocations. Searches walk outwards a ring of cells at a time and stop once
+the ring is further away than the nearest segment found so far, so a query
+costs about the same however many segments there are.
+*/
+
+struct SegmentGrid {
+  const Mesh *lines = nullptr;
+  float min_x = 0, min_y = 0, cell = 1;
+  int columns = 0, rows = 0;
+
+  // The segments (index pairs of lines) in cell c are
+  // items[first[c] .. first[c + 1])
+  std::vector<uint32_t> first;
+  std::vector<uint32_t> items;
+
+  // Indexes the segments of m, which must outlive the grid
+  void Build(const Mesh &m) {
+    lines = &m;
+    const std::vector<Vec3> &v = m.vertices;
+    const std::vector<uint32_t> &idx = m.indices;
+    const size_t segments = idx.size() / 2;
+    columns = rows = 0;
+    first.assign(1, 0);
+    items.clear();
+    if (segments == 0) {
+      return;
+    }
+
+    float max_x = -INFINITY, max_y = -INFINITY;
+    min_x = min_y = INFINITY;
+    double total = 0;
+    for (size_t s = 0; s < segments; ++s) {
+      const Vec3 a = v[idx[2 * s]], b = v[idx[2 * s + 1]];
+      min_x = std::min({min_x, a.x, b.x});
+      min_y = std::min({min_y, a.y, b.y});
+      max_x = std::max({max_x, a.x, b.x});
+      max_y = std::max({max_y, a.y, b.y});
+      total += std::hypot(b.x - a.x, b.y - a.y);
+    }
+    // Cells are no smaller than the average segment, and a segment passes
+    // through at most its length / cell * sqrt(2) + 3 cells, so there are
+    // fewer than five per segment on average. The area term keeps sparse
+    // drawings from having mostly empty cells.
+    const float w = max_x - min_x, h = max_y - min_y;
+    cell = std::max({(float)(total / segments), 1e-6f,
+                     std::sqrt(w * h / (4.0f * segments))});
+    columns = (int)(w / cell) + 1;
+    rows = (int)(h / cell) + 1;
+
+    // Counting pass, then fill. Each segment steps from the cell of one end
+    // to the cell of the other, crossing whichever cell edge its line meets
+    // first, so the cells visited are a 4-connected path along it. The number
+    // of steps is fixed up front, so rounding can't make it overshoot.
+    first.assign((size_t)columns * rows + 1, 0);
+    auto cells = [&](size_t s, auto &&f) {
+      const Vec3 a = v[idx[2 * s]], b = v[idx[2 * s + 1]];
+      int x = Column(a.x), y = Row(a.y);
+      const int x_end = Column(b.x), y_end = Row(b.y);
+      const int step_x = x_end > x ? 1 : -1, step_y = y_end > y ? 1 : -1;
+      const float dx = std::abs(b.x - a.x), dy = std::abs(b.y - a.y);
+      // How far along the segment, from 0 to 1, the next edge in each
+      // direction is, and how far apart the edges are
+      const float edge_x = min_x + (x + (step_x > 0)) * cell;
+      const float edge_y = min_y + (y + (step_y > 0)) * cell;
+      float t_x = dx > 0 ? std::abs(edge_x - a.x) / dx : INFINITY;
+      float t_y = dy > 0 ? std::abs(edge_y - a.y) / dy : INFINITY;
+      const float dt_x = dx > 0 ? cell / dx : INFINITY;
+      const float dt_y = dy > 0 ? cell / dy : INFINITY;
+      f((size_t)y * columns + x);
+      for (int n = std::abs(x_end - x) + std::abs(y_end - y); n > 0; --n) {
+        if (y == y_end or (x != x_end and t_x < t_y)) {
+          x += step_x;
+          t_x += dt_x;
+        } else {
+          y += step_y;
+          t_y += dt_y;
+        }
+        f((size_t)y * columns + x);
+      }
+    };
+    for (size_t s = 0; s < segments; ++s) {
+      cells(s, [&](size_t c) { ++first[c + 1]; });
+    }
+    for (size_t c = 0; c < (size_t)columns * rows; ++c) {
+      first[c + 1] += first[c];
+    }
+    items.resize(first.back());
+    std::vector<uint32_t> next(first.begin(), first.end() - 1);
+    for (size_t s = 0; s < segments; ++s) {
+      cells(s, [&](size_t c) { items[next[c]++] = s; });
+    }
+  }
+
+  int Column(float x) const {
+    return std::clamp((int)((x - min_x) / cell), 0, columns - 1);
+  }
+  int Row(float y) const {
+    return std::clamp((int)((y - min_y) / cell), 0, rows - 1);
+  }
+
+  // Distance from p to the nearest segment that doesn't have the vertex skip
+  // as an end, or limit if they're all further away than that
+  float Nearest(Vec3 p, uint32_t skip, float limit) const {
+    if (columns == 0) {
+      return limit;
+    }
+    const std::vector<Vec3> &v = lines->vertices;
+    const std::vector<uint32_t> &idx = lines->indices;
+    float best = limit;
+    const int cx = Column(p.x), cy = Row(p.y);
+    const int most = std::max({cx, cy, columns - 1 - cx, rows - 1 - cy});
+
+    auto search = [&](int x, int y) {
+      if (x < 0 or y < 0 or x >= columns or y >= rows) {
+        return;
+      }
+      const size_t c = (size_t)y * columns + x;
+      for (uint32_t i = first[c]; i < first[c + 1]; ++i) {
+        const uint32_t a = idx[2 * items[i]], b = idx[2 * items[i] + 1];
+        if (a != skip and b != skip) {
+          best = std::min(best, Distance(p, v[a], v[b]));
+        }
+      }
+    };
+    // Everything in ring r is at least (r - 1) cells away
+    search(cx, cy);
+    for (int r = 1; r <= most and (r - 1) * cell < best; ++r) {
+      for (int x = cx - r; x <= cx + r; ++x) {
+        search(x, cy - r);
+        search(x, cy + r);
+      }
+      for (int y = cy - r + 1; y < cy + r; ++y) {
+        search(cx - r, y);
+        search(cx + r, y);
+      }
+    }
+    return best;
+  }
+
+  // From p to the segment ab
+  static float Distance(Vec3 p, Vec3 a, Vec3 b) {
+    const float dx = b.x - a.x, dy = b.y - a.y;
+    const float length2 = dx * dx + dy * dy;
+    float t = 0;
+    if (length2 > 0) {
+      t = std::clamp(((p.x - a.x) * dx + (p.y - a.y) * dy) / length2, 0.0f,
+                     1.0f);
+    }
+    return std::hypot(p.x - (a.x + t * dx), p.y - (a.y + t * dy));
+  }
+};
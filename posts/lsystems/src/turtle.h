@@ -1,10 +1,17 @@
 #pragma once
 
+#include "geometry.h"
 #include "lsystem.h"
+#include "spatial.h"
 
 #include "SDL.h"
 
+#include <algorithm>
+#include <cmath>
 #include <map>
+#include <string>
+#include <string_view>
+#include <vector>
 
 /*
  * test
@@ -20,7 +27,15 @@
   X(TURN_RIGHT)                                                                \
   X(PUSH_POSITION)                                                             \
   X(POP_POSITION)                                                              \
-  X(DRAW_SQUARE)
+  X(DRAW_SQUARE)                                                               \
+  X(PITCH_DOWN)                                                                \
+  X(PITCH_UP)                                                                  \
+  X(ROLL_LEFT)                                                                 \
+  X(ROLL_RIGHT)                                                                \
+  X(TURN_AROUND)                                                               \
+  X(QUERY)                                                                     \
+  X(NARROW)                                                                    \
+  X(NEXT_COLOUR)                                                               \
 
 enum TurtleInstruction {
   // populated by X-Macro defined above
@@ -35,7 +50,7 @@ const char *instuction_labels[N_INSTRUCTIONS] = {
 
 // Add any new symbols from the LSystem to the map
 void UpdateTurtleMap(TurtleMap &tm, const LSystem &ls) {
-  for (Rule r : ls.rules) {
+  for (const Rule &r : ls.rules) {
     const char t = r.target;
     if (t != '\0' and tm.count(t) == 0) {
       tm[t] = INS_NONE;
@@ -46,7 +61,15 @@ void UpdateTurtleMap(TurtleMap &tm, const LSystem &ls) {
       }
     }
   }
-  for (char c : ls.seed) {
+  for (const ParametricRule &r : ls.parametric_rules) {
+    for (char c : r.successor + r.target) {
+      if (c != '\0' and tm.count(c) == 0) {
+        tm[c] = INS_NONE;
+      }
+    }
+  }
+  // Parametric seeds contain their parameters, so use the symbols instead
+  for (char c : ls.IsParametric() ? ls.Value() : ls.seed) {
     if (c != '\0' and tm.count(c) == 0) {
       tm[c] = INS_NONE;
     }
@@ -65,61 +88,501 @@ void CleanTurtleMap(TurtleMap &tm, const LSystem &ls) {
   }
 }
 
-// For each symbol in the provided string, the turtle checks if there is an
-// associated instruction in TurtleMap and if so, does it.
-void Draw(SDL_Renderer *r, const std::string &instructions, const TurtleMap &tm,
-          SDL_FPoint origin, float step, float da) {
+// How many lines the turtle will draw for a system with the given stats
+double CountSegments(const StageStats &stats, const TurtleMap &tm) {
+  double segments = 0;
+  for (auto [c, ins] : tm) {
+    if (ins == INS_MOVE_FORWARD and (unsigned char)c < 128) {
+      segments += stats.counts[(unsigned char)c];
+    }
+  }
+  return segments;
+}
+
+// Flat lookup from symbol to instruction, so the turtle doesn't search the
+// map for every symbol
+struct InstructionTable {
+  TurtleInstruction ins[128];
+
+  InstructionTable(const TurtleMap &tm) {
+    std::fill(ins, ins + 128, INS_NONE);
+    for (auto [c, i] : tm) {
+      if ((unsigned char)c < 128) {
+        ins[(unsigned char)c] = i;
+      }
+    }
+  }
+  TurtleInstruction operator[](char c) const {
+    return (unsigned char)c < 128 ? ins[(unsigned char)c] : INS_NONE;
+  }
+};
+
+// Turtle states saved by INS_PUSH_POSITION. Each member has its own array,
+// which keeps them friendly to vectorised or parallel turtles. joint is the
+// vertex the turtle was at, so branches start from a shared vertex.
+struct TurtleStack {
+  std::vector<float> x, y, a, width;
+  std::vector<uint32_t> joint;
+  std::vector<uint8_t> colour;
+  int top = 0;
+
+  // Never shrinks, so repeated draws reuse the same allocation
+  void Reserve(int n) {
+    if ((int)x.size() < n) {
+      x.resize(n);
+      y.resize(n);
+      a.resize(n);
+      width.resize(n);
+      joint.resize(n);
+      colour.resize(n);
+    }
+    top = 0;
+  }
+};
+
+// Where the turtle was at a query module: the symbol's index, and the vertex
+// the turtle was at, see AnswerQueries
+struct TurtleQuery {
+  size_t symbol;
+  uint32_t vertex;
+};
+
+// Everything the 2D turtle drew, in steps with y up, so it can be simplified
+// and drawn at any position and scale. z is always 0.
+// Each segment's width and colour index are only kept when the turtle map
+// uses INS_NARROW or INS_NEXT_COLOUR, otherwise they're empty.
+struct Drawing {
+  Mesh lines;
+  std::vector<Vec3> squares;
+  std::vector<TurtleQuery> queries;
+  std::vector<float> widths;
+  std::vector<uint8_t> colours;
+};
+
+// Merges and deduplicates the segments (see geometry.h), unless they have
+// their own widths and colours, which merging would lose
+void Simplify(Drawing &d) {
+  if (d.widths.empty()) {
+    Simplify(d.lines);
+  }
+}
+
+// Whether the turtle map changes the turtle's width or colour, so drawings
+// need them per segment
+bool IsStyled(const TurtleMap &tm) {
+  return std::any_of(tm.begin(), tm.end(), [](const auto &e) {
+    return e.second == INS_NARROW or e.second == INS_NEXT_COLOUR;
+  });
+}
+
+// How INS_NARROW and INS_NEXT_COLOUR at symbol i change the turtle's width
+// and colour index. Anything else leaves them as they are.
+void ApplyStyle(TurtleInstruction ins, const ParamBuffer *params, size_t i,
+                float &width, uint8_t &colour) {
+  const float NARROW_FACTOR = 0.7f;
+  const bool param = params and params->Count(i);
+  if (ins == INS_NARROW) {
+    width = param ? std::max(0.0f, params->Get(i)[0]) : width * NARROW_FACTOR;
+  } else if (ins == INS_NEXT_COLOUR) {
+    colour = param ? (uint8_t)std::clamp(params->Get(i)[0], 0.0f, 255.0f)
+                   : colour + 1;
+  }
+}
+
+// For each symbol, the turtle checks if there is an associated instruction in
+// TurtleMap and if so, does it. The symbols come from for_each, which passes
+// them to its callback as string pieces in order, and is called twice.
+// For parametric systems, the first parameter of a symbol scales its step
+// length, or sets its turn angle in degrees (as in ABoP).
+// The turtle starts with width 1 and colour index 0. As in ABoP, '!' and '\''
+// (usually) narrow the width and move to the next colour, or with a parameter
+// set them.
+// Returns false with nothing drawn if the turtle stack would be too large.
+template <typename ForEach>
+bool InterpretPieces(ForEach &&for_each, const TurtleMap &tm, float da,
+                     Drawing &out, const ParamBuffer *params,
+                     std::string *error) {
 
   // This number was not chosen for any reason, but generating
   // arbitrarily large vectors based on a user typo would be a bad idea...
-  const int MAX_STACK_SIZE = 1 << 16;
+  const int MAX_STACK_SIZE = 1 << 20;
 
   const float TWO_PI = 6.283185307;
 
-  struct State {
-    float x, y, a;
-  } state = {origin.x, origin.y, 0.75f};
-
-  std::vector<State> stack;
+  const InstructionTable table(tm);
+  const bool styled = IsStyled(tm);
 
-  for (char c : instructions) {
-    auto it = tm.find(c);
-    if (it == tm.end()) {
-      continue;
-    }
-    TurtleInstruction ti = it->second;
-    switch (ti) {
-    case INS_MOVE_FORWARD: {
-      SDL_FPoint dp = {-step * cosf(TWO_PI * state.a),
-                       step * sinf(TWO_PI * state.a)};
-      SDL_RenderDrawLineF(r, state.x, state.y, state.x + dp.x, state.y + dp.y);
-      state.x += dp.x;
-      state.y += dp.y;
-    } break;
-    case INS_TURN_LEFT: {
-      state.a += da;
-    } break;
-    case INS_TURN_RIGHT: {
-      state.a -= da;
-    } break;
-    case INS_PUSH_POSITION: {
-      if (stack.size() < MAX_STACK_SIZE) {
-        stack.push_back(state);
+  // Counting pass, so the stack and drawing can be sized exactly and pushes
+  // can never overflow
+  size_t segments = 0, squares = 0;
+  int depth = 0, max_depth = 0;
+  for_each([&](std::string_view piece) {
+    for (char c : piece) {
+      TurtleInstruction ti = table[c];
+      if (ti == INS_MOVE_FORWARD) {
+        ++segments;
+      } else if (ti == INS_DRAW_SQUARE) {
+        ++squares;
+      } else if (ti == INS_PUSH_POSITION) {
+        max_depth = std::max(max_depth, ++depth);
+      } else if (ti == INS_POP_POSITION and depth > 0) {
+        --depth;
       }
-    } break;
-    case INS_POP_POSITION: {
-      if (!stack.empty()) {
-        state = stack.back();
-        stack.pop_back();
+    }
+  });
+  out.lines.triangles = false;
+  out.lines.vertices.clear();
+  out.lines.indices.clear();
+  out.squares.clear();
+  out.queries.clear();
+  out.widths.clear();
+  out.colours.clear();
+  if (max_depth > MAX_STACK_SIZE or segments >= UINT32_MAX) {
+    if (error) {
+      *error = max_depth > MAX_STACK_SIZE
+                   ? "Turtle stack would need " + std::to_string(max_depth) +
+                         " entries, the limit is " +
+                         std::to_string(MAX_STACK_SIZE)
+                   : "Too many segments to index";
+    }
+    return false;
+  }
+  // One per thread, so several systems can be interpreted at once
+  thread_local TurtleStack stack;
+  stack.Reserve(max_depth);
+  out.lines.vertices.resize(segments + 1);
+  out.lines.indices.resize(2 * segments);
+  out.squares.resize(squares);
+  if (styled) {
+    out.widths.resize(segments);
+    out.colours.resize(segments);
+  }
+  Vec3 *vertex = out.lines.vertices.data();
+  uint32_t *index = out.lines.indices.data();
+  Vec3 *square = out.squares.data();
+
+  float x = 0, y = 0, a = 0.75f, width = 1;
+  uint8_t colour = 0;
+  uint32_t n = 0, current = 0;
+  vertex[n++] = {x, y, 0};
+
+  size_t i = 0;
+  for_each([&](std::string_view piece) {
+    for (char c : piece) {
+      TurtleInstruction ti = table[c];
+      switch (ti) {
+      case INS_MOVE_FORWARD: {
+        const float length =
+            (params and params->Count(i)) ? params->Get(i)[0] : 1.0f;
+        x -= length * cosf(TWO_PI * a);
+        y -= length * sinf(TWO_PI * a);
+        vertex[n] = {x, y, 0};
+        if (styled) {
+          out.widths[n - 1] = width;
+          out.colours[n - 1] = colour;
+        }
+        *index++ = current;
+        *index++ = current = n++;
+      } break;
+      case INS_TURN_LEFT: {
+        a += (params and params->Count(i)) ? params->Get(i)[0] / 360.0f : da;
+      } break;
+      case INS_TURN_RIGHT: {
+        a -= (params and params->Count(i)) ? params->Get(i)[0] / 360.0f : da;
+      } break;
+      case INS_PUSH_POSITION: {
+        stack.x[stack.top] = x;
+        stack.y[stack.top] = y;
+        stack.a[stack.top] = a;
+        stack.width[stack.top] = width;
+        stack.joint[stack.top] = current;
+        stack.colour[stack.top] = colour;
+        ++stack.top;
+      } break;
+      case INS_POP_POSITION: {
+        if (stack.top > 0) {
+          --stack.top;
+          x = stack.x[stack.top];
+          y = stack.y[stack.top];
+          a = stack.a[stack.top];
+          width = stack.width[stack.top];
+          current = stack.joint[stack.top];
+          colour = stack.colour[stack.top];
+        }
+      } break;
+      case INS_DRAW_SQUARE: {
+        *square++ = {x, y, 0};
+      } break;
+      case INS_TURN_AROUND: {
+        a += 0.5f;
+      } break;
+      case INS_NARROW:
+      case INS_NEXT_COLOUR: {
+        ApplyStyle(ti, params, i, width, colour);
+      } break;
+      // Only modules with a parameter to answer in count
+      case INS_QUERY: {
+        if (params and params->Count(i)) {
+          out.queries.push_back({i, current});
+        }
+      } break;
+      // Pitch and roll only mean something to the 3D turtle, see turtle3d.h
+      case INS_PITCH_DOWN:
+      case INS_PITCH_UP:
+      case INS_ROLL_LEFT:
+      case INS_ROLL_RIGHT:
+      case N_INSTRUCTIONS: // Not an instruction, only their count
+      case INS_NONE: {
+      } break;
       }
-    } break;
-    case INS_DRAW_SQUARE: {
-      const float sq_w = 0.25f * step;
-      SDL_FRect _r{state.x - sq_w / 2, state.y - sq_w / 2, sq_w, sq_w};
+      ++i;
+    }
+  });
+  return true;
+}
+
+// Interprets an already generated string
+bool Interpret2D(std::string_view instructions, const TurtleMap &tm, float da,
+                 Drawing &out, const ParamBuffer *params = nullptr,
+                 std::string *error = nullptr) {
+  return InterpretPieces([&](auto &&piece) { piece(instructions); }, tm, da,
+                         out, params, error);
+}
+
+// Open L-systems, after Mech & Prusinkiewicz, "Visual models of plants
+// interacting with their environment" (1996): parametric systems with symbols
+// mapped to INS_QUERY. Their rules can react to the plant's surroundings, such
+// as stopping a branch before it runs into another.
+bool IsOpen(const LSystem &ls, const TurtleMap &tm) {
+  if (!ls.IsParametric()) {
+    return false;
+  }
+  for (auto [c, ins] : tm) {
+    if (ins == INS_QUERY and ls.CharUsed(c)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Draws the current value of ls, then sets the first parameter r of each query
+// module to the distance from the turtle to the nearest segment not attached
+// where it is, if any is closer than r. Segments are found through a
+// SegmentGrid (see spatial.h), so this costs about as much as drawing does.
+bool AnswerQueries(LSystem &ls, const TurtleMap &tm, float da,
+                   std::string *error = nullptr) {
+  // One per thread, so several systems can be answered at once
+  thread_local Drawing drawing;
+  thread_local SegmentGrid grid;
+  if (!Interpret2D(ls.Value(), tm, da, drawing, ls.Params(), error)) {
+    return false;
+  }
+  grid.Build(drawing.lines);
+  for (const TurtleQuery &q : drawing.queries) {
+    float &r = ls.m_params.values[ls.m_params.start[q.symbol]];
+    r = grid.Nearest(drawing.lines.vertices[q.vertex], q.vertex, r);
+  }
+  ls.m_answered = ls.m_stage;
+  return true;
+}
+
+// Generates the system at stage for the 2D turtle. Open systems alternate
+// stepping with drawing, so each stage's queries are answered before it's
+// stepped (and the last stage's too). Others just Generate. Either way,
+// leaves ls.m_stage below stage on failure.
+std::string_view Generate2D(LSystem &ls, int stage, const TurtleMap &tm,
+                            float da, std::string *error = nullptr) {
+  if (!IsOpen(ls, tm)) {
+    return ls.Generate(stage, error);
+  }
+  if (ls.m_stage > stage) {
+    ls.Reset();
+  }
+  while (true) {
+    if (ls.m_answered != ls.m_stage and !AnswerQueries(ls, tm, da, error)) {
+      return ls.m_stage == stage ? ls.Value() : std::string_view();
+    }
+    if (ls.m_stage == stage) {
+      return ls.Value();
+    }
+    const int before = ls.m_stage;
+    ls.Generate(before + 1, error);
+    if (ls.m_stage == before) {
+      return {}; // Over the memory budget
+    }
+  }
+}
+
+// Interprets the system at the provided stage. Unless that stage has already
+// been generated, seekable systems are interpreted straight from their rules
+// (see LSystem::Expand) rather than generating it. Others are generated.
+bool Interpret2D(LSystem &ls, int stage, const TurtleMap &tm, float da,
+                 Drawing &out, std::string *error = nullptr) {
+  if (ls.m_stage == stage or !ls.CanSeek()) {
+    const std::string_view value = Generate2D(ls, stage, tm, da, error);
+    if (ls.m_stage != stage) {
+      out = {};
+      return false;
+    }
+    return Interpret2D(value, tm, da, out, ls.Params(), error);
+  }
+  return InterpretPieces([&](auto &&piece) { ls.Expand(stage, piece); }, tm,
+                         da, out, nullptr, error);
+}
+
+// How Render draws the turtle's widths and colour indexes
+struct StrokeStyle {
+  float width = 0; // Steps per unit of turtle width, or 1 pixel lines if 0
+  std::vector<SDL_Colour> palette; // Wraps around, the draw colour if empty
+};
+
+bool operator==(const StrokeStyle &a, const StrokeStyle &b) {
+  return a.width == b.width and
+         std::equal(a.palette.begin(), a.palette.end(), b.palette.begin(),
+                    b.palette.end(), [](SDL_Colour x, SDL_Colour y) {
+                      return x.r == y.r and x.g == y.g and x.b == y.b;
+                    });
+}
+bool operator!=(const StrokeStyle &a, const StrokeStyle &b) {
+  return !(a == b);
+}
+
+// Draws with the turtle's start at origin and each step scaled to step pixels,
+// in the draw colour. Styled drawings are submitted as quads in a single
+// SDL_RenderGeometry call, each stroke as wide as its turtle width (at least
+// a pixel) and in its colour from the palette.
+void Render(SDL_Renderer *r, const Drawing &d, SDL_FPoint origin, float step,
+            const StrokeStyle &style = {}) {
+  const std::vector<Vec3> &v = d.lines.vertices;
+  const std::vector<uint32_t> &idx = d.lines.indices;
+  const float sq_w = 0.25f * step;
+  const bool coloured = !d.colours.empty() and !style.palette.empty();
+  if (style.width <= 0 and !coloured) {
+    for (size_t i = 0; i + 1 < idx.size(); i += 2) {
+      const Vec3 a = v[idx[i]], b = v[idx[i + 1]];
+      SDL_RenderDrawLineF(r, origin.x + step * a.x, origin.y - step * a.y,
+                          origin.x + step * b.x, origin.y - step * b.y);
+    }
+    for (const Vec3 &p : d.squares) {
+      SDL_FRect _r{origin.x + step * p.x - sq_w / 2,
+                   origin.y - step * p.y - sq_w / 2, sq_w, sq_w};
       SDL_RenderFillRectF(r, &_r);
-    } break;
-    case INS_NONE: {
-    } break;
     }
+    return;
+  }
+
+  SDL_Colour ink;
+  SDL_GetRenderDrawColor(r, &ink.r, &ink.g, &ink.b, &ink.a);
+  // One per thread, like the turtle's stack
+  thread_local std::vector<SDL_Vertex> vertices;
+  thread_local std::vector<int> indices;
+  vertices.clear();
+  indices.clear();
+  auto quad = [&](std::initializer_list<SDL_FPoint> corners, SDL_Colour c) {
+    const int first = vertices.size();
+    for (SDL_FPoint p : corners) {
+      vertices.push_back({p, c, {0, 0}});
+    }
+    for (int k : {0, 1, 2, 0, 2, 3}) {
+      indices.push_back(first + k);
+    }
+  };
+
+  for (size_t i = 0; i + 1 < idx.size(); i += 2) {
+    const Vec3 a = v[idx[i]], b = v[idx[i + 1]];
+    const float ax = origin.x + step * a.x, ay = origin.y - step * a.y;
+    const float bx = origin.x + step * b.x, by = origin.y - step * b.y;
+    const float length = std::hypot(bx - ax, by - ay);
+    if (length == 0) {
+      continue;
+    }
+    const float w = d.widths.empty() ? 1.0f : d.widths[i / 2];
+    const float half = std::max(0.5f, 0.5f * w * style.width * step);
+    // Along and across the stroke, half its width long. The ends overhang by
+    // that much too, so bends don't leave gaps.
+    const float ux = (bx - ax) / length * half, uy = (by - ay) / length * half;
+    SDL_Colour c = ink;
+    if (coloured) {
+      c = style.palette[d.colours[i / 2] % style.palette.size()];
+      c.a = ink.a;
+    }
+    quad({{ax - ux - uy, ay - uy + ux},
+          {bx + ux - uy, by + uy + ux},
+          {bx + ux + uy, by + uy - ux},
+          {ax - ux + uy, ay - uy - ux}},
+         c);
+  }
+  for (const Vec3 &p : d.squares) {
+    const float x = origin.x + step * p.x, y = origin.y - step * p.y;
+    const float h = sq_w / 2;
+    quad({{x - h, y - h}, {x + h, y - h}, {x + h, y + h}, {x - h, y + h}},
+         ink);
+  }
+  SDL_RenderGeometry(r, nullptr, vertices.data(), vertices.size(),
+                     indices.data(), indices.size());
+}
+
+// Extent of one or more drawings, in steps
+struct Bounds {
+  float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY,
+        max_y = -INFINITY;
+
+  bool Empty() const { return min_x > max_x; }
+  void Extend(const Vec3 &p) {
+    min_x = std::min(min_x, p.x);
+    min_y = std::min(min_y, p.y);
+    max_x = std::max(max_x, p.x);
+    max_y = std::max(max_y, p.y);
+  }
+  void Extend(const Drawing &d) {
+    for (const Vec3 &p : d.lines.vertices) {
+      Extend(p);
+    }
+    for (const Vec3 &p : d.squares) {
+      Extend(p);
+    }
+  }
+};
+
+// The origin and step that centre b in a width x height target, scaled to fit
+// with a small margin
+void Fit(const Bounds &b, int width, int height, SDL_FPoint *origin,
+         float *step) {
+  const float margin = 0.05f * std::min(width, height);
+  const float w = std::max(b.max_x - b.min_x, 1e-6f);
+  const float h = std::max(b.max_y - b.min_y, 1e-6f);
+  *step = std::min((width - 2 * margin) / w, (height - 2 * margin) / h);
+  *origin = {width / 2.0f - *step * (b.min_x + b.max_x) / 2,
+             height / 2.0f + *step * (b.min_y + b.max_y) / 2};
+}
+
+// Draws centred in a width x height target, scaled to fit with a small margin
+void RenderFitted(SDL_Renderer *r, const Drawing &d, int width, int height,
+                  const StrokeStyle &style = {}) {
+  Bounds b;
+  b.Extend(d);
+  if (b.Empty()) {
+    return;
+  }
+  SDL_FPoint origin;
+  float step;
+  Fit(b, width, height, &origin, &step);
+  Render(r, d, origin, step, style);
+}
+
+// Interprets and renders in one go, optionally simplifying the geometry in
+// between (see geometry.h)
+bool Draw(SDL_Renderer *r, std::string_view instructions, const TurtleMap &tm,
+          SDL_FPoint origin, float step, float da,
+          const ParamBuffer *params = nullptr, std::string *error = nullptr,
+          bool simplify = false) {
+  thread_local Drawing drawing;
+  if (!Interpret2D(instructions, tm, da, drawing, params, error)) {
+    return false;
+  }
+  if (simplify) {
+    Simplify(drawing);
   }
+  Render(r, drawing, origin, step);
+  return true;
 }
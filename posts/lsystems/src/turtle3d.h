@@ -0,0 +1,337 @@
+#pragma once
+
+#include "geometry.h"
+#include "lsystem.h"
+#include "turtle.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+3D interpretation of the turtle, following ABoP 1.5. The turtle carries a
+frame of three unit vectors: its heading H, left L and up U.
+
+  + -   turn left/right, rotating H and L about U
+  & ^   pitch down/up, rotating H and U about L
+  \ /   roll left/right, rotating L and U about H
+  |     turn around
+
+The symbols are whatever the TurtleMap says, the above are the usual ones.
+Segments go into a single indexed Mesh, either as lines or as generalized
+cylinders (tubes with a ring of vertices at each joint). The mesh is sized by
+a first pass over the string, so the main loop never allocates.
+
+Coordinates are y up, and the turtle starts heading along +y with L = -x,
+which matches the 2D turtle when looking down the z axis.
+*/
+
+// Rotates the pair of frame vectors (a, b) by angle turns, moving a towards b
+inline void Rotate(Vec3 &a, Vec3 &b, float angle) {
+  const float TWO_PI = 6.283185307;
+  const float c = cosf(TWO_PI * angle), s = sinf(TWO_PI * angle);
+  const Vec3 a2 = c * a + s * b;
+  b = c * b + -s * a;
+  a = a2;
+}
+
+struct Turtle3DOptions {
+  float step = 1;   // Length of a step in mesh units
+  float da = 0.071; // Turn per instruction, as a fraction of a full turn
+  int sides = 0;    // Sides of each tube, or 0 to output lines
+  float radius = 0.1f;
+};
+
+// 3D turtle states saved by INS_PUSH_POSITION, one array per member like
+// TurtleStack. Each state also remembers the vertex (or first vertex of the
+// ring) it was at, so branches share their starting joint.
+struct TurtleStack3D {
+  std::vector<Vec3> p, h, l, u;
+  std::vector<uint32_t> joint;
+  int top = 0;
+
+  void Reserve(int n) {
+    if ((int)p.size() < n) {
+      p.resize(n);
+      h.resize(n);
+      l.resize(n);
+      u.resize(n);
+      joint.resize(n);
+    }
+    top = 0;
+  }
+};
+
+// Interprets the string as a 3D turtle, replacing the contents of mesh.
+// Parameters mean the same as in InterpretPieces: the first one is a move's
+// length in steps, or a turn in degrees. Returns false with an error if the
+// mesh or stack would be too large to index.
+bool Interpret3D(std::string_view instructions, const TurtleMap &tm,
+                 const Turtle3DOptions &opt, Mesh &mesh,
+                 const ParamBuffer *params = nullptr,
+                 std::string *error = nullptr) {
+  // Same limit as Draw
+  const int MAX_STACK_SIZE = 1 << 20;
+
+  const InstructionTable table(tm);
+
+  // Counting pass, so every buffer can be sized exactly
+  uint64_t segments = 0;
+  int depth = 0, max_depth = 0;
+  for (char c : instructions) {
+    TurtleInstruction ti = table[c];
+    if (ti == INS_MOVE_FORWARD) {
+      ++segments;
+    } else if (ti == INS_PUSH_POSITION) {
+      max_depth = std::max(max_depth, ++depth);
+    } else if (ti == INS_POP_POSITION and depth > 0) {
+      --depth;
+    }
+  }
+
+  const bool tubes = opt.sides >= 3;
+  const int ring = tubes ? opt.sides : 1;
+  const uint64_t n_vertices = (segments + 1) * ring;
+  const uint64_t n_indices = (tubes ? 6 * ring : 2) * segments;
+  if (max_depth > MAX_STACK_SIZE) {
+    if (error) {
+      *error = "Turtle stack would need " + std::to_string(max_depth) +
+               " entries, the limit is " + std::to_string(MAX_STACK_SIZE);
+    }
+    return false;
+  }
+  // The index count too, so resize can't wrap where size_t is 32 bit (WASM)
+  if (n_vertices > UINT32_MAX or n_indices > UINT32_MAX) {
+    if (error) {
+      *error = "Mesh would need " + std::to_string(n_vertices) +
+               " vertices and " + std::to_string(n_indices) +
+               " indices, more than 32 bits can count";
+    }
+    return false;
+  }
+
+  // One per thread, so several systems can be interpreted at once
+  thread_local TurtleStack3D stack;
+  stack.Reserve(max_depth);
+  mesh.triangles = tubes;
+  mesh.vertices.resize(n_vertices);
+  mesh.indices.resize(n_indices);
+  Vec3 *vertex = mesh.vertices.data();
+  uint32_t *index = mesh.indices.data();
+
+  // Ring offsets are the same for every joint apart from the frame
+  std::vector<float> ring_cos(ring), ring_sin(ring);
+  for (int k = 0; k < ring; ++k) {
+    ring_cos[k] = opt.radius * cosf(6.283185307f * k / ring);
+    ring_sin[k] = opt.radius * sinf(6.283185307f * k / ring);
+  }
+
+  Vec3 p = {0, 0, 0}, h = {0, 1, 0}, l = {-1, 0, 0}, u = {0, 0, 1};
+  uint32_t n = 0;
+
+  // Adds a joint at p, returning the index of its first vertex
+  auto joint = [&]() {
+    const uint32_t first = n;
+    if (tubes) {
+      for (int k = 0; k < ring; ++k) {
+        vertex[n++] = p + ring_cos[k] * l + ring_sin[k] * u;
+      }
+    } else {
+      vertex[n++] = p;
+    }
+    return first;
+  };
+  uint32_t current = joint();
+
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    TurtleInstruction ti = table[instructions[i]];
+    const bool has_param = params and params->Count(i);
+    const float angle = has_param ? params->Get(i)[0] / 360.0f : opt.da;
+    switch (ti) {
+    case INS_MOVE_FORWARD: {
+      const float length = has_param ? params->Get(i)[0] : 1.0f;
+      p = p + opt.step * length * h;
+      const uint32_t next = joint();
+      if (tubes) {
+        for (int k = 0; k < ring; ++k) {
+          const int k1 = (k + 1) % ring;
+          const uint32_t a = current + k, b = current + k1;
+          const uint32_t c = next + k, d = next + k1;
+          *index++ = a, *index++ = b, *index++ = d;
+          *index++ = a, *index++ = d, *index++ = c;
+        }
+      } else {
+        *index++ = current;
+        *index++ = next;
+      }
+      current = next;
+    } break;
+    case INS_TURN_LEFT: {
+      Rotate(h, l, angle);
+    } break;
+    case INS_TURN_RIGHT: {
+      Rotate(h, l, -angle);
+    } break;
+    case INS_PITCH_DOWN: {
+      Rotate(h, u, -angle);
+    } break;
+    case INS_PITCH_UP: {
+      Rotate(h, u, angle);
+    } break;
+    case INS_ROLL_LEFT: {
+      Rotate(l, u, -angle);
+    } break;
+    case INS_ROLL_RIGHT: {
+      Rotate(l, u, angle);
+    } break;
+    case INS_TURN_AROUND: {
+      h = -h;
+      l = -l;
+    } break;
+    case INS_PUSH_POSITION: {
+      stack.p[stack.top] = p;
+      stack.h[stack.top] = h;
+      stack.l[stack.top] = l;
+      stack.u[stack.top] = u;
+      stack.joint[stack.top] = current;
+      ++stack.top;
+    } break;
+    case INS_POP_POSITION: {
+      if (stack.top > 0) {
+        --stack.top;
+        p = stack.p[stack.top];
+        h = stack.h[stack.top];
+        l = stack.l[stack.top];
+        u = stack.u[stack.top];
+        current = stack.joint[stack.top];
+      }
+    } break;
+    // Widths and colours are only drawn in 2D, see Render
+    case INS_DRAW_SQUARE:
+    case INS_QUERY:
+    case INS_NARROW:
+    case INS_NEXT_COLOUR:
+    case N_INSTRUCTIONS: // Not an instruction, only their count
+    case INS_NONE: {
+    } break;
+    }
+  }
+  return true;
+}
+
+// Collects small writes into large fwrite calls
+struct FileWriter {
+  FILE *f;
+  std::vector<char> buffer = std::vector<char>(1 << 16);
+  size_t used = 0;
+  bool ok = true;
+
+  FileWriter(FILE *f) : f(f) {}
+
+  void Flush() {
+    ok = ok and fwrite(buffer.data(), 1, used, f) == used;
+    used = 0;
+  }
+  // Each formatted write must fit in 128 bytes
+  template <typename... Args> void Printf(const char *format, Args... args) {
+    if (used + 128 > buffer.size()) {
+      Flush();
+    }
+    used += snprintf(&buffer[used], buffer.size() - used, format, args...);
+  }
+  void Write(const void *data, size_t size) {
+    if (used + size > buffer.size()) {
+      Flush();
+    }
+    if (size > buffer.size()) {
+      ok = ok and fwrite(data, 1, size, f) == size;
+      return;
+    }
+    memcpy(&buffer[used], data, size);
+    used += size;
+  }
+};
+
+namespace MeshFile {
+
+FILE *Open(const char *path, std::string *error) {
+  FILE *f = fopen(path, "wb");
+  if (!f and error) {
+    *error = std::string("Couldn't open ") + path + " for writing";
+  }
+  return f;
+}
+
+bool Close(FileWriter &w, const char *path, std::string *error) {
+  w.Flush();
+  const bool ok = (fclose(w.f) == 0) and w.ok;
+  if (!ok and error) {
+    *error = std::string("Couldn't write ") + path;
+  }
+  return ok;
+}
+
+} // namespace MeshFile
+
+// Wavefront OBJ, with 'l' elements for line meshes and 'f' for tubes
+bool WriteOBJ(const Mesh &mesh, const char *path, std::string *error) {
+  FILE *f = MeshFile::Open(path, error);
+  if (!f) {
+    return false;
+  }
+  FileWriter w(f);
+  for (const Vec3 &v : mesh.vertices) {
+    w.Printf("v %g %g %g\n", v.x, v.y, v.z);
+  }
+  // OBJ indices start at 1
+  const size_t n = mesh.triangles ? 3 : 2;
+  const uint32_t *i = mesh.indices.data();
+  const uint32_t *end = i + mesh.indices.size();
+  for (; i + n <= end; i += n) {
+    if (n == 3) {
+      w.Printf("f %u %u %u\n", i[0] + 1, i[1] + 1, i[2] + 1);
+    } else {
+      w.Printf("l %u %u\n", i[0] + 1, i[1] + 1);
+    }
+  }
+  return MeshFile::Close(w, path, error);
+}
+
+// Binary little endian PLY, with an edge element for line meshes and a face
+// element for tubes. The vertex and edge data are written straight from the
+// mesh, which assumes a little endian host (as x86, ARM and WASM all are).
+bool WritePLY(const Mesh &mesh, const char *path, std::string *error) {
+  FILE *f = MeshFile::Open(path, error);
+  if (!f) {
+    return false;
+  }
+  FileWriter w(f);
+  const size_t n = mesh.triangles ? 3 : 2;
+  w.Printf("ply\nformat binary_little_endian 1.0\n");
+  w.Printf("element vertex %zu\n", mesh.vertices.size());
+  w.Printf("property float x\nproperty float y\nproperty float z\n");
+  if (mesh.triangles) {
+    w.Printf("element face %zu\n", mesh.indices.size() / n);
+    w.Printf("property list uchar uint vertex_indices\n");
+  } else {
+    w.Printf("element edge %zu\n", mesh.indices.size() / n);
+    w.Printf("property uint vertex1\nproperty uint vertex2\n");
+  }
+  w.Printf("end_header\n");
+
+  w.Write(mesh.vertices.data(), mesh.vertices.size() * sizeof(Vec3));
+  if (mesh.triangles) {
+    const uint8_t count = 3;
+    for (size_t i = 0; i + n <= mesh.indices.size(); i += n) {
+      w.Write(&count, 1);
+      w.Write(&mesh.indices[i], 3 * sizeof(uint32_t));
+    }
+  } else {
+    w.Write(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+  }
+  return MeshFile::Close(w, path, error);
+}
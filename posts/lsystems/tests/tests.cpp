@@ -0,0 +1,593 @@
+// Checks that the fast paths give the same answers as the plain ones they
+// replace. Built and run by make test, exits with 1 if any check fails.
+
+#include "examples.h"
+#include "lsystem.h"
+#include "serialize.h"
+#include "spatial.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+
+int g_checks = 0, g_failures = 0;
+
+void Check(bool ok, const std::string &what)
+{
+  ++g_checks;
+  if (!ok) {
+    std::cerr << "FAILED: " << what << '\n';
+    ++g_failures;
+  }
+}
+
+// Stages are only compared up to this length, to keep the run short
+const uint64_t MAX_LENGTH = 1 << 20;
+
+// Seeking (Length, Window and Expand) against generating the whole stage, for
+// every example that can seek
+void SeekMatchesGenerate()
+{
+  for (const Example &e : EXAMPLES) {
+    Demo d = MakeExample(e);
+    if (!d.ls.CanSeek()) {
+      continue;
+    }
+    LSystem seek = d.ls;
+    for (int stage = 0; stage <= d.max_stage; ++stage) {
+      const std::string value(d.ls.Generate(stage));
+      if (value.size() > MAX_LENGTH) {
+        break;
+      }
+      const std::string at =
+          std::string(e.name) + " stage " + std::to_string(stage);
+      Check(seek.Length(stage) == value.size(), at + ": Length");
+      for (uint64_t start : {(uint64_t)0, (uint64_t)value.size() / 3,
+                             (uint64_t)value.size() - 1}) {
+        Check(seek.Window(stage, start, 100) == value.substr(start, 100),
+              at + ": Window at " + std::to_string(start));
+      }
+      std::string expanded;
+      seek.Expand(stage, [&](std::string_view piece) { expanded += piece; });
+      Check(expanded == value, at + ": Expand");
+    }
+  }
+}
+
+bool SameRules(const std::vector<Rule> &a, const std::vector<Rule> &b)
+{
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].target != b[i].target or a[i].replacement != b[i].replacement or
+        a[i].left_context != b[i].left_context or
+        a[i].right_context != b[i].right_context or
+        a[i].probability != b[i].probability or
+        a[i].left_string != b[i].left_string or
+        a[i].right_string != b[i].right_string) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Every example saved with each stage encoding and loaded again. Building
+// them also checks their parametric rules parse (see MakeExample).
+void SaveLoadRoundTrip()
+{
+  const char *path = "fern-test.lsb";
+  for (const Example &e : EXAMPLES) {
+    for (StageEncoding encoding : {STAGE_NONE, STAGE_RAW, STAGE_PACKED}) {
+      Demo saved = MakeExample(e);
+      UpdateTurtleMap(saved.tm, saved.ls); // As LoadDemo does
+      const std::string at =
+          std::string(e.name) + " encoding " + std::to_string(encoding);
+      std::string error;
+      Demo loaded;
+      if (!SaveDemo(saved, encoding, path, &error) or
+          !LoadDemo(path, loaded, &error)) {
+        Check(false, at + ": " + error);
+        continue;
+      }
+      Check(loaded.ls.seed == saved.ls.seed and
+                SameRules(loaded.ls.rules, saved.ls.rules) and
+                loaded.ls.parametric_rules.size() ==
+                    saved.ls.parametric_rules.size() and
+                loaded.ls.rng_seed == saved.ls.rng_seed and
+                loaded.ls.ignore_list[0] == saved.ls.ignore_list[0] and
+                loaded.ls.ignore_list[1] == saved.ls.ignore_list[1],
+            at + ": system");
+      Check(loaded.tm == saved.tm and loaded.stroke == saved.stroke and
+                loaded.stage == saved.stage and
+                loaded.max_stage == saved.max_stage and
+                loaded.step_size == saved.step_size and
+                loaded.angle_delta == saved.angle_delta and
+                loaded.zoom == saved.zoom,
+            at + ": view and turtle");
+      // Open systems are only stepped by the turtle
+      if (!saved.ls.IsParametric() and
+          saved.ls.Length(saved.stage) <= MAX_LENGTH) {
+        Check(loaded.ls.Generate(loaded.stage) ==
+                  saved.ls.Generate(saved.stage),
+              at + ": stage " + std::to_string(saved.stage));
+      }
+    }
+  }
+  std::remove(path);
+
+  // A packed stage whose length wraps round when multiplied by its bits per
+  // symbol, which must be refused rather than allocated
+  Demo demo = MakeExample(EXAMPLES[0]);
+  std::string bytes = SaveDemo(demo, STAGE_PACKED);
+  const std::string_view value = demo.ls.Generate(demo.stage);
+  const std::string alphabet = "F+-[]";
+  const int bits = Serialize::BitsFor(alphabet.size());
+  const size_t n_words = (value.size() * bits + 63) / 64;
+  const size_t at = bytes.size() - n_words * 8 - 1 - alphabet.size() - 1 - 8;
+  uint64_t length;
+  memcpy(&length, &bytes[at], 8);
+  Check(length == value.size(), "packed stage length is where expected");
+  length = UINT64_MAX / bits + 1;
+  memcpy(&bytes[at], &length, 8);
+  std::string error;
+  Demo loaded;
+  Check(!LoadDemo(bytes.data(), bytes.size(), nullptr, loaded, &error),
+        "packed stage with a wrapping length");
+}
+
+// Edits to one rule of each example that can seek, applied with Update to a
+// generated stage, against generating the edited system from scratch. Each
+// edit is undone with Update too, which should give back the original.
+void UpdateMatchesReset()
+{
+  // A branch reads the same backwards once its brackets are swapped back
+  auto mirror = [](std::string s) {
+    std::reverse(s.begin(), s.end());
+    for (char &c : s) {
+      c = c == '[' ? ']' : c == ']' ? '[' : c;
+    }
+    return s;
+  };
+  for (const Example &e : EXAMPLES) {
+    const Demo d = MakeExample(e);
+    if (!d.ls.CanSeek()) {
+      continue;
+    }
+    LSystem original = d.ls;
+    int stage = 1;
+    while (stage < d.max_stage and original.Length(stage + 1) <= 1 << 16) {
+      ++stage;
+    }
+    const std::string before(original.Generate(stage));
+
+    for (size_t i = 0; i < d.ls.rules.size(); ++i) {
+      const Rule &rule = d.ls.rules[i];
+      const std::string edits[] = {
+          mirror(rule.replacement),
+          rule.replacement + rule.target,
+          d.ls.rules[(i + 1) % d.ls.rules.size()].replacement,
+      };
+      for (const std::string &edit : edits) {
+        const std::string at = std::string(e.name) + " rule " +
+                               std::to_string(i) + " -> " + edit;
+        LSystem updated = original;
+        updated.rules[i].replacement = edit;
+        updated.Update();
+        LSystem reset = updated;
+        reset.Reset();
+        Check(updated.m_stage == stage and
+                  updated.Value() == reset.Generate(stage),
+              at + ": Update");
+
+        updated.rules[i].replacement = rule.replacement;
+        updated.Update();
+        Check(updated.m_stage == stage and updated.Value() == before,
+              at + ": undone");
+      }
+    }
+  }
+}
+
+// The symbols a context is matched against, nearest first, found the slow way
+// by walking out from i and scanning for the bracket at the other end of each
+// branch (see LSystem::FindNeighbours for the rules)
+std::string LeftOf(const LSystem &ls, std::string_view v, size_t i)
+{
+  const bool branches = !ls.IsIgnored('[') and !ls.IsIgnored(']');
+  std::string out;
+  for (size_t j = i; j-- > 0;) {
+    if (ls.IsIgnored(v[j]) or v[j] == '[') {
+      continue;
+    }
+    if (v[j] == ']') {
+      int depth = 0;
+      size_t k = j;
+      while (k-- > 0 and !(v[k] == '[' and depth == 0)) {
+        depth += v[k] == ']' ? 1 : v[k] == '[' ? -1 : 0;
+      }
+      if (!branches or k == SIZE_MAX) {
+        break;
+      }
+      j = k;
+      continue;
+    }
+    out += v[j];
+  }
+  return out;
+}
+
+std::string RightOf(const LSystem &ls, std::string_view v, size_t i)
+{
+  const bool branches = !ls.IsIgnored('[') and !ls.IsIgnored(']');
+  std::string out;
+  for (size_t j = i + 1; j < v.size(); ++j) {
+    if (ls.IsIgnored(v[j])) {
+      continue;
+    }
+    if (v[j] == ']') {
+      break;
+    }
+    if (v[j] == '[') {
+      int depth = 0;
+      size_t k = j + 1;
+      for (; k < v.size() and !(v[k] == ']' and depth == 0); ++k) {
+        depth += v[k] == '[' ? 1 : v[k] == ']' ? -1 : 0;
+      }
+      if (!branches or k == v.size()) {
+        break;
+      }
+      j = k;
+      continue;
+    }
+    out += v[j];
+  }
+  return out;
+}
+
+// One step of a deterministic system, trying every rule's contexts against
+// every symbol's neighbours in turn
+std::string ReferenceStep(const LSystem &ls, std::string_view v)
+{
+  std::string out;
+  for (size_t i = 0; i < v.size(); ++i) {
+    const std::string left = LeftOf(ls, v, i), right = RightOf(ls, v, i);
+    const char c_l = left.empty() ? CON_END : left[0];
+    const char c_r = right.empty() ? CON_END : right[0];
+    const std::string reading(left.rbegin(), left.rend()); // Left, in order
+    const Rule *match = nullptr;
+    for (const Rule &r : ls.rules) {
+      const size_t l = r.left_string.size();
+      if (r.target == v[i] and ContextMatches(r.left_context, c_l) and
+          ContextMatches(r.right_context, c_r) and left.size() >= l and
+          reading.compare(left.size() - l, l, r.left_string) == 0 and
+          right.compare(0, r.right_string.size(), r.right_string) == 0) {
+        match = &r;
+        break;
+      }
+    }
+    out += match ? match->replacement : std::string(1, v[i]);
+  }
+  return out;
+}
+
+// Random deterministic systems with contexts of up to three symbols (but no
+// branches in them, see LSystem::RightTreeMatches), stepped by the automata
+// and by ReferenceStep
+void ContextsMatchReference()
+{
+  std::mt19937 rng(1);
+  auto pick = [&](const char *from) {
+    return from[rng() % strlen(from)];
+  };
+  // Balanced brackets, so most branches have both ends
+  auto random_string = [&](int max_length) {
+    std::string s;
+    int open = 0;
+    for (int n = 1 + rng() % max_length; n > 0; --n) {
+      const char c = pick("ABCABC+[]");
+      if (c == ']' and open == 0) {
+        continue;
+      }
+      open += c == '[' ? 1 : c == ']' ? -1 : 0;
+      s += c;
+    }
+    return s + std::string(open, ']');
+  };
+  // Mostly A and B, so longer contexts still match now and then
+  auto random_context = [&]() {
+    std::string s;
+    for (int n = rng() % 4; n > 0; --n) {
+      s += pick("AAB");
+    }
+    return s;
+  };
+
+  for (int system = 0; system < 1000; ++system) {
+    LSystem ls;
+    ls.seed = random_string(12);
+    for (int n = 1 + rng() % 4; n > 0; --n) {
+      Rule r;
+      r.target = pick("ABC");
+      r.replacement = random_string(5);
+      r.left_string = random_context();
+      r.right_string = random_context();
+      r.left_context = rng() % 2 ? CON_IGNORE : pick("ABC");
+      r.right_context = rng() % 2 ? CON_IGNORE : pick("ABC");
+      ls.rules.push_back(r);
+    }
+    if (rng() % 2) {
+      ls.AddIgnored('+');
+    }
+    if (rng() % 10 == 0) {
+      ls.AddIgnored(pick("[]"));
+    }
+    ls.Reset();
+    for (int stage = 1; stage <= 4 and ls.Value().size() < 1 << 14; ++stage) {
+      const std::string expected = ReferenceStep(ls, ls.Value());
+      ls.Step();
+      Check(ls.Value() == expected,
+            "system " + std::to_string(system) + " seed " + ls.seed +
+                " stage " + std::to_string(stage));
+    }
+  }
+}
+
+// Distance from p to the segment from a to b
+float Distance(Vec3 p, Vec3 a, Vec3 b)
+{
+  const Vec3 ab = b - a, ap = p - a;
+  const float t = std::clamp(Dot(ap, ab) / std::max(Dot(ab, ab), 1e-12f),
+                             0.0f, 1.0f);
+  const Vec3 d = ap - t * ab;
+  return sqrtf(Dot(d, d));
+}
+
+// Simplify on retraced and straight runs, which have known answers, then on
+// whole examples, where every original segment must lie along a simplified
+// one and the simplified ones must be no longer in total than the distinct
+// originals (so they cover nothing else).
+void SimplifyKeepsShape()
+{
+  const TurtleMap tm = {{'F', INS_MOVE_FORWARD}, {'+', INS_TURN_LEFT},
+                        {'-', INS_TURN_RIGHT},   {'[', INS_PUSH_POSITION},
+                        {']', INS_POP_POSITION}};
+  const std::pair<const char *, size_t> known[] = {
+      {"[F]F", 1}, {"FFFF", 1}, {"FF[+F]FF", 3}, {"F+F-F", 3}};
+  for (auto [instructions, segments] : known) {
+    Drawing d;
+    Interpret2D(instructions, tm, 0.125f, d);
+    Simplify(d);
+    Check(d.lines.indices.size() == 2 * segments,
+          std::string("simplified ") + instructions);
+  }
+
+  for (const Example &e : EXAMPLES) {
+    Demo demo = MakeExample(e);
+    if (demo.ls.IsParametric() or demo.ls.Length(demo.stage) > 1 << 12) {
+      continue;
+    }
+    Drawing d;
+    Interpret2D(demo.ls.Generate(demo.stage), demo.tm, demo.angle_delta, d);
+    Mesh simple = d.lines;
+    Simplify(simple);
+
+    auto length = [](const Mesh &m, size_t i) {
+      const Vec3 ab = m.vertices[m.indices[i + 1]] - m.vertices[m.indices[i]];
+      return sqrtf(Dot(ab, ab));
+    };
+    const float tolerance = 1e-3f;
+    bool covered = true;
+    double original_length = 0, simple_length = 0;
+    std::vector<std::pair<Vec3, Vec3>> seen;
+    for (size_t i = 0; i + 1 < d.lines.indices.size(); i += 2) {
+      const Vec3 a = d.lines.vertices[d.lines.indices[i]];
+      const Vec3 b = d.lines.vertices[d.lines.indices[i + 1]];
+      bool inside = false;
+      for (size_t j = 0; j + 1 < simple.indices.size() and !inside; j += 2) {
+        const Vec3 s_a = simple.vertices[simple.indices[j]];
+        const Vec3 s_b = simple.vertices[simple.indices[j + 1]];
+        inside = Distance(a, s_a, s_b) < tolerance and
+                 Distance(b, s_a, s_b) < tolerance;
+      }
+      covered &= inside or length(d.lines, i) < tolerance;
+      // Repeats, either way round, only count once
+      auto near = [&](Vec3 p, Vec3 q) { return Distance(p, q, q) < tolerance; };
+      bool repeat = false;
+      for (auto [s_a, s_b] : seen) {
+        repeat |= (near(a, s_a) and near(b, s_b)) or
+                  (near(a, s_b) and near(b, s_a));
+      }
+      if (!repeat) {
+        seen.push_back({a, b});
+        original_length += length(d.lines, i);
+      }
+    }
+    for (size_t j = 0; j + 1 < simple.indices.size(); j += 2) {
+      simple_length += length(simple, j);
+    }
+    Check(covered, std::string(e.name) + ": simplified covers the original");
+    Check(simple_length <= original_length + 1e-3 * original_length,
+          std::string(e.name) + ": simplified adds nothing");
+    Check(simple.indices.size() <= d.lines.indices.size(),
+          std::string(e.name) + ": simplified has no more segments");
+  }
+}
+
+// SegmentGrid::Nearest against trying every segment, over random short
+// segments with a few a hundred times longer, which must still only take the
+// cells along them
+void GridMatchesBruteForce()
+{
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> unit(0, 1);
+  for (int test = 0; test < 20; ++test) {
+    Mesh m;
+    for (int s = 0; s < 500; ++s) {
+      const Vec3 a = {100 * unit(rng), 100 * unit(rng), 0};
+      const float length = s % 50 == 0 ? 100 : 1;
+      const float angle = 6.283185307f * unit(rng);
+      const Vec3 b = a + length * Vec3{cosf(angle), sinf(angle), 0};
+      m.indices.push_back(m.vertices.size());
+      m.indices.push_back(m.vertices.size() + 1);
+      m.vertices.push_back(a);
+      m.vertices.push_back(b);
+    }
+    SegmentGrid grid;
+    grid.Build(m);
+    const std::string at = "grid " + std::to_string(test);
+    Check(grid.items.size() < 5 * m.indices.size() / 2, at + ": cells");
+
+    bool same = true;
+    for (int q = 0; q < 200; ++q) {
+      const Vec3 p = {120 * unit(rng) - 10, 120 * unit(rng) - 10, 0};
+      float best = 1000;
+      for (size_t i = 0; i < m.indices.size(); i += 2) {
+        best = std::min(best, SegmentGrid::Distance(p, m.vertices[i],
+                                                    m.vertices[i + 1]));
+      }
+      same &= grid.Nearest(p, UINT32_MAX, 1000) == best;
+    }
+    Check(same, at + ": nearest");
+  }
+}
+
+// IndexBrackets against a plain stack walk, over random strings with some
+// brackets left unmatched. The long ones are split between threads, so
+// pairs that cross from one thread's slice into another's are covered.
+void BracketsMatchReference()
+{
+  std::mt19937 rng(2);
+  const size_t SPLIT = 4 * LSystem::PARALLEL_STEP_LENGTH + 12345;
+  const size_t sizes[] = {0, 1, 2, 10, 100, 1000, SPLIT, SPLIT};
+  const int threads[] = {1, 1, 1, 1, 1, 1, 3, 4};
+  for (int test = 0; test < 8; ++test) {
+    LSystem ls;
+    ls.threads = threads[test];
+    ls.Reset();
+    std::string &value = ls.m_value;
+    value.clear();
+    for (size_t i = 0; i < sizes[test]; ++i) {
+      value += "[]F"[rng() % 3];
+    }
+
+    std::vector<uint64_t> expected(value.size(), LSystem::NO_BRACKET), open;
+    for (size_t i = 0; i < value.size(); ++i) {
+      if (value[i] == '[') {
+        open.push_back(i);
+      } else if (value[i] == ']' and !open.empty()) {
+        expected[i] = open.back();
+        expected[open.back()] = i;
+        open.pop_back();
+      }
+    }
+    ls.IndexBrackets();
+    Check(ls.m_brackets == expected,
+          "brackets of " + std::to_string(value.size()) + " symbols with " +
+              std::to_string(threads[test]) + " threads");
+  }
+}
+
+// Predict's length, symbol counts and stack depth against the generated
+// stage, for every example that can seek (the ones it's exact for). Stage 30
+// is too big to generate, but seeking knows its length, and its power takes
+// several squarings.
+void PredictMatchesGenerate()
+{
+  for (const Example &e : EXAMPLES) {
+    Demo d = MakeExample(e);
+    if (!d.ls.CanSeek()) {
+      continue;
+    }
+    for (int stage = 0; stage <= d.max_stage; ++stage) {
+      const std::string value(d.ls.Generate(stage));
+      if (value.size() > MAX_LENGTH) {
+        break;
+      }
+      const StageStats stats = d.ls.Predict(stage);
+      double counts[128] = {0};
+      int depth = 0, max_depth = 0;
+      for (char c : value) {
+        ++counts[(unsigned char)c];
+        depth += (c == '[') - (c == ']');
+        max_depth = std::max(max_depth, depth);
+      }
+      const std::string at =
+          std::string(e.name) + " stage " + std::to_string(stage);
+      Check(stats.exact and stats.length == value.size(), at + ": length");
+      Check(std::equal(counts, counts + 128, stats.counts), at + ": counts");
+      Check(stats.max_depth == max_depth, at + ": stack depth");
+    }
+    const uint64_t length = d.ls.Length(30);
+    if (length < 1ull << 53) {
+      Check(d.ls.Predict(30).length == length,
+            std::string(e.name) + " stage 30: length");
+    }
+  }
+}
+
+// A parametric system stepped to where its condition stops it, then rules
+// that must be rejected
+void ParametricRules()
+{
+  LSystem ls;
+  ls.seed = "F(1)";
+  ParametricRule rule;
+  std::string error;
+  Check(ParseParametricRule("F(l) : l > 0.2 -> F(l*0.5)G(l, 2)", &rule,
+                            &error),
+        "parametric rule: " + error);
+  ls.parametric_rules.push_back(rule);
+  ls.Reset();
+  Check(ls.Generate(4) == "FGGG", "parametric stage 4 symbols");
+  const ParamBuffer *params = ls.Params();
+  const float expected[4][2] = {{0.125f}, {0.25f, 2}, {0.5f, 2}, {1, 2}};
+  bool same = params != nullptr;
+  for (int i = 0; same and i < 4; ++i) {
+    same = params->Count(i) == (i == 0 ? 1 : 2);
+    for (int j = 0; same and j < params->Count(i); ++j) {
+      same = params->Get(i)[j] == expected[i][j];
+    }
+  }
+  Check(same, "parametric stage 4 parameters");
+
+  std::string many;
+  for (int i = 0; i <= MAX_ARITY; ++i) {
+    many += (i ? ",a" : "a") + std::to_string(i);
+  }
+  const std::string bad[] = {
+      "F() -> F()",       "F(x+1) -> F(x)",         "F(x, x) -> F(x)",
+      "F(1x) -> F(1)",    "F(x) -> F()",            "F(x) -> G(y)",
+      "F(x) G(x)",        "F(" + many + ") -> F(1)",
+  };
+  for (const std::string &text : bad) {
+    Check(!ParseParametricRule(text, &rule, &error),
+          "accepted a malformed rule: " + text);
+  }
+  Check(ParseParametricRule("F(x, y_2) -> F(y_2, x)", &rule, &error),
+        "rejected a rule with two names: " + error);
+}
+
+int main()
+{
+  SeekMatchesGenerate();
+  SaveLoadRoundTrip();
+  UpdateMatchesReset();
+  ContextsMatchReference();
+  PredictMatchesGenerate();
+  BracketsMatchReference();
+  SimplifyKeepsShape();
+  GridMatchesBruteForce();
+  ParametricRules();
+  if (g_failures > 0) {
+    std::cerr << g_failures << " of " << g_checks << " checks failed\n";
+    return 1;
+  }
+  std::cout << "All " << g_checks << " checks passed\n";
+  return 0;
+}